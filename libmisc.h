@@ -34,30 +34,52 @@ void log_cleanup(void);
 #define misc_timerEventAdd            timer_event_add
 #define misc_timerEventDelete         timer_event_delete
 #define misc_timerExecuteExpireEvents timer_execute_expire_events
+#define misc_timerEventAddPrio        timer_event_add_prio
+#define misc_timerSetBudget           timer_setBudget
+#define misc_timerHasExpired          timer_hasExpired
+#define misc_timerNextExpireMs        timer_nextExpireMs
+#define misc_timerSetDebug            timer_setDebug
+#define misc_timerDumpStats           timer_dumpStats
+
+#define TIMER_PRIO_HIGH    0
+#define TIMER_PRIO_NORMAL  1
+#define TIMER_PRIO_LOW     2
 
 typedef void (*event_func)(void*);
 int timer_init(void **timer_handle);
 void timer_cleanup(void **handle);
 int timer_event_add(void *handle, event_func func, void *ctx_data,
               int ms, const char *name);
+int timer_event_add_prio(void *handle, event_func func, void *ctx_data,
+                         int ms, const char *name, int prio);
 int timer_event_delete(void *handle, event_func func, void *ctx_data);
 void timer_execute_expire_events(void *handle);
+void timer_setBudget(void *handle, int max_events, int max_usec);
+int timer_hasExpired(void *handle);
+int timer_nextExpireMs(void *handle);
+void timer_setDebug(int on);
+void timer_dumpStats(void *handle, int fd);
+
+/* ------------------------------- loop -------------------------------------- */
+#include "misc_loop.h"
 
 /* ------------------------------- net -------------------------------------- */
 
 char *misc_getIpAddress(char *ifname);
+char *misc_getMacAddress(char *ifname);
+int misc_netCacheInit(void);
+int misc_netCacheFd(void);
+int misc_netCacheUpdate(void);
+void misc_netCacheCleanup(void);
 
 
 /* ------------------------------- util -------------------------------------- */
 
 #define SYSTEM misc_system
 
-void misc_procEp(char *pidfile);
-void misc_printFile(char *format, ...);
-void misc_printConsole(const char *format, ...);
-void misc_pipeCmd(char *command, char **output);
-void misc_system(const char *format, ...);
-int misc_isNullStr(const char *str);
-int misc_selSleep(int sec);
+#include "misc_util.h"
+
+/* ------------------------------- spawn ------------------------------------- */
+#include "misc_spawn.h"
 
 #endif /* _LIBMISC_H_ */
@@ -0,0 +1,268 @@
+/**
+ * @file   misc_arena.c
+ *
+ * @brief  Size class allocator for shared memory, offset based.
+ *
+ * Layout: the header, then blocks. Every block starts with 8 bytes
+ * telling its class and whether it is in use, which catches double
+ * frees and bad offsets. A free block holds the offset of the next
+ * free one of its class.
+ *
+ * The lock is a futex word (0 free, 1 locked, 2 locked with waiters),
+ * not a private one since the waiters are in other processes.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "misc_arena.h"
+
+#define ARENA_MAGIC     0x4152454e      /* "AREN" */
+#define ARENA_VERSION   1
+#define ARENA_INITING   1               /* state while formatting */
+#define ARENA_READY     2
+#define ARENA_BLK_USED  0x55534544      /* "USED" */
+#define ARENA_BLK_FREE  0x46524545      /* "FREE" */
+#define ARENA_MIN_CLASS 16
+
+typedef struct arenaBlock
+{
+    unsigned int cls;
+    unsigned int tag;                   /**< ARENA_BLK_XXX */
+} arenaBlock_t;
+
+typedef struct arenaHdr
+{
+    volatile unsigned int state;        /**< 0, ARENA_INITING, ARENA_READY */
+    unsigned int          magic;
+    unsigned int          version;
+    unsigned int          size;
+    volatile int          lock;
+    unsigned int          top;          /**< first byte never carved */
+    volatile unsigned int root;
+    unsigned int          allocs;
+    unsigned int          frees;
+    unsigned int          failures;
+    unsigned int          inUseBytes;
+    unsigned int          peakBytes;
+    unsigned int          freeHead[MISC_ARENA_CLASSES];
+    unsigned int          inUse[MISC_ARENA_CLASSES];
+    unsigned int          freeCount[MISC_ARENA_CLASSES];
+} arenaHdr_t;
+
+/* the first block starts there */
+#define ARENA_HDR_SIZE  ((sizeof(arenaHdr_t) + 7) & ~7)
+
+/* 16, 24, 32, 48, 64, 96 ... 1MB, header included */
+static unsigned int arenaClassSize(int cls)
+{
+    unsigned int size = ARENA_MIN_CLASS << (cls / 2);
+
+    return (cls & 1) ? size + size / 2 : size;
+}
+
+static int arenaClass(size_t size)
+{
+    int cls;
+
+    size += sizeof(arenaBlock_t);
+    for(cls = 0; cls < MISC_ARENA_CLASSES; cls++)
+    {
+        if(arenaClassSize(cls) >= size)
+            return cls;
+    }
+
+    return -1;
+}
+
+static void arenaLock(arenaHdr_t *ah)
+{
+    int c;
+
+    if((c = __sync_val_compare_and_swap(&ah->lock, 0, 1)) == 0)
+        return;
+
+    do
+    {
+        /* mark it contended, then sleep until it is released */
+        if(c == 2 || __sync_val_compare_and_swap(&ah->lock, 1, 2) != 0)
+            syscall(SYS_futex, &ah->lock, FUTEX_WAIT, 2, NULL, NULL, 0);
+    } while((c = __sync_val_compare_and_swap(&ah->lock, 0, 2)) != 0);
+}
+
+static void arenaUnlock(arenaHdr_t *ah)
+{
+    if(__sync_fetch_and_sub(&ah->lock, 1) != 1)
+    {
+        ah->lock = 0;
+        __sync_synchronize();
+        syscall(SYS_futex, &ah->lock, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+void *misc_arenaOpen(void *mem, size_t size)
+{
+    arenaHdr_t *ah = mem;
+
+    if(size < ARENA_HDR_SIZE + ARENA_MIN_CLASS || size > 0xffffffffUL ||
+       ((unsigned long)mem & 7) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(__sync_bool_compare_and_swap(&ah->state, 0, ARENA_INITING))
+    {
+        ah->magic = ARENA_MAGIC;
+        ah->version = ARENA_VERSION;
+        ah->size = size;
+        ah->top = ARENA_HDR_SIZE;
+        __sync_synchronize();
+        ah->state = ARENA_READY;
+    }
+
+    while(ah->state == ARENA_INITING)
+        sched_yield();
+    __sync_synchronize();
+
+    if(ah->state != ARENA_READY || ah->magic != ARENA_MAGIC ||
+       ah->version != ARENA_VERSION)
+    {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return ah;
+}
+
+miscArenaOff_t misc_arenaAlloc(void *arena, size_t size)
+{
+    arenaHdr_t *ah = arena;
+    arenaBlock_t *blk;
+    unsigned int off = 0, bytes;
+    int cls;
+
+    if(size == 0 || (cls = arenaClass(size)) < 0)
+    {
+        __sync_fetch_and_add(&ah->failures, 1);
+        return 0;
+    }
+    bytes = arenaClassSize(cls);
+
+    arenaLock(ah);
+
+    if((off = ah->freeHead[cls]) != 0)
+    {
+        blk = (arenaBlock_t *)((char *)ah + off);
+        ah->freeHead[cls] = *(unsigned int *)(blk + 1);
+        ah->freeCount[cls]--;
+    }
+    else if(ah->size - ah->top >= bytes)
+    {
+        off = ah->top;
+        ah->top += bytes;
+        blk = (arenaBlock_t *)((char *)ah + off);
+        blk->cls = cls;
+    }
+
+    if(off != 0)
+    {
+        blk->tag = ARENA_BLK_USED;
+        ah->inUse[cls]++;
+        ah->allocs++;
+        ah->inUseBytes += bytes;
+        if(ah->inUseBytes > ah->peakBytes)
+            ah->peakBytes = ah->inUseBytes;
+        off += sizeof(arenaBlock_t);
+    }
+    else
+        ah->failures++;
+
+    arenaUnlock(ah);
+
+    return off;
+}
+
+void misc_arenaFree(void *arena, miscArenaOff_t off)
+{
+    arenaHdr_t *ah = arena;
+    arenaBlock_t *blk;
+    unsigned int cls;
+
+    if(off == 0)
+        return;
+
+    /* checked under the lock: a racing double free must not pass too */
+    arenaLock(ah);
+
+    blk = (arenaBlock_t *)((char *)ah + off) - 1;
+    if(off < ARENA_HDR_SIZE + sizeof(arenaBlock_t) || (off & 7) != 0 ||
+       off >= ah->top || blk->tag != ARENA_BLK_USED ||
+       blk->cls >= MISC_ARENA_CLASSES)
+    {
+        arenaUnlock(ah);
+        fprintf(stderr, "misc_arenaFree: bad offset %u\n", off);
+        return;
+    }
+    cls = blk->cls;
+
+    blk->tag = ARENA_BLK_FREE;
+    *(unsigned int *)(blk + 1) = ah->freeHead[cls];
+    ah->freeHead[cls] = off - sizeof(arenaBlock_t);
+    ah->freeCount[cls]++;
+    ah->inUse[cls]--;
+    ah->frees++;
+    ah->inUseBytes -= arenaClassSize(cls);
+
+    arenaUnlock(ah);
+}
+
+miscArenaOff_t misc_arenaOff(void *arena, const void *ptr)
+{
+    return ptr != NULL ? (miscArenaOff_t)((const char *)ptr - (char *)arena) : 0;
+}
+
+void misc_arenaSetRoot(void *arena, miscArenaOff_t off)
+{
+    __sync_synchronize();
+    ((arenaHdr_t *)arena)->root = off;
+}
+
+miscArenaOff_t misc_arenaGetRoot(void *arena)
+{
+    miscArenaOff_t off = ((arenaHdr_t *)arena)->root;
+
+    __sync_synchronize();
+
+    return off;
+}
+
+int misc_arenaStats(void *arena, miscArenaStats_t *stats)
+{
+    arenaHdr_t *ah = arena;
+    int cls;
+
+    arenaLock(ah);
+
+    stats->size = ah->size;
+    stats->carved = ah->top;
+    stats->inUseBytes = ah->inUseBytes;
+    stats->peakBytes = ah->peakBytes;
+    stats->allocs = ah->allocs;
+    stats->frees = ah->frees;
+    stats->failures = ah->failures;
+    for(cls = 0; cls < MISC_ARENA_CLASSES; cls++)
+    {
+        stats->classes[cls].size = arenaClassSize(cls) - sizeof(arenaBlock_t);
+        stats->classes[cls].inUse = ah->inUse[cls];
+        stats->classes[cls].free = ah->freeCount[cls];
+    }
+
+    arenaUnlock(ah);
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef _MISC_ARENA_H_
+#define _MISC_ARENA_H_
+
+#include <stddef.h>
+
+/**
+ * Allocator working inside a memory block shared between processes,
+ * e.g. an oil_shmOpen() region. Allocations are handed out as offsets
+ * from the arena start rather than pointers, so structures built in it
+ * (lists, hash tables, queues linking offsets) are valid in every
+ * process whatever the address it is mapped at:
+ *
+ *     arena = misc_arenaOpen(oil_shmAddr(region), oil_shmSize(region));
+ *     off = misc_arenaAlloc(arena, sizeof(node_t));
+ *     node = MISC_ARENA_PTR(arena, off);
+ *     node->next = head;
+ *     misc_arenaSetRoot(arena, off);
+ *
+ * Blocks are taken from per size class free lists, or carved from the
+ * unused end of the arena. Freed blocks go back to their class list and
+ * are not merged, so the arena suits many objects of a few sizes. A
+ * futex word in the arena serializes the allocations of all processes.
+ */
+
+/** Offset of an allocation, 0 is the NULL offset */
+typedef unsigned int miscArenaOff_t;
+
+#define MISC_ARENA_CLASSES  33      /**< 16 bytes to 1MB blocks */
+#define MISC_ARENA_MAX_ALLOC (1024 * 1024 - 8)
+
+#define MISC_ARENA_PTR(arena, off) \
+    ((off) != 0 ? (void *)((char *)(arena) + (off)) : NULL)
+
+typedef struct miscArenaClass
+{
+    unsigned int size;              /**< bytes usable */
+    unsigned int inUse;             /**< blocks allocated */
+    unsigned int free;              /**< blocks on the free list */
+} miscArenaClass_t;
+
+typedef struct miscArenaStats
+{
+    unsigned int     size;          /**< arena bytes */
+    unsigned int     carved;        /**< bytes handed to the size classes */
+    unsigned int     inUseBytes;    /**< block bytes allocated */
+    unsigned int     peakBytes;
+    unsigned int     allocs;
+    unsigned int     frees;
+    unsigned int     failures;      /**< allocations which failed */
+    miscArenaClass_t classes[MISC_ARENA_CLASSES];
+} miscArenaStats_t;
+
+/**
+ * Format mem as an arena, or attach to the arena already in it. mem
+ * must be zero filled the first time, which a new shared memory region
+ * is; when several processes open it at once, one formats it and the
+ * others wait.
+ *
+ * @param mem 8 bytes aligned
+ * @param size at most 4GB
+ *
+ * @return the arena (mem), NULL if too small or holding something else
+ */
+void *misc_arenaOpen(void *mem, size_t size);
+
+/**
+ * @return offset of size bytes, 8 bytes aligned, 0 if out of memory
+ */
+miscArenaOff_t misc_arenaAlloc(void *arena, size_t size);
+
+void misc_arenaFree(void *arena, miscArenaOff_t off);
+
+miscArenaOff_t misc_arenaOff(void *arena, const void *ptr);
+
+/**
+ * An offset stored in the arena header, to find the data structure
+ * built in it from another process.
+ */
+void misc_arenaSetRoot(void *arena, miscArenaOff_t off);
+miscArenaOff_t misc_arenaGetRoot(void *arena);
+
+int misc_arenaStats(void *arena, miscArenaStats_t *stats);
+
+#endif
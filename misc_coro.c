@@ -0,0 +1,95 @@
+/**
+ * @file   misc_coro.c
+ *
+ * @brief  Glue between the protothreads of misc_coro.h and misc_loop,
+ *         the timer or fd callback just re-enters the coroutine.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "misc_timer.h"
+#include "misc_loop.h"
+#include "misc_coro.h"
+
+static void coroTimerResume(void *ctxArg)
+{
+    miscCoro_t *co = (miscCoro_t *)ctxArg;
+
+    co->sleeping = 0;
+    misc_coroResume(co);
+}
+
+static void coroFdResume(int fd, int events, void *ctxArg)
+{
+    miscCoro_t *co = (miscCoro_t *)ctxArg;
+
+    misc_loopDelFd(co->loop, fd);
+    co->fd = -1;
+    co->events = events;
+    misc_coroResume(co);
+}
+
+int misc_coroStart(miscCoro_t *co, void *loop, miscCoroFunc_t func,
+                   void *ctxArg, miscCoroDoneFunc_t done)
+{
+    co->lc = 0;
+    co->func = func;
+    co->done = done;
+    co->loop = loop;
+    co->ctxArg = ctxArg;
+    co->fd = -1;
+    co->events = 0;
+    co->sleeping = 0;
+    co->err = 0;
+
+    return misc_coroResume(co);
+}
+
+int misc_coroResume(miscCoro_t *co)
+{
+    int ret;
+
+    ret = (co->func)(co);
+
+    /* done may free co, don't touch it afterwards */
+    if(ret == MCORO_ENDED && co->done != NULL)
+        (co->done)(co);
+
+    return ret;
+}
+
+void misc_coroCancel(miscCoro_t *co)
+{
+    if(co->sleeping)
+    {
+        timer_event_delete(misc_loopTimer(co->loop), coroTimerResume, co);
+        co->sleeping = 0;
+    }
+
+    if(co->fd >= 0)
+    {
+        misc_loopDelFd(co->loop, co->fd);
+        co->fd = -1;
+    }
+}
+
+int misc_coroArmSleep(miscCoro_t *co, int ms)
+{
+    co->err = timer_event_add(misc_loopTimer(co->loop), coroTimerResume,
+                              co, ms, "coro");
+    if(co->err == 0)
+        co->sleeping = 1;
+
+    return co->err;
+}
+
+int misc_coroArmFd(miscCoro_t *co, int fd, int readable)
+{
+    co->err = misc_loopAddFd(co->loop, fd,
+                             readable ? MISC_LOOP_READ : MISC_LOOP_WRITE,
+                             coroFdResume, co);
+    if(co->err == 0)
+        co->fd = fd;
+
+    return co->err;
+}
@@ -0,0 +1,132 @@
+#ifndef _MISC_CORO_H_
+#define _MISC_CORO_H_
+
+/**
+ * Stackless coroutines (protothreads) driven by misc_loop.
+ *
+ * A coroutine is a function taking its miscCoro_t and written between
+ * MCORO_BEGIN() and MCORO_END(). Waiting returns from the function,
+ * the loop calls it again when the timer or fd is ready and the
+ * switch jumps back to the wait point. The state is therefore just
+ * the miscCoro_t, usually the first member of a session struct:
+ *
+ *     typedef struct { miscCoro_t co; int fd; int retry; } session_t;
+ *
+ *     static int sessionRun(miscCoro_t *co)
+ *     {
+ *         session_t *s = (session_t *)co;
+ *
+ *         MCORO_BEGIN(co);
+ *         for(s->retry = 0; s->retry < 3; s->retry++)
+ *         {
+ *             MCORO_WAIT_READABLE(co, s->fd);
+ *             ...
+ *             MCORO_SLEEP(co, 100);
+ *         }
+ *         MCORO_END(co);
+ *     }
+ *
+ * Local variables are NOT kept across a wait, keep them in the session
+ * struct. A switch statement can't span a wait either.
+ */
+
+#define MCORO_WAITING  0
+#define MCORO_ENDED    1
+
+typedef struct miscCoro miscCoro_t;
+
+typedef int (*miscCoroFunc_t)(miscCoro_t *co);
+typedef void (*miscCoroDoneFunc_t)(miscCoro_t *co);
+
+struct miscCoro
+{
+    unsigned short      lc;      /**< resume point, 0 is the start */
+    miscCoroFunc_t      func;
+    miscCoroDoneFunc_t  done;    /**< called once func ended, or NULL */
+    void               *loop;    /**< misc_loop handle */
+    void               *ctxArg;
+    int                 fd;      /**< fd waited for, -1 if none */
+    int                 events;  /**< MISC_LOOP_XXX flags of the last fd wait */
+    int                 sleeping;
+    int                 err;     /**< set if the last wait could not be armed */
+};
+
+#define MCORO_BEGIN(co)  switch((co)->lc) { case 0:
+
+#define MCORO_END(co)    } (co)->lc = 0; return MCORO_ENDED
+
+/** Return to the loop, resumed on the next misc_coroResume() */
+#define MCORO_YIELD(co)                          \
+    do {                                         \
+        (co)->lc = __LINE__;                     \
+        return MCORO_WAITING;                    \
+        case __LINE__:;                          \
+    } while(0)
+
+/** Wait until cond is true, re-checked on every resume */
+#define MCORO_WAIT_UNTIL(co, cond)               \
+    do {                                         \
+        (co)->lc = __LINE__;                     \
+        case __LINE__:                           \
+        if(!(cond))                              \
+            return MCORO_WAITING;                \
+    } while(0)
+
+/** Sleep for ms, backed by the timer of the loop */
+#define MCORO_SLEEP(co, ms)                      \
+    do {                                         \
+        (co)->lc = __LINE__;                     \
+        if(misc_coroArmSleep((co), (ms)) == 0)   \
+            return MCORO_WAITING;                \
+        case __LINE__:;                          \
+    } while(0)
+
+/** Wait until fd is readable, (co)->events holds the ready flags */
+#define MCORO_WAIT_READABLE(co, fd)              \
+    do {                                         \
+        (co)->lc = __LINE__;                     \
+        if(misc_coroArmFd((co), (fd), 1) == 0)   \
+            return MCORO_WAITING;                \
+        case __LINE__:;                          \
+    } while(0)
+
+/** Wait until fd is writable */
+#define MCORO_WAIT_WRITABLE(co, fd)              \
+    do {                                         \
+        (co)->lc = __LINE__;                     \
+        if(misc_coroArmFd((co), (fd), 0) == 0)   \
+            return MCORO_WAITING;                \
+        case __LINE__:;                          \
+    } while(0)
+
+/**
+ * Start a coroutine, it runs until its first wait before returning.
+ *
+ * @param co coroutine state, must stay valid until it ended
+ * @param loop misc_loop handle
+ * @param func
+ * @param ctxArg
+ * @param done called when func ended, e.g. to free the session
+ *
+ * @return MCORO_WAITING or MCORO_ENDED
+ */
+int misc_coroStart(miscCoro_t *co, void *loop, miscCoroFunc_t func,
+                   void *ctxArg, miscCoroDoneFunc_t done);
+
+/**
+ * Run a coroutine up to its next wait, used for MCORO_YIELD and
+ * MCORO_WAIT_UNTIL which have no event of their own.
+ */
+int misc_coroResume(miscCoro_t *co);
+
+/**
+ * Drop the pending timer or fd wait, the coroutine is not resumed
+ * anymore and done is not called.
+ */
+void misc_coroCancel(miscCoro_t *co);
+
+/* used by the MCORO_XXX macros */
+int misc_coroArmSleep(miscCoro_t *co, int ms);
+int misc_coroArmFd(miscCoro_t *co, int fd, int readable);
+
+#endif
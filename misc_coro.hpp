@@ -0,0 +1,132 @@
+#ifndef _MISC_CORO_HPP_
+#define _MISC_CORO_HPP_
+
+/**
+ * C++20 coroutines on top of misc_loop, the C++ flavour of
+ * misc_coro.h. Locals live in the coroutine frame, so no session
+ * struct is needed:
+ *
+ *     misc::Task session(void *loop, int fd)
+ *     {
+ *         for(int retry = 0; retry < 3; retry++)
+ *         {
+ *             int ev = co_await misc::readable(loop, fd);
+ *             ...
+ *             co_await misc::sleepMs(loop, 100);
+ *         }
+ *     }
+ *
+ * A Task starts running when called and frees its frame when it
+ * returns. The loop must outlive every suspended task.
+ */
+
+#if __cplusplus < 202002L
+#error "misc_coro.hpp needs C++20, use misc_coro.h from C"
+#endif
+
+#include <coroutine>
+#include <exception>
+
+extern "C" {
+#include "misc_timer.h"
+#include "misc_loop.h"
+}
+
+namespace misc {
+
+/** Fire and forget coroutine */
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() noexcept { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+/** co_await result: 0, or -1 if the timer could not be armed */
+class SleepAwaiter
+{
+public:
+    SleepAwaiter(void *loop, int ms) : loop_(loop), ms_(ms), err_(0) {}
+
+    bool await_ready() const noexcept { return ms_ < 0; }
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        handle_ = h;
+        err_ = timer_event_add(misc_loopTimer(loop_), &SleepAwaiter::onTimer,
+                               this, ms_, "coro");
+        /* not suspended if arming failed */
+        return err_ == 0;
+    }
+
+    int await_resume() const noexcept { return err_; }
+
+private:
+    static void onTimer(void *ctxArg)
+    {
+        static_cast<SleepAwaiter *>(ctxArg)->handle_.resume();
+    }
+
+    void                    *loop_;
+    int                      ms_;
+    int                      err_;
+    std::coroutine_handle<>  handle_;
+};
+
+/** co_await result: the MISC_LOOP_XXX flags ready, or -1 on error */
+class FdAwaiter
+{
+public:
+    FdAwaiter(void *loop, int fd, int events)
+        : loop_(loop), fd_(fd), events_(events), result_(-1) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        handle_ = h;
+        return misc_loopAddFd(loop_, fd_, events_, &FdAwaiter::onFd, this) == 0;
+    }
+
+    int await_resume() const noexcept { return result_; }
+
+private:
+    static void onFd(int fd, int events, void *ctxArg)
+    {
+        FdAwaiter *self = static_cast<FdAwaiter *>(ctxArg);
+
+        misc_loopDelFd(self->loop_, fd);
+        self->result_ = events;
+        self->handle_.resume();
+    }
+
+    void                    *loop_;
+    int                      fd_;
+    int                      events_;
+    int                      result_;
+    std::coroutine_handle<>  handle_;
+};
+
+inline SleepAwaiter sleepMs(void *loop, int ms)
+{
+    return SleepAwaiter(loop, ms);
+}
+
+inline FdAwaiter readable(void *loop, int fd)
+{
+    return FdAwaiter(loop, fd, MISC_LOOP_READ);
+}
+
+inline FdAwaiter writable(void *loop, int fd)
+{
+    return FdAwaiter(loop, fd, MISC_LOOP_WRITE);
+}
+
+} /* namespace misc */
+
+#endif
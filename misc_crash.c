@@ -21,6 +21,7 @@
 #endif
 
 #include "misc_crash.h"
+#include "misc_proc.h"
 
 #define NIY()	printf("%s: Not Implemented Yet!\n", __FUNCTION__)
 
@@ -32,6 +33,9 @@ static void **gbl_backtraceBuffer;
 static char **gbl_backtraceSymbols;
 static int    gbl_backtraceDoneFlag = 0;
 
+/* /proc files are read here from the signal handler, no malloc */
+static char   gbl_procBuf[4096];
+
 /*!
  * Output text to a fd, looping to avoid being interrupted.
  *
@@ -161,20 +165,24 @@ static void outputFini( void )
 
 static void outputFile(char *file)
 {
-    FILE *fp;
-    char buf[1024];
+    miscProcLines_t pl;
+    char *line;
+    int len;
 
     outputPrintf("mCrash dumping file: %s\n", file);
     
-    if((fp = fopen(file, "r")) == NULL)
+    if(misc_procLinesOpen(&pl, file, gbl_procBuf, sizeof(gbl_procBuf)) < 0)
         return;
 
-    while(fgets(buf, sizeof(buf), fp) != NULL)
+    while((line = misc_procLinesNext(&pl)) != NULL)
     {
-        outputPrintf(buf);
+        /* the stat line is longer than what outputPrintf() takes */
+        for(len = strlen(line); len > MAX_LINE_LEN / 2;
+            line += MAX_LINE_LEN / 2, len -= MAX_LINE_LEN / 2)
+            outputPrintf("%.*s", MAX_LINE_LEN / 2, line);
+        outputPrintf(pl.split ? "%s" : "%s\n", line);
     }
-
-    fclose(fp);
+    misc_procLinesClose(&pl);
 
     outputPrintf("\n");
 }
@@ -291,14 +299,13 @@ static void outputBacktrace(int signo, siginfo_t *siginfo, void *uc)
 
     outputCmd("ps");
     
-    snprintf(procFile, sizeof(procFile), "/proc/meminfo");
-    outputFile(procFile);    
+    outputFile("/proc/meminfo");
     
-    snprintf(procFile, sizeof(procFile), "/proc/%ld/stat", (long)pid);
-    outputFile(procFile);
+    if(misc_procPath(procFile, sizeof(procFile), pid, "stat") != NULL)
+        outputFile(procFile);
     
-    snprintf(procFile, sizeof(procFile), "/proc/%ld/maps", (long)pid);
-    outputFile(procFile);
+    if(misc_procPath(procFile, sizeof(procFile), pid, "maps") != NULL)
+        outputFile(procFile);
 
 	outputPrintf("************************************************************\n");
 	outputPrintf("*               mCrash BackTrace Dump\n");
@@ -395,19 +402,14 @@ int miscCrash_init(mCrashParameters_t *params)
 static char *miscCrash_getProcName(pid_t pid)
 {
     static char curProcessName[MAX_LINE_LEN];
-    FILE *fp;
-    char pmapFile[64];
+    miscProcStat_t st;
     char buf[1024];
     
-    snprintf(pmapFile, sizeof(pmapFile), "/proc/%ld/stat", (long)pid);
-    if((fp = fopen(pmapFile, "r")) == NULL)
-        return NULL;
-
-    if(fgets(buf, sizeof(buf), fp) == NULL)
+    if(misc_procStat(pid, &st, buf, sizeof(buf)) != 0)
         return NULL;
 
     memset(curProcessName, 0, sizeof(curProcessName));
-    sscanf(buf, "%*[^(](%[^)]", curProcessName);
+    strncpy(curProcessName, st.comm, sizeof(curProcessName) - 1);
 
     return curProcessName;
 }
@@ -7,6 +7,7 @@
 
 #include "misc_oil.h"
 #include "misc_log.h"
+#include "misc_seqlock.h"
 
 /* #define SHM_SUPPORT */
 
@@ -39,7 +40,18 @@ typedef struct logAttr_s {
 }logAttr_t;
 
 #ifdef SHM_SUPPORT
+/*
+ * The shared table is published through a seqlock latch: log_log()
+ * works on a local copy of our entry, refreshed when the latch version
+ * moved, and only writes the table when our attributes changed.
+ */
+static logAttr_t logAttr;
 static logAttr_t *logAttribute = NULL;
+static void *gbl_logShm = NULL;
+static void *gbl_logLatch = NULL;
+static int gbl_logIdx = -1;
+static unsigned int gbl_logVersion;
+static logAttr_t gbl_logTable[MAX_LOG_ENTITY];
 #else
 static logAttr_t logAttr;
 static logAttr_t *logAttribute = &logAttr;
@@ -58,31 +70,58 @@ static inline char *get_appLogAttr(char *appName, char *attrPendix)
     return val;
 }
 
+#ifdef SHM_SUPPORT
+static void refreshLogAttr(void)
+{
+    if(misc_seqlockVersion(gbl_logLatch) == gbl_logVersion)
+        return;
+
+    gbl_logVersion = misc_seqlockRead(gbl_logLatch, gbl_logTable);
+    logAttr = gbl_logTable[gbl_logIdx];
+}
+
+static void setLogEntity(void *data, void *ctxArg)
+{
+    ((logAttr_t *)data)[gbl_logIdx] = *(logAttr_t *)ctxArg;
+}
+#endif
+
 static void updateLogAttr(void)
 {
     char *s;
-    char *appName = logAttribute->logApplicationName;
+    logAttr_t attr = *logAttribute;
+    char *appName = attr.logApplicationName;
     
     if((s = get_appLogAttr(appName, "log_level")) == NULL)
-        logAttribute->logLevel = DEFAULT_LOG_LEVEL;
+        attr.logLevel = DEFAULT_LOG_LEVEL;
     else
     {
-        logAttribute->logLevel = atoi(s);
+        attr.logLevel = atoi(s);
     }
     
     if((s = get_appLogAttr(appName, "log_dest")) == NULL)
-        logAttribute->logDestination = DEFAULT_LOG_DESTINATION;
+        attr.logDestination = DEFAULT_LOG_DESTINATION;
     else
     {
-        logAttribute->logDestination = atoi(s);
+        attr.logDestination = atoi(s);
     }
 
     if((s = get_appLogAttr(appName, "log_mask")) == NULL)
-        logAttribute->logHeaderMask = DEFAULT_LOG_HEADER_MASK;
+        attr.logHeaderMask = DEFAULT_LOG_HEADER_MASK;
     else
     {
-        logAttribute->logHeaderMask = atoi(s);
+        attr.logHeaderMask = atoi(s);
     }
+
+    if(attr.logLevel == logAttribute->logLevel &&
+       attr.logDestination == logAttribute->logDestination &&
+       attr.logHeaderMask == logAttribute->logHeaderMask)
+        return;
+
+#ifdef SHM_SUPPORT
+    misc_seqlockUpdate(gbl_logLatch, setLogEntity, &attr);
+#endif
+    *logAttribute = attr;
 }
 
 void log_log(logLevel_t level, const char *func, int line, const char *fmt, ... )
@@ -103,6 +142,9 @@ void log_log(logLevel_t level, const char *func, int line, const char *fmt, ...
    if(logAttribute == NULL)
        return;
    
+#ifdef SHM_SUPPORT
+   refreshLogAttr();
+#endif
    updateLogAttr();
    
    maxLen = sizeof(buf);
@@ -245,13 +287,23 @@ static logAttr_t *initLogEntity(char *appName, logAttr_t *logAttrArray)
     return logAttr;
 }
 
+#ifdef SHM_SUPPORT
+/* find or claim our entry, other processes may be claiming theirs */
+static void claimLogEntity(void *data, void *ctxArg)
+{
+    logAttr_t *logAttrArray = data;
+    logAttr_t *entity;
+
+    if((entity = initLogEntity(ctxArg, logAttrArray)) != NULL)
+        gbl_logIdx = entity - logAttrArray;
+}
+#endif
+
 void log_init(char *appname)
 {
-    int shmId = UNINITIALIZED_SHM_ID;
-    int ret;
+#ifdef SHM_SUPPORT
     void *shmAddr;
-    FILE *fp;
-    char buf[32];
+#endif
     char *s, *appName = appname;
 
     for (s = appname; *s != '\0';)
@@ -261,54 +313,35 @@ void log_init(char *appname)
     }    
     
 #ifdef SHM_SUPPORT
-    if(access(LOG_SHM_FILE, F_OK) == 0)
+    /* the first process creates it zero filled, the others attach */
+    if(oil_shmOpen(&gbl_logShm, LOG_SHM_NAME,
+                   misc_seqlockSize(sizeof(logAttr_t)*MAX_LOG_ENTITY),
+                   LOG_SHM_VERSION, OIL_SHM_CREATE) != 0)
     {
-        if((fp = fopen(LOG_SHM_FILE, "r")) == NULL)
-            return;
-        fread(buf, sizeof(buf), 1, fp);
-        fclose(fp);
-        
-        shmId = atoi(line);
-
-#ifdef F_DEBUG
-        printf("%s %s %d shmId = %d\n",
-               __FUNCTION__, __FILE__, __LINE__,
-               shmId);
-#endif        
-        ret = oil_shmInit(sizeof(logAttr_t)*MAX_LOG_ENTITY, &shmId, &shmAddr);
-        if(ret != 0)
-        {
-            printf("oil_shmInit error\n");
-            return;
-        }
+        printf("oil_shmOpen error\n");
+        return;
     }
-    else
-    {
-        /* first initialize */
-        ret = oil_shmInit(sizeof(logAttr_t)*MAX_LOG_ENTITY, &shmId, &shmAddr);
-        if(ret != 0)
-        {
-            printf("oil_shmInit initialize error\n");
-            return;
-        }        
+    shmAddr = oil_shmAddr(gbl_logShm);
 
 #ifdef F_DEBUG
-        printf("%s %s %d shmId = %d, shmAddr = 0x%x\n",
-               __FUNCTION__, __FILE__, __LINE__,
-               shmId, shmAddr);
-#endif        
-        if((fp = fopen(LOG_SHM_FILE, "w")) == NULL)
-            return;
-        fprintf(fp, "%d", shmId);
-        fclose(fp);
-        
-        memset(shmAddr, 0, sizeof(logAttr_t)*MAX_LOG_ENTITY);
-#ifdef F_DEBUG
-        printf("%s %s %d tracing ...\n", __FUNCTION__, __FILE__, __LINE__);
+    printf("%s %s %d shmAddr = %p\n",
+           __FUNCTION__, __FILE__, __LINE__, shmAddr);
 #endif        
-    }
     
-    logAttribute = initLogEntity(appName, (logAttr_t *)shmAddr);
+    if((gbl_logLatch = misc_seqlockOpen(shmAddr, sizeof(logAttr_t)*MAX_LOG_ENTITY,
+                                        NULL)) == NULL)
+    {
+        printf("misc_seqlockOpen error\n");
+        return;
+    }
+
+    misc_seqlockUpdate(gbl_logLatch, claimLogEntity, appName);
+    if(gbl_logIdx < 0)
+        return;
+
+    gbl_logVersion = misc_seqlockRead(gbl_logLatch, gbl_logTable);
+    logAttr = gbl_logTable[gbl_logIdx];
+    logAttribute = &logAttr;
 
 #else
     if((s = get_appLogAttr(appName, "log_level")) == NULL)
@@ -27,7 +27,8 @@ typedef enum
 } logDest_t;
 
 #define MAX_LOG_ENTITY         32
-#define LOG_SHM_FILE           "/tmp/log_shm"
+#define LOG_SHM_NAME           "misc_log"
+#define LOG_SHM_VERSION        2
 
 /** Show application name in the log line. */
 #define LOG_HDRMASK_APPNAME    0x0001 
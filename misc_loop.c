@@ -0,0 +1,497 @@
+/**
+ * @file   misc_loop.c
+ *
+ * @brief  epoll based event loop: fd readiness callbacks, timers from
+ *         misc_timer, signals through signalfd and cross thread
+ *         wakeup through eventfd.
+ *
+ * The fd table is indexed by fd, so dispatching a ready fd is O(1)
+ * whatever the number of watched fds. Every table entry carries a
+ * generation number which is also stored in the epoll data, so
+ * events of an fd deleted (or deleted and re-added) by an earlier
+ * callback of the same batch are dropped.
+ */
+/* #define F_DEBUG */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "misc_timer.h"
+#include "misc_loop.h"
+
+#ifdef F_DEBUG
+#define DPRINTF(fmt, args...) printf(fmt, ##args)
+#else
+#define DPRINTF(fmt, args...)
+#endif
+
+#define LOOP_MAX_SIGNALS     65  /* _NSIG on linux */
+#define LOOP_SIGINFO_BATCH   16
+
+typedef struct loopFd
+{
+    loopFdFunc_t  func;         /**< NULL if the fd is not watched */
+    void         *ctxArg;
+    int           events;       /**< MISC_LOOP_XXX flags registered */
+    unsigned int  gen;          /**< bumped on every add/delete */
+} loopFd_t;
+
+typedef struct loopSignal
+{
+    loopSignalFunc_t func;
+    void            *ctxArg;
+} loopSignal_t;
+
+/** Internal loop handle. */
+typedef struct loopHandle
+{
+    int               epfd;
+    int               wakeFd;   /**< eventfd for misc_loopWakeup() */
+    int               sigFd;    /**< signalfd, -1 until a signal is added */
+    sigset_t          sigMask;
+    sigset_t          sigBlocked; /**< already blocked before being added */
+    loopFd_t         *fds;      /**< indexed by fd */
+    int               maxFds;   /**< size of fds */
+    void             *timer;    /**< misc_timer handle */
+    volatile int      stop;
+    loopWakeupFunc_t  wakeFunc;
+    void             *wakeArg;
+    loopSignal_t      signals[LOOP_MAX_SIGNALS];
+    struct epoll_event events[MISC_LOOP_MAX_EVENTS];
+} loopHandle_t;
+
+static unsigned int loopToEpoll(int events)
+{
+    unsigned int ev = 0;
+
+    if(events & MISC_LOOP_READ)
+        ev |= EPOLLIN;
+    if(events & MISC_LOOP_WRITE)
+        ev |= EPOLLOUT;
+    if(events & MISC_LOOP_EDGE)
+        ev |= EPOLLET;
+    if(events & MISC_LOOP_ONESHOT)
+        ev |= EPOLLONESHOT;
+
+    return ev;
+}
+
+static int epollToLoop(unsigned int ev)
+{
+    int events = 0;
+
+    if(ev & EPOLLIN)
+        events |= MISC_LOOP_READ;
+    if(ev & EPOLLOUT)
+        events |= MISC_LOOP_WRITE;
+    if(ev & (EPOLLERR | EPOLLHUP))
+        events |= MISC_LOOP_ERROR;
+
+    return events;
+}
+
+static int loopGrow(loopHandle_t *lh, int fd)
+{
+    loopFd_t *fds;
+    int size;
+
+    if(fd < lh->maxFds)
+        return 0;
+
+    size = lh->maxFds ? lh->maxFds : 64;
+    while(size <= fd)
+        size *= 2;
+
+    if((fds = realloc(lh->fds, size * sizeof(loopFd_t))) == NULL)
+    {
+        perror("realloc");
+        return -1;
+    }
+    memset(fds + lh->maxFds, 0, (size - lh->maxFds) * sizeof(loopFd_t));
+
+    lh->fds = fds;
+    lh->maxFds = size;
+
+    return 0;
+}
+
+static int loopCtl(loopHandle_t *lh, int op, int fd, int events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = loopToEpoll(events);
+    ev.data.u64 = ((uint64_t)lh->fds[fd].gen << 32) | (uint32_t)fd;
+
+    return epoll_ctl(lh->epfd, op, fd, &ev);
+}
+
+static void loopWakeupRead(int fd, int events, void *ctxArg)
+{
+    loopHandle_t *lh = (loopHandle_t *)ctxArg;
+    uint64_t count;
+
+    /* the counter is reset by the read, wakeups are coalesced */
+    if(read(fd, &count, sizeof(count)) != sizeof(count))
+        return;
+
+    if(lh->wakeFunc != NULL)
+        (lh->wakeFunc)(lh->wakeArg);
+}
+
+static void loopSignalRead(int fd, int events, void *ctxArg)
+{
+    loopHandle_t *lh = (loopHandle_t *)ctxArg;
+    struct signalfd_siginfo si[LOOP_SIGINFO_BATCH];
+    loopSignal_t *sig;
+    int n, i;
+
+    while((n = read(fd, si, sizeof(si))) > 0)
+    {
+        for(i = 0; i < n / (int)sizeof(si[0]); i++)
+        {
+            if(si[i].ssi_signo >= LOOP_MAX_SIGNALS)
+                continue;
+
+            sig = &lh->signals[si[i].ssi_signo];
+            if(sig->func != NULL)
+                (sig->func)(si[i].ssi_signo, sig->ctxArg);
+        }
+    }
+}
+
+int misc_loopInit(void **handle)
+{
+    loopHandle_t *lh;
+
+    *handle = NULL;
+
+    if((lh = calloc(1, sizeof(loopHandle_t))) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    lh->epfd = lh->wakeFd = lh->sigFd = -1;
+    sigemptyset(&lh->sigMask);
+    sigemptyset(&lh->sigBlocked);
+
+    if((lh->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        perror("epoll_create1");
+        goto err;
+    }
+
+    if((lh->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        perror("eventfd");
+        goto err;
+    }
+
+    if(timer_init(&lh->timer) != 0)
+        goto err;
+
+    if(misc_loopAddFd(lh, lh->wakeFd, MISC_LOOP_READ, loopWakeupRead, lh) != 0)
+        goto err;
+
+    *handle = lh;
+
+    return 0;
+
+err:
+    misc_loopCleanup((void **)&lh);
+    return -1;
+}
+
+void misc_loopCleanup(void **handle)
+{
+    loopHandle_t *lh = (loopHandle_t *)(*handle);
+    int signo;
+
+    if(lh == NULL)
+        return;
+
+    for(signo = 1; signo < LOOP_MAX_SIGNALS; signo++)
+    {
+        if(lh->signals[signo].func != NULL)
+            misc_loopDelSignal(lh, signo);
+    }
+
+    if(lh->timer != NULL)
+        timer_cleanup(&lh->timer);
+    if(lh->sigFd >= 0)
+        close(lh->sigFd);
+    if(lh->wakeFd >= 0)
+        close(lh->wakeFd);
+    if(lh->epfd >= 0)
+        close(lh->epfd);
+
+    free(lh->fds);
+    free(lh);
+    *handle = NULL;
+}
+
+void *misc_loopTimer(void *handle)
+{
+    return ((loopHandle_t *)handle)->timer;
+}
+
+int misc_loopAddFd(void *handle, int fd, int events,
+                   loopFdFunc_t func, void *ctxArg)
+{
+    loopHandle_t *lh = (loopHandle_t *)handle;
+    loopFd_t *lf;
+
+    if(fd < 0 || func == NULL)
+        return -1;
+
+    if(loopGrow(lh, fd) != 0)
+        return -1;
+
+    lf = &lh->fds[fd];
+    if(lf->func != NULL)
+    {
+        DPRINTF("fd %d is already watched\n", fd);
+        return -1;
+    }
+
+    lf->gen++;
+    lf->func = func;
+    lf->ctxArg = ctxArg;
+    lf->events = events;
+
+    if(loopCtl(lh, EPOLL_CTL_ADD, fd, events) != 0)
+    {
+        perror("epoll_ctl add");
+        lf->func = NULL;
+        return -1;
+    }
+
+    DPRINTF("watch fd %d events 0x%x\n", fd, events);
+
+    return 0;
+}
+
+int misc_loopModFd(void *handle, int fd, int events)
+{
+    loopHandle_t *lh = (loopHandle_t *)handle;
+
+    if(fd < 0 || fd >= lh->maxFds || lh->fds[fd].func == NULL)
+        return -1;
+
+    lh->fds[fd].events = events;
+
+    if(loopCtl(lh, EPOLL_CTL_MOD, fd, events) != 0)
+    {
+        perror("epoll_ctl mod");
+        return -1;
+    }
+
+    return 0;
+}
+
+int misc_loopDelFd(void *handle, int fd)
+{
+    loopHandle_t *lh = (loopHandle_t *)handle;
+    loopFd_t *lf;
+
+    if(fd < 0 || fd >= lh->maxFds || lh->fds[fd].func == NULL)
+        return -1;
+
+    lf = &lh->fds[fd];
+    lf->func = NULL;
+    lf->ctxArg = NULL;
+    lf->gen++;
+
+    /* the fd may already be closed by the caller, which removed it */
+    epoll_ctl(lh->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    DPRINTF("unwatch fd %d\n", fd);
+
+    return 0;
+}
+
+int misc_loopAddSignal(void *handle, int signo,
+                       loopSignalFunc_t func, void *ctxArg)
+{
+    loopHandle_t *lh = (loopHandle_t *)handle;
+    sigset_t one, old;
+    int fd;
+
+    if(signo <= 0 || signo >= LOOP_MAX_SIGNALS || func == NULL)
+        return -1;
+
+    if(sigismember(&lh->sigMask, signo))
+    {
+        lh->signals[signo].func = func;
+        lh->signals[signo].ctxArg = ctxArg;
+        return 0;
+    }
+
+    sigemptyset(&one);
+    sigaddset(&one, signo);
+    if((errno = pthread_sigmask(SIG_BLOCK, &one, &old)) != 0)
+    {
+        perror("pthread_sigmask");
+        return -1;
+    }
+
+    sigaddset(&lh->sigMask, signo);
+    fd = signalfd(lh->sigFd, &lh->sigMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(fd < 0)
+    {
+        perror("signalfd");
+        goto error;
+    }
+
+    if(lh->sigFd < 0)
+    {
+        lh->sigFd = fd;
+        if(misc_loopAddFd(lh, fd, MISC_LOOP_READ, loopSignalRead, lh) != 0)
+        {
+            close(fd);
+            lh->sigFd = -1;
+            goto error;
+        }
+    }
+
+    /* misc_loopDelSignal() leaves it blocked then */
+    if(sigismember(&old, signo))
+        sigaddset(&lh->sigBlocked, signo);
+    lh->signals[signo].func = func;
+    lh->signals[signo].ctxArg = ctxArg;
+
+    return 0;
+
+error:
+    sigdelset(&lh->sigMask, signo);
+    if(!sigismember(&old, signo))
+        pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+
+    return -1;
+}
+
+int misc_loopDelSignal(void *handle, int signo)
+{
+    loopHandle_t *lh = (loopHandle_t *)handle;
+    sigset_t one;
+
+    if(signo <= 0 || signo >= LOOP_MAX_SIGNALS ||
+       lh->signals[signo].func == NULL)
+        return -1;
+
+    lh->signals[signo].func = NULL;
+    lh->signals[signo].ctxArg = NULL;
+    sigdelset(&lh->sigMask, signo);
+    signalfd(lh->sigFd, &lh->sigMask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if(sigismember(&lh->sigBlocked, signo))
+    {
+        sigdelset(&lh->sigBlocked, signo);
+        return 0;
+    }
+
+    sigemptyset(&one);
+    sigaddset(&one, signo);
+    pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+
+    return 0;
+}
+
+void misc_loopSetWakeup(void *handle, loopWakeupFunc_t func, void *ctxArg)
+{
+    loopHandle_t *lh = (loopHandle_t *)handle;
+
+    lh->wakeFunc = func;
+    lh->wakeArg = ctxArg;
+}
+
+int misc_loopWakeup(void *handle)
+{
+    loopHandle_t *lh = (loopHandle_t *)handle;
+    uint64_t one = 1;
+
+    if(write(lh->wakeFd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        return -1;
+
+    return 0;
+}
+
+int misc_loopRunOnce(void *handle, int timeoutMs)
+{
+    loopHandle_t *lh = (loopHandle_t *)handle;
+    struct epoll_event *ev;
+    loopFd_t *lf;
+    int n, i, fd, next, dispatched = 0;
+    unsigned int gen;
+
+    /* expired timers left over by the execute budget: just poll */
+    if(timer_hasExpired(lh->timer))
+        timeoutMs = 0;
+    else if((next = timer_nextExpireMs(lh->timer)) >= 0 &&
+            (timeoutMs < 0 || next < timeoutMs))
+        timeoutMs = next;
+
+    n = epoll_wait(lh->epfd, lh->events, MISC_LOOP_MAX_EVENTS, timeoutMs);
+    if(n < 0)
+    {
+        if(errno != EINTR)
+        {
+            perror("epoll_wait");
+            return -1;
+        }
+        n = 0;
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        ev = &lh->events[i];
+        fd = (int)(uint32_t)ev->data.u64;
+        gen = (unsigned int)(ev->data.u64 >> 32);
+
+        if(fd >= lh->maxFds)
+            continue;
+
+        lf = &lh->fds[fd];
+        if(lf->func == NULL || lf->gen != gen)
+        {
+            /* removed by an earlier callback of this batch */
+            continue;
+        }
+
+        (lf->func)(fd, epollToLoop(ev->events), lf->ctxArg);
+        dispatched++;
+    }
+
+    timer_execute_expire_events(lh->timer);
+
+    return dispatched;
+}
+
+int misc_loopRun(void *handle)
+{
+    loopHandle_t *lh = (loopHandle_t *)handle;
+
+    lh->stop = 0;
+
+    while(!lh->stop)
+    {
+        if(misc_loopRunOnce(lh, -1) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+void misc_loopStop(void *handle)
+{
+    ((loopHandle_t *)handle)->stop = 1;
+}
@@ -0,0 +1,121 @@
+#ifndef _MISC_LOOP_H_
+#define _MISC_LOOP_H_
+
+/** fd readiness flags, used both when registering and in callbacks */
+#define MISC_LOOP_READ      (1<<0)
+#define MISC_LOOP_WRITE     (1<<1)
+#define MISC_LOOP_EDGE      (1<<2)  /**< edge triggered, read until EAGAIN */
+#define MISC_LOOP_ONESHOT   (1<<3)  /**< disarm after the first event */
+#define MISC_LOOP_ERROR     (1<<4)  /**< callback only: error or hangup */
+
+/** Number of ready fds fetched by one epoll_wait call */
+#define MISC_LOOP_MAX_EVENTS 64
+
+typedef void (*loopFdFunc_t)(int fd, int events, void *ctxArg);
+typedef void (*loopSignalFunc_t)(int signo, void *ctxArg);
+typedef void (*loopWakeupFunc_t)(void *ctxArg);
+
+/**
+ * Create an event loop with its own timer handle.
+ *
+ * @param handle
+ *
+ * @return 0 on success, -1 on error
+ */
+int misc_loopInit(void **handle);
+
+void misc_loopCleanup(void **handle);
+
+/**
+ * Get the timer handle of the loop, timers are added to it with the
+ * normal timer_event_add() API and run from the loop.
+ *
+ * @param handle
+ *
+ * @return timer handle
+ */
+void *misc_loopTimer(void *handle);
+
+/**
+ * Watch an fd, func is called with the MISC_LOOP_XXX flags that are
+ * ready. The fd is not closed by the loop.
+ *
+ * @param handle
+ * @param fd
+ * @param events MISC_LOOP_READ, MISC_LOOP_WRITE, MISC_LOOP_EDGE, MISC_LOOP_ONESHOT
+ * @param func
+ * @param ctxArg
+ *
+ * @return 0 on success, -1 on error
+ */
+int misc_loopAddFd(void *handle, int fd, int events,
+                   loopFdFunc_t func, void *ctxArg);
+
+/**
+ * Change the watched events of an fd, also re-arms a oneshot fd.
+ */
+int misc_loopModFd(void *handle, int fd, int events);
+
+/**
+ * Stop watching an fd, safe to be called from any loop callback.
+ */
+int misc_loopDelFd(void *handle, int fd);
+
+/**
+ * Deliver a signal through the loop instead of an async handler.
+ * The signal is blocked in the calling thread, threads created
+ * afterwards inherit the mask, so create the loop early.
+ * misc_loopDelSignal() unblocks it, unless it was already blocked.
+ *
+ * @param handle
+ * @param signo
+ * @param func
+ * @param ctxArg
+ *
+ * @return 0 on success, -1 on error
+ */
+int misc_loopAddSignal(void *handle, int signo,
+                       loopSignalFunc_t func, void *ctxArg);
+
+int misc_loopDelSignal(void *handle, int signo);
+
+/**
+ * Set the function run in the loop thread after misc_loopWakeup().
+ */
+void misc_loopSetWakeup(void *handle, loopWakeupFunc_t func, void *ctxArg);
+
+/**
+ * Wake up the loop from another thread. Several wakeups before the
+ * loop runs are coalesced into one callback.
+ *
+ * @param handle
+ *
+ * @return 0 on success, -1 on error
+ */
+int misc_loopWakeup(void *handle);
+
+/**
+ * Wait for fd events or the next timer, dispatch them and run the
+ * expired timers.
+ *
+ * @param handle
+ * @param timeoutMs max time to wait, -1 waits for the next event
+ *
+ * @return number of fd events dispatched, -1 on error
+ */
+int misc_loopRunOnce(void *handle, int timeoutMs);
+
+/**
+ * Run until misc_loopStop() is called.
+ *
+ * @return 0 after misc_loopStop(), -1 on error
+ */
+int misc_loopRun(void *handle);
+
+/**
+ * Make misc_loopRun() return, may be called from a loop callback or,
+ * followed by misc_loopWakeup(), from another thread.
+ */
+void misc_loopStop(void *handle);
+
+#endif
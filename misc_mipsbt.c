@@ -30,55 +30,72 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include "misc_proc.h"
 
 #define NREG_RA 31
 #define NREG_SP 29
 
-typedef struct pmapLine {
+#define BT_MAX_MAPS 1024
+
+typedef struct pmapRange {
     unsigned long    vmStart;
     unsigned long    vmEnd;
-    char             permission[5];
-    unsigned long    vmPageOffset;
-    char             dev[6];
-    unsigned long    innodeNumber;
-    struct pmapLine *next;
-} pmapLine_t;
+} pmapRange_t;
 
-pmapLine_t *gbl_pmapLineHead = NULL;
+/* readable mappings, filled from the signal handler: no malloc */
+static pmapRange_t gbl_pmapRanges[BT_MAX_MAPS];
+static int gbl_pmapCount = 0;
+static char gbl_pmapBuf[4096];
 
 static int bt_getProcessMaps(void)
 {
-    FILE *fp;
-    pmapLine_t *plTail = NULL;
-    pmapLine_t *pl = NULL;
+    miscProcMap_t map;
+    miscProcLines_t pl;
     char pmapFile[64];
-    char buf[1024];
-    int pid;
+    char *line;
+    int full = 0, tail = 0;
     
-    pid = getpid();
-    snprintf(pmapFile, sizeof(pmapFile), "/proc/%ld/maps", (long)pid);
-    if((fp = fopen(pmapFile, "r")) == NULL)
+    if(misc_procPath(pmapFile, sizeof(pmapFile), getpid(), "maps") == NULL ||
+       misc_procLinesOpen(&pl, pmapFile, gbl_pmapBuf, sizeof(gbl_pmapBuf)) < 0)
         return -1;
 
-    while(fgets(buf, sizeof(buf), fp) != NULL)
+    gbl_pmapCount = 0;
+    while((line = misc_procLinesNext(&pl)) != NULL)
     {
+        /* skip the rest of a too long path */
+        if(tail || misc_procParseMap(line, &map) < 0)
+        {
+            tail = pl.split;
+            continue;
+        }
+        tail = pl.split;
 #ifdef F_DEBUG        
-        printf("%s", buf);
+        printf("%08lx-%08lx %s %s\n", map.start, map.end, map.perms, map.path);
 #endif        
-        pl = calloc(1, sizeof(pmapLine_t));
-        sscanf(buf,
-               "%lx-%lx %4s %lx %5s %lu",
-               &pl->vmStart, &pl->vmEnd, pl->permission,
-               &pl->vmPageOffset, pl->dev, &pl->innodeNumber);
-        pl->next = NULL;
-        if(!gbl_pmapLineHead)
-            gbl_pmapLineHead = pl;
-        if(plTail)
-            plTail->next = pl;
-        plTail = pl;
+        if(map.perms[0] != 'r')
+            continue;
+        /* adjacent readable mappings make one range */
+        if(gbl_pmapCount > 0 &&
+           gbl_pmapRanges[gbl_pmapCount - 1].vmEnd == map.start)
+        {
+            gbl_pmapRanges[gbl_pmapCount - 1].vmEnd = map.end;
+            continue;
+        }
+        if(gbl_pmapCount >= BT_MAX_MAPS)
+        {
+            full++;
+            continue;
+        }
+        gbl_pmapRanges[gbl_pmapCount].vmStart = map.start;
+        gbl_pmapRanges[gbl_pmapCount].vmEnd = map.end;
+        gbl_pmapCount++;
     }
+    misc_procLinesClose(&pl);
 
-    fclose(fp);
+    if(full > 0)
+        printf("Too many mappings, %d readable ones left out\n", full);
 
     return 0;
 }
@@ -92,17 +109,13 @@ static int bt_getProcessMaps(void)
  */
 static int bt_regularAddr(unsigned long addr)
 {
-    pmapLine_t *pl = gbl_pmapLineHead;
+    int i;
     
-    if(!gbl_pmapLineHead)
-        return 0;
-
-    while(pl != NULL)
+    for(i = 0; i < gbl_pmapCount; i++)
     {
-        if((pl->permission[0] == 'r') &&
-           (addr >= pl->vmStart) && (addr <= pl->vmEnd))
+        if((addr >= gbl_pmapRanges[i].vmStart) &&
+           (addr <= gbl_pmapRanges[i].vmEnd))
             return 1;
-        pl = pl->next;
     }
     
     printf("Can't read address %08x\n", addr);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE             /* recvmmsg(), sendmmsg() */
 #include <stdio.h>
 #include <stdlib.h>             /* malloc() */
 #include <string.h>             /* strncpy(), memcpy() ... */
@@ -7,15 +8,1813 @@
 #include <sys/ioctl.h>          /* get infos about net device */
 #include <net/if.h>             /* idem */
 #include <linux/if_packet.h>    /* struct sockaddr_ll */
+#include <arpa/inet.h>          /* inet_ntop */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/netlink.h>      /* interface cache */
+#include <linux/rtnetlink.h>
+#include <time.h>
+#include <sched.h>              /* sched_yield() */
+#include <poll.h>               /* packet capture */
+#include <sys/mman.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <netinet/udp.h>        /* batched udp */
 
+#include "misc_loop.h"
 #include "misc_net.h"
 
+#define NL_BUFSZ 16384
+
+#define NET_DEV_FILE    "/proc/net/dev"
+#define NET_DEV_BUFSZ   8192
+
+#define CAPTURE_DEF_BLOCK_SIZE   (1 << 20)
+#define CAPTURE_DEF_BLOCK_COUNT  8
+#define CAPTURE_DEF_TIMEOUT      10     /* ms */
+#define CAPTURE_FRAME_SIZE       2048   /* only used to size the ring */
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING   23
+#endif
+
+#define NEIGH_HASH_BITS          10
+#define NEIGH_HASH_SIZE          (1 << NEIGH_HASH_BITS)  /* 2x MISC_NET_MAX_NEIGH */
+
+#define UDP_CACHELINE            64
+#define UDP_DEF_BATCH            32
+#define UDP_DEF_BUFSZ            2048
+#define UDP_GSO_MAX_SEGS         64     /* kernel limit per send */
+
+#ifndef SOL_UDP
+#define SOL_UDP                  17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT              103
+#endif
+
+/** Interface table filled by the netlink handlers, index 0 is a free slot */
+typedef struct netIfTable
+{
+    miscNetIf_t *ifs;
+    int          max;
+} netIfTable_t;
+
+/**
+ * Interface cache, written only by misc_netCacheInit()/Update() and
+ * read lock-free: seq is odd while the writer updates the table and
+ * readers retry if it changed under them.
+ */
+static struct
+{
+    volatile unsigned int seq;
+    int                   nlFd;
+    miscNetIf_t           ifs[MISC_NET_MAX_IFS];
+} gbl_netCache = { 0, -1 };
+
+typedef int (*nlMsgFunc_t)(struct nlmsghdr *nlh, void *arg);
+
+static int nlOpen(unsigned int groups)
+{
+    struct sockaddr_nl sa;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if(fd == -1)
+    {
+        perror("netlink socket");
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = groups;
+    if(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+    {
+        perror("netlink bind");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int nlDumpRequest(int fd, int type, int family)
+{
+    struct
+    {
+        struct nlmsghdr nlh;
+        struct rtgenmsg gen;
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.gen));
+    req.nlh.nlmsg_type = type;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq = type;
+    req.gen.rtgen_family = family;
+
+    if(send(fd, &req, req.nlh.nlmsg_len, 0) < 0)
+    {
+        perror("netlink send");
+        return -1;
+    }
+
+    return 0;
+}
+
+/** 
+ * Pass the netlink messages of a received buffer to func.
+ * 
+ * @param done set when the end of a dump was seen
+ * 
+ * @return number of messages
+ */
+static int nlParse(char *buf, int len, nlMsgFunc_t func, void *arg, int *done)
+{
+    struct nlmsghdr *nlh;
+    int count = 0;
+
+    for(nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, (unsigned int)len);
+        nlh = NLMSG_NEXT(nlh, len))
+    {
+        if(nlh->nlmsg_type == NLMSG_DONE || nlh->nlmsg_type == NLMSG_ERROR)
+        {
+            if(done != NULL)
+                *done = 1;
+            continue;
+        }
+
+        func(nlh, arg);
+        count++;
+    }
+
+    return count;
+}
+
+/** 
+ * Run a dump request and feed every answer to func.
+ */
+static int nlDump(int fd, int type, int family, nlMsgFunc_t func, void *arg)
+{
+    char buf[NL_BUFSZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int len, done = 0;
+
+    if(nlDumpRequest(fd, type, family) != 0)
+        return -1;
+
+    while(!done)
+    {
+        len = recv(fd, buf, sizeof(buf), 0);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        nlParse(buf, len, func, arg, &done);
+    }
+
+    return 0;
+}
+
+static int rtaCopy(struct rtattr *rta, void *dst, int size)
+{
+    int len = RTA_PAYLOAD(rta);
+
+    if(len > size)
+        len = size;
+    memcpy(dst, RTA_DATA(rta), len);
+
+    return len;
+}
+
+static inline void netCacheWriteBegin(void)
+{
+    gbl_netCache.seq++;
+    __sync_synchronize();
+}
+
+static inline void netCacheWriteEnd(void)
+{
+    __sync_synchronize();
+    gbl_netCache.seq++;
+}
+
+static miscNetIf_t *netIfSlot(netIfTable_t *tbl, int index, int create)
+{
+    miscNetIf_t *free = NULL;
+    int i;
+
+    for(i = 0; i < tbl->max; i++)
+    {
+        if(tbl->ifs[i].index == index)
+            return &tbl->ifs[i];
+        if(free == NULL && tbl->ifs[i].index == 0)
+            free = &tbl->ifs[i];
+    }
+
+    if(!create || free == NULL)
+        return NULL;
+
+    memset(free, 0, sizeof(*free));
+    free->index = index;
+
+    return free;
+}
+
+static int netIfLink(struct nlmsghdr *nlh, netIfTable_t *tbl)
+{
+    struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    struct rtattr *rta;
+    miscNetIf_t *nif;
+    int len;
+
+    if(nlh->nlmsg_type == RTM_DELLINK)
+    {
+        if((nif = netIfSlot(tbl, ifi->ifi_index, 0)) != NULL)
+            nif->index = 0;
+        return 0;
+    }
+
+    if((nif = netIfSlot(tbl, ifi->ifi_index, 1)) == NULL)
+        return 0;
+
+    nif->flags = ifi->ifi_flags;
+    len = IFLA_PAYLOAD(nlh);
+    for(rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+    {
+        switch(rta->rta_type)
+        {
+            case IFLA_IFNAME:
+                rtaCopy(rta, nif->name, sizeof(nif->name) - 1);
+                break;
+            case IFLA_MTU:
+                rtaCopy(rta, &nif->mtu, sizeof(nif->mtu));
+                break;
+            case IFLA_ADDRESS:
+                rtaCopy(rta, nif->mac, sizeof(nif->mac));
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static int netIfAddr(struct nlmsghdr *nlh, netIfTable_t *tbl)
+{
+    struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+    struct rtattr *rta;
+    miscNetAddr_t na, *slot = NULL;
+    miscNetIf_t *nif;
+    int len, i, haveLocal = 0;
+
+    if((ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6) ||
+       (nif = netIfSlot(tbl, ifa->ifa_index, 0)) == NULL)
+        return 0;
+
+    memset(&na, 0, sizeof(na));
+    na.family = ifa->ifa_family;
+    na.prefixLen = ifa->ifa_prefixlen;
+    na.flags = ifa->ifa_flags;
+    na.scope = ifa->ifa_scope;
+
+    len = IFA_PAYLOAD(nlh);
+    for(rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+    {
+        /* IFA_ADDRESS is the peer on point to point links */
+        if(rta->rta_type == IFA_LOCAL)
+        {
+            rtaCopy(rta, &na.addr, sizeof(na.addr));
+            haveLocal = 1;
+        }
+        else if(rta->rta_type == IFA_ADDRESS && !haveLocal)
+        {
+            rtaCopy(rta, &na.addr, sizeof(na.addr));
+        }
+    }
+
+    for(i = 0; i < nif->naddrs; i++)
+    {
+        if(nif->addrs[i].family == na.family &&
+           memcmp(&nif->addrs[i].addr, &na.addr, sizeof(na.addr)) == 0)
+        {
+            slot = &nif->addrs[i];
+            break;
+        }
+    }
+
+    if(nlh->nlmsg_type == RTM_NEWADDR)
+    {
+        if(slot == NULL && nif->naddrs < MISC_NET_MAX_ADDRS)
+            slot = &nif->addrs[nif->naddrs++];
+        if(slot != NULL)
+            *slot = na;
+    }
+    else if(nlh->nlmsg_type == RTM_DELADDR && slot != NULL)
+    {
+        /* keep the order, the first IPv4 one is the primary address */
+        nif->naddrs--;
+        memmove(slot, slot + 1, (&nif->addrs[nif->naddrs] - slot) * sizeof(*slot));
+    }
+
+    return 0;
+}
+
+static int netIfMsg(struct nlmsghdr *nlh, void *arg)
+{
+    switch(nlh->nlmsg_type)
+    {
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+            return netIfLink(nlh, (netIfTable_t *)arg);
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+            return netIfAddr(nlh, (netIfTable_t *)arg);
+    }
+
+    return 0;
+}
+
+/** 
+ * Dump all links and addresses into tbl.
+ * 
+ * @return number of interfaces, -1 on error
+ */
+static int netIfDump(int fd, netIfTable_t *tbl)
+{
+    int i, n = 0;
+
+    memset(tbl->ifs, 0, tbl->max * sizeof(miscNetIf_t));
+    if(nlDump(fd, RTM_GETLINK, AF_UNSPEC, netIfMsg, tbl) != 0 ||
+       nlDump(fd, RTM_GETADDR, AF_UNSPEC, netIfMsg, tbl) != 0)
+        return -1;
+
+    for(i = 0; i < tbl->max; i++)
+    {
+        if(tbl->ifs[i].index != 0)
+            n++;
+    }
+
+    return n;
+}
+
+static int netCacheLoad(void)
+{
+    static miscNetIf_t ifs[MISC_NET_MAX_IFS];
+    netIfTable_t tbl = { ifs, MISC_NET_MAX_IFS };
+
+    /* dump into a scratch table, readers only wait for the copy */
+    if(netIfDump(gbl_netCache.nlFd, &tbl) < 0)
+        return -1;
+
+    netCacheWriteBegin();
+    memcpy(gbl_netCache.ifs, ifs, sizeof(ifs));
+    netCacheWriteEnd();
+
+    return 0;
+}
+
+/** 
+ * Copy the cache entry of ifname, or all entries if ifname is NULL.
+ * 
+ * @return number of entries copied, -1 if the cache is not running
+ */
+static int netCacheRead(const char *ifname, miscNetIf_t *out, int max)
+{
+    unsigned int seq;
+    int i, n;
+
+    if(gbl_netCache.nlFd < 0)
+        return -1;
+
+    do
+    {
+        while((seq = gbl_netCache.seq) & 1)
+            ;
+        __sync_synchronize();
+
+        n = 0;
+        for(i = 0; i < MISC_NET_MAX_IFS && n < max; i++)
+        {
+            if(gbl_netCache.ifs[i].index == 0)
+                continue;
+            if(ifname != NULL &&
+               strncmp(gbl_netCache.ifs[i].name, ifname, MISC_NET_IFNAMSIZ) != 0)
+                continue;
+            out[n++] = gbl_netCache.ifs[i];
+        }
+
+        __sync_synchronize();
+    } while(seq != gbl_netCache.seq);
+
+    return n;
+}
+
+static int netCacheFind(const char *ifname, miscNetIf_t *out)
+{
+    return (netCacheRead(ifname, out, 1) == 1) ? 0 : -1;
+}
+
+/** 
+ * @return the primary IPv4 address of nif, or NULL
+ */
+static const struct in_addr *netIfPrimary(const miscNetIf_t *nif)
+{
+    int i;
+
+    for(i = 0; i < nif->naddrs; i++)
+    {
+        if(nif->addrs[i].family == AF_INET &&
+           !(nif->addrs[i].flags & IFA_F_SECONDARY))
+            return &nif->addrs[i].addr.v4;
+    }
+
+    return NULL;
+}
+
+int misc_netCacheInit(void)
+{
+    int fd;
+
+    if(gbl_netCache.nlFd >= 0)
+        return 0;
+
+    if((fd = nlOpen(RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR)) < 0)
+        return -1;
+
+    gbl_netCache.nlFd = fd;
+    if(netCacheLoad() != 0)
+    {
+        misc_netCacheCleanup();
+        return -1;
+    }
+
+    /* from now on only notifications, read from the event loop */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return 0;
+}
+
+int misc_netCacheFd(void)
+{
+    return gbl_netCache.nlFd;
+}
+
+int misc_netCacheUpdate(void)
+{
+    char buf[NL_BUFSZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+    netIfTable_t tbl = { gbl_netCache.ifs, MISC_NET_MAX_IFS };
+    int fd = gbl_netCache.nlFd;
+    int len, total = 0;
+
+    if(fd < 0)
+        return -1;
+
+    while(1)
+    {
+        len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if(len < 0)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+                break;
+            if(errno != ENOBUFS)
+                return -1;
+
+            /* notifications were lost, reload everything */
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            len = netCacheLoad();
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            if(len != 0)
+                return -1;
+            total++;
+            continue;
+        }
+
+        netCacheWriteBegin();
+        total += nlParse(buf, len, netIfMsg, &tbl, NULL);
+        netCacheWriteEnd();
+    }
+
+    return total;
+}
+
+void misc_netCacheCleanup(void)
+{
+    if(gbl_netCache.nlFd >= 0)
+    {
+        close(gbl_netCache.nlFd);
+        gbl_netCache.nlFd = -1;
+    }
+}
+
+int misc_netCacheGetIp(const char *ifname, struct in_addr *addr)
+{
+    const struct in_addr *primary;
+    miscNetIf_t nif;
+
+    if(netCacheFind(ifname, &nif) != 0 || (primary = netIfPrimary(&nif)) == NULL)
+        return -1;
+
+    *addr = *primary;
+
+    return 0;
+}
+
+int misc_netCacheGetMac(const char *ifname, unsigned char *mac)
+{
+    miscNetIf_t nif;
+
+    if(netCacheFind(ifname, &nif) != 0)
+        return -1;
+
+    memcpy(mac, nif.mac, MISC_NET_MAC_LEN);
+
+    return 0;
+}
+
+int misc_netGetInterfaces(miscNetIf_t *ifs, int maxIfs)
+{
+    netIfTable_t tbl;
+    int fd, i, n;
+
+    if((n = netCacheRead(NULL, ifs, maxIfs)) >= 0)
+        return n;
+
+    /* no cache, one dump straight into the caller's array */
+    if((fd = nlOpen(0)) < 0)
+        return -1;
+
+    tbl.ifs = ifs;
+    tbl.max = maxIfs;
+    n = netIfDump(fd, &tbl);
+    close(fd);
+    if(n < 0)
+        return -1;
+
+    /* compact, deleted links may have left holes */
+    for(i = n = 0; i < maxIfs; i++)
+    {
+        if(ifs[i].index == 0)
+            continue;
+        if(i != n)
+            ifs[n] = ifs[i];
+        n++;
+    }
+
+    return n;
+}
+
+int misc_netAddrToStr(const miscNetAddr_t *addr, char *buf, int size)
+{
+    char tmp[INET6_ADDRSTRLEN];
+
+    if(inet_ntop(addr->family, &addr->addr, tmp, sizeof(tmp)) == NULL)
+        return -1;
+
+    return snprintf(buf, size, "%s/%d", tmp, addr->prefixLen);
+}
+
+int misc_netMacToStr(const unsigned char *mac, char *buf, int size)
+{
+    return snprintf(buf, size, "%02X:%02X:%02X:%02X:%02X:%02X",
+                    mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+/** Neighbor table, entries are dense, the two hashes hold entry index + 1 */
+typedef struct neighTable
+{
+    int             count;
+    miscNetNeigh_t  ents[MISC_NET_MAX_NEIGH];
+    unsigned short  ipHash[NEIGH_HASH_SIZE];
+    unsigned short  macHash[NEIGH_HASH_SIZE];
+} neighTable_t;
+
+typedef struct neighSub
+{
+    miscNeighFunc_t func;
+    void           *ctxArg;
+} neighSub_t;
+
+/**
+ * Neighbor cache, left-right snapshots: readers use tables[active]
+ * while the writer changes the other table, publishes it by flipping
+ * active, waits for the readers of the old one to leave and applies
+ * the same change to it. Readers never wait nor retry more than once
+ * per flip, and writes never block behind a slow reader for more than
+ * one lookup.
+ */
+static struct
+{
+    volatile int          active;
+    volatile unsigned int readers[2];
+    int                   nlFd;
+    int                   nsubs;
+    neighSub_t            subs[MISC_NET_NEIGH_MAX_SUBS];
+    neighTable_t          tables[2];
+} gbl_neighCache = { 0, { 0, 0 }, -1 };
+
+typedef struct neighMsgArg
+{
+    neighTable_t *tbl;
+    int           notify;   /**< first pass of a change, call the subscribers */
+} neighMsgArg_t;
+
+static unsigned int neighIpHash(int family, const void *addr)
+{
+    const unsigned int *w = (const unsigned int *)addr;
+    unsigned int h = w[0];
+
+    if(family == AF_INET6)
+        h ^= w[1] ^ w[2] ^ w[3];
+
+    return (h * 0x9e3779b1) >> (32 - NEIGH_HASH_BITS);
+}
+
+static unsigned int neighMacHash(const unsigned char *mac)
+{
+    unsigned int h;
+
+    h = (mac[2] << 24 | mac[3] << 16 | mac[4] << 8 | mac[5]) ^
+        (mac[0] << 8 | mac[1]);
+
+    return (h * 0x9e3779b1) >> (32 - NEIGH_HASH_BITS);
+}
+
+static unsigned int neighHome(const neighTable_t *tbl, int byMac, int idx)
+{
+    const miscNetNeigh_t *ent = &tbl->ents[idx];
+
+    return byMac ? neighMacHash(ent->mac) : neighIpHash(ent->family, &ent->addr);
+}
+
+static void neighHashInsert(unsigned short *hash, unsigned int h, int idx)
+{
+    while(hash[h] != 0)
+        h = (h + 1) & (NEIGH_HASH_SIZE - 1);
+    hash[h] = idx + 1;
+}
+
+/* find the bucket of idx, linear probing from its home bucket */
+static unsigned int neighHashSlot(const unsigned short *hash, unsigned int h, int idx)
+{
+    while(hash[h] != idx + 1)
+        h = (h + 1) & (NEIGH_HASH_SIZE - 1);
+
+    return h;
+}
+
+/* remove without tombstones: shift back the followers that may move */
+static void neighHashRemove(neighTable_t *tbl, int byMac, int idx)
+{
+    unsigned short *hash = byMac ? tbl->macHash : tbl->ipHash;
+    unsigned int i, j, k;
+
+    i = j = neighHashSlot(hash, neighHome(tbl, byMac, idx), idx);
+    while(1)
+    {
+        j = (j + 1) & (NEIGH_HASH_SIZE - 1);
+        if(hash[j] == 0)
+            break;
+        k = neighHome(tbl, byMac, hash[j] - 1);
+        /* k cyclically in ]i, j] stays, otherwise it fills the hole */
+        if((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        hash[i] = hash[j];
+        i = j;
+    }
+    hash[i] = 0;
+}
+
+static int neighFind(const neighTable_t *tbl, int ifindex, int family,
+                     const void *addr)
+{
+    unsigned int h = neighIpHash(family, addr);
+    const miscNetNeigh_t *ent;
+    int alen = family == AF_INET6 ? 16 : 4;
+
+    for(; tbl->ipHash[h] != 0; h = (h + 1) & (NEIGH_HASH_SIZE - 1))
+    {
+        ent = &tbl->ents[tbl->ipHash[h] - 1];
+        if(ent->family == family && memcmp(&ent->addr, addr, alen) == 0 &&
+           (ifindex == 0 || ent->ifindex == ifindex))
+            return tbl->ipHash[h] - 1;
+    }
+
+    return -1;
+}
+
+static int neighFindMac(const neighTable_t *tbl, const unsigned char *mac)
+{
+    unsigned int h = neighMacHash(mac);
+    const miscNetNeigh_t *ent;
+
+    for(; tbl->macHash[h] != 0; h = (h + 1) & (NEIGH_HASH_SIZE - 1))
+    {
+        ent = &tbl->ents[tbl->macHash[h] - 1];
+        if(memcmp(ent->mac, mac, MISC_NET_MAC_LEN) == 0)
+            return tbl->macHash[h] - 1;
+    }
+
+    return -1;
+}
+
+static void neighDel(neighTable_t *tbl, int idx)
+{
+    int last = tbl->count - 1;
+
+    neighHashRemove(tbl, 0, idx);
+    neighHashRemove(tbl, 1, idx);
+
+    /* keep the entries dense, the last one takes the hole */
+    if(idx != last)
+    {
+        tbl->ipHash[neighHashSlot(tbl->ipHash, neighHome(tbl, 0, last), last)] = idx + 1;
+        tbl->macHash[neighHashSlot(tbl->macHash, neighHome(tbl, 1, last), last)] = idx + 1;
+        tbl->ents[idx] = tbl->ents[last];
+    }
+    tbl->count--;
+}
+
+/** 
+ * Apply one neighbor to a table.
+ * 
+ * @return the MISC_NET_NEIGH_XXX change, 0 if nothing a subscriber
+ * cares about changed
+ */
+static int neighSet(neighTable_t *tbl, const miscNetNeigh_t *neigh, int del)
+{
+    miscNetNeigh_t *ent;
+    int idx;
+
+    idx = neighFind(tbl, neigh->ifindex, neigh->family, &neigh->addr);
+    if(del)
+    {
+        if(idx < 0)
+            return 0;
+        neighDel(tbl, idx);
+        return MISC_NET_NEIGH_DEL;
+    }
+
+    if(idx < 0)
+    {
+        if(tbl->count == MISC_NET_MAX_NEIGH)
+            return 0;
+        idx = tbl->count++;
+        tbl->ents[idx] = *neigh;
+        neighHashInsert(tbl->ipHash, neighHome(tbl, 0, idx), idx);
+        neighHashInsert(tbl->macHash, neighHome(tbl, 1, idx), idx);
+        return MISC_NET_NEIGH_NEW;
+    }
+
+    ent = &tbl->ents[idx];
+    if(memcmp(ent->mac, neigh->mac, MISC_NET_MAC_LEN) != 0)
+    {
+        neighHashRemove(tbl, 1, idx);
+        *ent = *neigh;
+        neighHashInsert(tbl->macHash, neighHome(tbl, 1, idx), idx);
+        return MISC_NET_NEIGH_CHANGE;
+    }
+
+    /* REACHABLE <-> STALE ... transitions are too frequent to notify */
+    ent->state = neigh->state;
+    ent->flags = neigh->flags;
+
+    return 0;
+}
+
+static int neighMsg(struct nlmsghdr *nlh, void *arg)
+{
+    neighMsgArg_t *nma = (neighMsgArg_t *)arg;
+    struct ndmsg *ndm = NLMSG_DATA(nlh);
+    struct rtattr *rta;
+    miscNetNeigh_t neigh;
+    int len, del, change, i, hasMac = 0, hasDst = 0;
+
+    if(nlh->nlmsg_type != RTM_NEWNEIGH && nlh->nlmsg_type != RTM_DELNEIGH)
+        return 0;
+    if(ndm->ndm_family != AF_INET && ndm->ndm_family != AF_INET6)
+        return 0;
+
+    memset(&neigh, 0, sizeof(neigh));
+    neigh.ifindex = ndm->ndm_ifindex;
+    neigh.family = ndm->ndm_family;
+    neigh.state = ndm->ndm_state;
+    neigh.flags = ndm->ndm_flags;
+
+    len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+    for(rta = RTM_RTA(ndm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+    {
+        if(rta->rta_type == NDA_DST)
+            hasDst = rtaCopy(rta, &neigh.addr, sizeof(neigh.addr)) > 0;
+        else if(rta->rta_type == NDA_LLADDR)
+            hasMac = rtaCopy(rta, neigh.mac, MISC_NET_MAC_LEN) == MISC_NET_MAC_LEN;
+    }
+    if(!hasDst)
+        return 0;
+
+    /* only resolved neighbors are kept, the cache maps ip <-> mac */
+    del = nlh->nlmsg_type == RTM_DELNEIGH || !hasMac ||
+          (neigh.state & (NUD_FAILED | NUD_INCOMPLETE));
+
+    change = neighSet(nma->tbl, &neigh, del);
+    if(change != 0 && nma->notify)
+    {
+        for(i = 0; i < gbl_neighCache.nsubs; i++)
+            (gbl_neighCache.subs[i].func)(change, &neigh, gbl_neighCache.subs[i].ctxArg);
+    }
+
+    return 0;
+}
+
+/* make the table being written the active one, wait for the old one */
+static int neighPublish(void)
+{
+    int old = gbl_neighCache.active;
+
+    __sync_synchronize();
+    gbl_neighCache.active = !old;
+    __sync_synchronize();
+
+    while(gbl_neighCache.readers[old] != 0)
+        sched_yield();
+
+    return old;
+}
+
+static const neighTable_t *neighReadBegin(int *slot)
+{
+    int idx;
+
+    while(1)
+    {
+        idx = gbl_neighCache.active;
+        __sync_fetch_and_add(&gbl_neighCache.readers[idx], 1);
+        /* the writer may have flipped before seeing us */
+        if(idx == gbl_neighCache.active)
+            break;
+        __sync_fetch_and_sub(&gbl_neighCache.readers[idx], 1);
+    }
+
+    *slot = idx;
+
+    return &gbl_neighCache.tables[idx];
+}
+
+static inline void neighReadEnd(int slot)
+{
+    __sync_fetch_and_sub(&gbl_neighCache.readers[slot], 1);
+}
+
+static int neighLoad(void)
+{
+    neighMsgArg_t nma;
+    int i, old;
+
+    nma.tbl = &gbl_neighCache.tables[!gbl_neighCache.active];
+    nma.notify = 0;
+    memset(nma.tbl, 0, sizeof(neighTable_t));
+    if(nlDump(gbl_neighCache.nlFd, RTM_GETNEIGH, AF_UNSPEC, neighMsg, &nma) != 0)
+        return -1;
+
+    old = neighPublish();
+    memcpy(&gbl_neighCache.tables[old], nma.tbl, sizeof(neighTable_t));
+
+    for(i = 0; i < gbl_neighCache.nsubs; i++)
+        (gbl_neighCache.subs[i].func)(MISC_NET_NEIGH_RELOAD, NULL,
+                                      gbl_neighCache.subs[i].ctxArg);
+
+    return 0;
+}
+
+int misc_netNeighInit(void)
+{
+    int fd;
+
+    if(gbl_neighCache.nlFd >= 0)
+        return 0;
+
+    if((fd = nlOpen(RTMGRP_NEIGH)) < 0)
+        return -1;
+
+    gbl_neighCache.nlFd = fd;
+    if(neighLoad() != 0)
+    {
+        misc_netNeighCleanup();
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return 0;
+}
+
+int misc_netNeighFd(void)
+{
+    return gbl_neighCache.nlFd;
+}
+
+int misc_netNeighUpdate(void)
+{
+    char buf[NL_BUFSZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+    neighMsgArg_t nma;
+    int fd = gbl_neighCache.nlFd;
+    int len, old, total = 0;
+
+    if(fd < 0)
+        return -1;
+
+    while(1)
+    {
+        len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if(len < 0)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+                break;
+            if(errno != ENOBUFS)
+                return -1;
+
+            /* notifications were lost, reload everything */
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            len = neighLoad();
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            if(len != 0)
+                return -1;
+            total++;
+            continue;
+        }
+
+        /* same messages on both tables, the subscribers see them once */
+        nma.tbl = &gbl_neighCache.tables[!gbl_neighCache.active];
+        nma.notify = 1;
+        total += nlParse(buf, len, neighMsg, &nma, NULL);
+
+        old = neighPublish();
+        nma.tbl = &gbl_neighCache.tables[old];
+        nma.notify = 0;
+        nlParse(buf, len, neighMsg, &nma, NULL);
+    }
+
+    return total;
+}
+
+void misc_netNeighCleanup(void)
+{
+    if(gbl_neighCache.nlFd >= 0)
+    {
+        close(gbl_neighCache.nlFd);
+        gbl_neighCache.nlFd = -1;
+    }
+}
+
+int misc_netNeighByIp(int family, const void *addr, miscNetNeigh_t *neigh)
+{
+    const neighTable_t *tbl;
+    int slot, idx;
+
+    tbl = neighReadBegin(&slot);
+    if((idx = neighFind(tbl, 0, family, addr)) >= 0)
+        *neigh = tbl->ents[idx];
+    neighReadEnd(slot);
+
+    return idx < 0 ? -1 : 0;
+}
+
+int misc_netNeighByMac(const unsigned char *mac, miscNetNeigh_t *neigh)
+{
+    const neighTable_t *tbl;
+    int slot, idx;
+
+    tbl = neighReadBegin(&slot);
+    if((idx = neighFindMac(tbl, mac)) >= 0)
+        *neigh = tbl->ents[idx];
+    neighReadEnd(slot);
+
+    return idx < 0 ? -1 : 0;
+}
+
+int misc_netNeighGetAll(miscNetNeigh_t *neighs, int max)
+{
+    const neighTable_t *tbl;
+    int slot, n;
+
+    tbl = neighReadBegin(&slot);
+    n = tbl->count < max ? tbl->count : max;
+    memcpy(neighs, tbl->ents, n * sizeof(miscNetNeigh_t));
+    neighReadEnd(slot);
+
+    return n;
+}
+
+int misc_netNeighSubscribe(miscNeighFunc_t func, void *ctxArg)
+{
+    if(gbl_neighCache.nsubs == MISC_NET_NEIGH_MAX_SUBS)
+        return -1;
+
+    gbl_neighCache.subs[gbl_neighCache.nsubs].func = func;
+    gbl_neighCache.subs[gbl_neighCache.nsubs].ctxArg = ctxArg;
+    gbl_neighCache.nsubs++;
+
+    return 0;
+}
+
+int misc_netNeighUnsubscribe(miscNeighFunc_t func, void *ctxArg)
+{
+    int i;
+
+    for(i = 0; i < gbl_neighCache.nsubs; i++)
+    {
+        if(gbl_neighCache.subs[i].func == func &&
+           gbl_neighCache.subs[i].ctxArg == ctxArg)
+        {
+            gbl_neighCache.subs[i] = gbl_neighCache.subs[--gbl_neighCache.nsubs];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/** Previous sample of one interface */
+typedef struct netStatsPrev
+{
+    char              name[MISC_NET_IFNAMSIZ];
+    miscNetCounters_t counters;
+} netStatsPrev_t;
+
+/** Internal statistics sampler handle. */
+typedef struct netStatsHandle
+{
+    int                fd;              /**< /proc/net/dev, kept open */
+    unsigned long long lastNs;          /**< time of the previous sample */
+    int                nprev;
+    netStatsPrev_t     prev[MISC_NET_MAX_IFS];
+    char               buf[NET_DEV_BUFSZ];
+} netStatsHandle_t;
+
+static unsigned long long netNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** 
+ * Parse the next decimal number, skipping leading blanks.
+ */
+static unsigned long long netParseNum(char **pp, char *end)
+{
+    unsigned long long v = 0;
+    char *p = *pp;
+
+    while(p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    while(p < end && *p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+
+    *pp = p;
+
+    return v;
+}
+
+/** 
+ * Per second rate of a counter. A counter going backwards was reset,
+ * unless it is a 32 bit one (drivers of 32 bit kernels) which wrapped:
+ * that is only assumed in a 32 bit build and when it was close to the
+ * top, a reset from the upper half reads as a wrap there.
+ */
+static unsigned long long netRate(unsigned long long cur,
+                                  unsigned long long prev,
+                                  unsigned long long ns)
+{
+    unsigned long long delta;
+
+    if(cur >= prev)
+        delta = cur - prev;
+    else if(sizeof(long) == 4 && prev <= 0xffffffffULL && prev >= 0x80000000ULL)
+        delta = cur + 0x100000000ULL - prev;
+    else
+        return 0;
+
+    /* delta * 1e9 overflows past 18GB, e.g. a fast link or a long gap */
+    return (unsigned long long)((double)delta * 1e9 / ns);
+}
+
+static netStatsPrev_t *netStatsPrev(netStatsHandle_t *nh, int hint,
+                                    const char *name)
+{
+    int i;
+
+    /* interfaces are usually listed in the same order every time */
+    if(hint < nh->nprev &&
+       strncmp(nh->prev[hint].name, name, MISC_NET_IFNAMSIZ) == 0)
+        return &nh->prev[hint];
+
+    for(i = 0; i < nh->nprev; i++)
+    {
+        if(strncmp(nh->prev[i].name, name, MISC_NET_IFNAMSIZ) == 0)
+            return &nh->prev[i];
+    }
+
+    return NULL;
+}
+
+int misc_netStatsInit(void **handle)
+{
+    netStatsHandle_t *nh;
+
+    if((nh = calloc(1, sizeof(netStatsHandle_t))) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    if((nh->fd = open(NET_DEV_FILE, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        perror("open " NET_DEV_FILE);
+        free(nh);
+        return -1;
+    }
+
+    *handle = nh;
+
+    return 0;
+}
+
+void misc_netStatsCleanup(void **handle)
+{
+    netStatsHandle_t *nh = (netStatsHandle_t *)(*handle);
+
+    if(nh == NULL)
+        return;
+
+    close(nh->fd);
+    free(nh);
+    *handle = NULL;
+}
+
+int misc_netStatsSample(void *handle, miscNetStats_t *stats, int max)
+{
+    netStatsHandle_t *nh = (netStatsHandle_t *)handle;
+    netStatsPrev_t cur[MISC_NET_MAX_IFS], *prev;
+    miscNetCounters_t *c, *pc;
+    unsigned long long now, ns;
+    char *p, *end, *line, *colon;
+    int len, n = 0, skip;
+
+    /* the whole table in one syscall, re-read from offset 0 */
+    len = pread(nh->fd, nh->buf, sizeof(nh->buf), 0);
+    if(len <= 0)
+        return -1;
+    now = netNowNs();
+    ns = nh->lastNs ? now - nh->lastNs : 0;
+
+    end = nh->buf + len;
+    for(p = nh->buf, skip = 2; p < end && n < max && n < MISC_NET_MAX_IFS; )
+    {
+        line = p;
+        while(p < end && *p != '\n')
+            p++;
+        if(p == end)
+            break;              /* truncated line */
+        p++;
+
+        /* two header lines */
+        if(skip > 0)
+        {
+            skip--;
+            continue;
+        }
+
+        for(colon = line; colon < p && *colon != ':'; colon++)
+            ;
+        if(colon == p)
+            continue;
+
+        while(*line == ' ')
+            line++;
+        len = colon - line;
+        if(len >= MISC_NET_IFNAMSIZ)
+            len = MISC_NET_IFNAMSIZ - 1;
+
+        memset(cur[n].name, 0, sizeof(cur[n].name));
+        memcpy(cur[n].name, line, len);
+
+        c = &cur[n].counters;
+        line = colon + 1;
+        c->rxBytes   = netParseNum(&line, p);
+        c->rxPackets = netParseNum(&line, p);
+        c->rxErrors  = netParseNum(&line, p);
+        c->rxDrops   = netParseNum(&line, p);
+        netParseNum(&line, p);  /* fifo */
+        netParseNum(&line, p);  /* frame */
+        netParseNum(&line, p);  /* compressed */
+        netParseNum(&line, p);  /* multicast */
+        c->txBytes   = netParseNum(&line, p);
+        c->txPackets = netParseNum(&line, p);
+        c->txErrors  = netParseNum(&line, p);
+        c->txDrops   = netParseNum(&line, p);
+
+        memcpy(stats[n].name, cur[n].name, sizeof(stats[n].name));
+        stats[n].total = *c;
+        memset(&stats[n].rate, 0, sizeof(stats[n].rate));
+
+        if(ns > 0 && (prev = netStatsPrev(nh, n, cur[n].name)) != NULL)
+        {
+            pc = &prev->counters;
+            stats[n].rate.rxBytes   = netRate(c->rxBytes, pc->rxBytes, ns);
+            stats[n].rate.rxPackets = netRate(c->rxPackets, pc->rxPackets, ns);
+            stats[n].rate.rxErrors  = netRate(c->rxErrors, pc->rxErrors, ns);
+            stats[n].rate.rxDrops   = netRate(c->rxDrops, pc->rxDrops, ns);
+            stats[n].rate.txBytes   = netRate(c->txBytes, pc->txBytes, ns);
+            stats[n].rate.txPackets = netRate(c->txPackets, pc->txPackets, ns);
+            stats[n].rate.txErrors  = netRate(c->txErrors, pc->txErrors, ns);
+            stats[n].rate.txDrops   = netRate(c->txDrops, pc->txDrops, ns);
+        }
+
+        n++;
+    }
+
+    memcpy(nh->prev, cur, n * sizeof(netStatsPrev_t));
+    nh->nprev = n;
+    nh->lastNs = now;
+
+    return n;
+}
+
+/** Internal capture handle. */
+typedef struct captureHandle
+{
+    int            fd;
+    unsigned char *ring;            /**< mmap'ed blocks */
+    size_t         ringSize;
+    unsigned int   blockSize;
+    unsigned int   blockCount;
+    unsigned int   current;         /**< next block to read */
+    int            ignoreOutgoing;
+} captureHandle_t;
+
+int misc_captureOpen(void **handle, const miscCaptureParams_t *params)
+{
+    captureHandle_t *ch;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    struct sock_fprog prog;
+    int version = TPACKET_V3;
+    int one = 1, fanout;
+
+    *handle = NULL;
+
+    if((ch = calloc(1, sizeof(captureHandle_t))) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    ch->ring = MAP_FAILED;
+    ch->blockSize = params->blockSize ? params->blockSize : CAPTURE_DEF_BLOCK_SIZE;
+    ch->blockCount = params->blockCount ? params->blockCount : CAPTURE_DEF_BLOCK_COUNT;
+    ch->ignoreOutgoing = params->ignoreOutgoing;
+
+    ch->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+    if(ch->fd < 0)
+    {
+        perror("packet socket");
+        goto err;
+    }
+
+    if(setsockopt(ch->fd, SOL_PACKET, PACKET_VERSION,
+                  &version, sizeof(version)) != 0)
+    {
+        perror("PACKET_VERSION");
+        goto err;
+    }
+
+    /* filter before bind, so no unfiltered frame gets into the ring */
+    if(params->filter != NULL && params->filterLen > 0)
+    {
+        prog.len = params->filterLen;
+        prog.filter = (struct sock_filter *)params->filter;
+        if(setsockopt(ch->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                      &prog, sizeof(prog)) != 0)
+        {
+            perror("SO_ATTACH_FILTER");
+            goto err;
+        }
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = ch->blockSize;
+    req.tp_block_nr = ch->blockCount;
+    req.tp_frame_size = CAPTURE_FRAME_SIZE;
+    req.tp_frame_nr = (ch->blockSize / CAPTURE_FRAME_SIZE) * ch->blockCount;
+    req.tp_retire_blk_tov = params->blockTimeoutMs ?
+        params->blockTimeoutMs : CAPTURE_DEF_TIMEOUT;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+    if(setsockopt(ch->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+    {
+        perror("PACKET_RX_RING");
+        goto err;
+    }
+
+    ch->ringSize = (size_t)ch->blockSize * ch->blockCount;
+    ch->ring = mmap(NULL, ch->ringSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ch->fd, 0);
+    if(ch->ring == MAP_FAILED)
+    {
+        perror("mmap");
+        goto err;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    if(params->ifname != NULL &&
+       (sll.sll_ifindex = if_nametoindex(params->ifname)) == 0)
+    {
+        perror("if_nametoindex");
+        goto err;
+    }
+    if(bind(ch->fd, (struct sockaddr *)&sll, sizeof(sll)) != 0)
+    {
+        perror("packet bind");
+        goto err;
+    }
+
+    /* not supported before 4.20, frames are then dropped in dispatch */
+    if(ch->ignoreOutgoing &&
+       setsockopt(ch->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+                  &one, sizeof(one)) == 0)
+        ch->ignoreOutgoing = 0;
+
+    if(params->fanoutGroup > 0)
+    {
+        fanout = (params->fanoutGroup & 0xffff) | (PACKET_FANOUT_HASH << 16);
+        if(setsockopt(ch->fd, SOL_PACKET, PACKET_FANOUT,
+                      &fanout, sizeof(fanout)) != 0)
+        {
+            perror("PACKET_FANOUT");
+            goto err;
+        }
+    }
+
+    *handle = ch;
+
+    return 0;
+
+err:
+    misc_captureClose((void **)&ch);
+    return -1;
+}
+
+int misc_captureFd(void *handle)
+{
+    return ((captureHandle_t *)handle)->fd;
+}
+
+int misc_captureDispatch(void *handle, int timeoutMs,
+                         miscCaptureFunc_t func, void *ctxArg)
+{
+    captureHandle_t *ch = (captureHandle_t *)handle;
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *hdr;
+    struct sockaddr_ll *sll;
+    miscCaptureFrame_t frame;
+    struct pollfd pfd;
+    unsigned int i;
+    int count = 0, waited = 0;
+
+    while(1)
+    {
+        bd = (struct tpacket_block_desc *)
+            (ch->ring + (size_t)ch->current * ch->blockSize);
+
+        if(!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+        {
+            if(count > 0 || waited || timeoutMs == 0)
+                break;
+
+            pfd.fd = ch->fd;
+            pfd.events = POLLIN | POLLERR;
+            pfd.revents = 0;
+            if(poll(&pfd, 1, timeoutMs) < 0 && errno != EINTR)
+                return -1;
+            waited = 1;
+            continue;
+        }
+
+        /* the block is ours until its status is given back */
+        __sync_synchronize();
+
+        hdr = (struct tpacket3_hdr *)((unsigned char *)bd +
+                                      bd->hdr.bh1.offset_to_first_pkt);
+        for(i = 0; i < bd->hdr.bh1.num_pkts; i++)
+        {
+            sll = (struct sockaddr_ll *)((unsigned char *)hdr +
+                                         TPACKET_ALIGN(sizeof(*hdr)));
+
+            if(!ch->ignoreOutgoing || sll->sll_pkttype != PACKET_OUTGOING)
+            {
+                frame.data = (unsigned char *)hdr + hdr->tp_mac;
+                frame.len = hdr->tp_snaplen;
+                frame.wireLen = hdr->tp_len;
+                frame.sec = hdr->tp_sec;
+                frame.nsec = hdr->tp_nsec;
+                frame.ifindex = sll->sll_ifindex;
+                frame.rxhash = hdr->hv1.tp_rxhash;
+                func(&frame, ctxArg);
+                count++;
+            }
+
+            hdr = (struct tpacket3_hdr *)((unsigned char *)hdr +
+                                          hdr->tp_next_offset);
+        }
+
+        __sync_synchronize();
+        bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+        ch->current = (ch->current + 1) % ch->blockCount;
+    }
+
+    return count;
+}
+
+int misc_captureStats(void *handle, unsigned int *packets, unsigned int *drops)
+{
+    captureHandle_t *ch = (captureHandle_t *)handle;
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    /* the kernel resets the counters on every read */
+    if(getsockopt(ch->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) != 0)
+        return -1;
+
+    *packets = st.tp_packets;
+    *drops = st.tp_drops;
+
+    return 0;
+}
+
+void misc_captureClose(void **handle)
+{
+    captureHandle_t *ch = (captureHandle_t *)(*handle);
+
+    if(ch == NULL)
+        return;
+
+    if(ch->ring != MAP_FAILED)
+        munmap(ch->ring, ch->ringSize);
+    if(ch->fd >= 0)
+        close(ch->fd);
+
+    free(ch);
+    *handle = NULL;
+}
+
+/** Internal batched udp handle. */
+typedef struct udpHandle
+{
+    int                      fd;
+    int                      batch;
+    int                      bufSize;   /**< per buffer, cache line multiple */
+    unsigned char           *pool;      /**< batch rx buffers then batch tx buffers */
+    struct mmsghdr          *rxMsgs;
+    struct mmsghdr          *txMsgs;
+    struct iovec            *iov;       /**< batch rx then batch tx */
+    struct sockaddr_storage *addrs;     /**< idem */
+    int                      txCount;   /**< queued datagrams */
+    int                      noMmsg;    /**< recvmmsg/sendmmsg missing (ENOSYS) */
+    int                      noGso;     /**< no UDP_SEGMENT in this kernel */
+    void                    *loop;
+    miscUdpFunc_t            func;
+    void                    *ctxArg;
+} udpHandle_t;
+
+int misc_udpInit(void **handle, int fd, int batch, int bufSize)
+{
+    udpHandle_t *uh;
+    void *pool;
+    socklen_t optLen;
+    int i, gso;
+
+    *handle = NULL;
+
+    if(batch <= 0)
+        batch = UDP_DEF_BATCH;
+    if(bufSize <= 0)
+        bufSize = UDP_DEF_BUFSZ;
+    /* no two buffers share a cache line */
+    bufSize = (bufSize + UDP_CACHELINE - 1) & ~(UDP_CACHELINE - 1);
+
+    if((uh = calloc(1, sizeof(udpHandle_t))) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    uh->fd = fd;
+    uh->batch = batch;
+    uh->bufSize = bufSize;
+
+    if(posix_memalign(&pool, UDP_CACHELINE, (size_t)bufSize * batch * 2) != 0)
+        pool = NULL;
+    uh->pool = pool;
+    uh->rxMsgs = calloc(batch, sizeof(struct mmsghdr));
+    uh->txMsgs = calloc(batch, sizeof(struct mmsghdr));
+    uh->iov = calloc(batch * 2, sizeof(struct iovec));
+    uh->addrs = calloc(batch * 2, sizeof(struct sockaddr_storage));
+    if(uh->pool == NULL || uh->rxMsgs == NULL || uh->txMsgs == NULL ||
+       uh->iov == NULL || uh->addrs == NULL)
+    {
+        perror("malloc");
+        misc_udpCleanup((void **)&uh);
+        return -1;
+    }
+
+    /* the rx headers never change, only the lengths are reset */
+    for(i = 0; i < batch; i++)
+    {
+        uh->iov[i].iov_base = uh->pool + (size_t)i * bufSize;
+        uh->iov[i].iov_len = bufSize;
+        uh->rxMsgs[i].msg_hdr.msg_iov = &uh->iov[i];
+        uh->rxMsgs[i].msg_hdr.msg_iovlen = 1;
+        uh->rxMsgs[i].msg_hdr.msg_name = &uh->addrs[i];
+
+        uh->iov[batch + i].iov_base = uh->pool + (size_t)(batch + i) * bufSize;
+        uh->txMsgs[i].msg_hdr.msg_iov = &uh->iov[batch + i];
+        uh->txMsgs[i].msg_hdr.msg_iovlen = 1;
+        uh->txMsgs[i].msg_hdr.msg_name = &uh->addrs[batch + i];
+    }
+
+    /*
+     * Kernels before UDP_SEGMENT ignore the cmsg and would send one big
+     * datagram, ask the socket whether it knows the option.
+     */
+    optLen = sizeof(gso);
+    if(getsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso, &optLen) != 0)
+        uh->noGso = 1;
+
+    *handle = uh;
+
+    return 0;
+}
+
+void misc_udpCleanup(void **handle)
+{
+    udpHandle_t *uh = (udpHandle_t *)(*handle);
+
+    if(uh == NULL)
+        return;
+
+    if(uh->loop != NULL)
+        misc_loopDelFd(uh->loop, uh->fd);
+
+    free(uh->pool);
+    free(uh->rxMsgs);
+    free(uh->txMsgs);
+    free(uh->iov);
+    free(uh->addrs);
+    free(uh);
+    *handle = NULL;
+}
+
+/* one recvfrom() per datagram, for kernels without recvmmsg */
+static int udpRecvSingle(udpHandle_t *uh)
+{
+    struct msghdr *mh;
+    ssize_t len;
+    int i;
+
+    for(i = 0; i < uh->batch; i++)
+    {
+        mh = &uh->rxMsgs[i].msg_hdr;
+        mh->msg_namelen = sizeof(struct sockaddr_storage);
+        len = recvfrom(uh->fd, uh->iov[i].iov_base, uh->bufSize, MSG_DONTWAIT,
+                       (struct sockaddr *)mh->msg_name, &mh->msg_namelen);
+        if(len < 0)
+            break;
+        uh->rxMsgs[i].msg_len = len;
+    }
+
+    if(i == 0)
+        return -1;
+
+    return i;
+}
+
+int misc_udpRecv(void *handle, miscUdpFunc_t func, void *ctxArg)
+{
+    udpHandle_t *uh = (udpHandle_t *)handle;
+    struct msghdr *mh;
+    int i, n = -1;
+
+    if(!uh->noMmsg)
+    {
+        for(i = 0; i < uh->batch; i++)
+            uh->rxMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+
+        n = recvmmsg(uh->fd, uh->rxMsgs, uh->batch, MSG_DONTWAIT, NULL);
+        if(n < 0 && errno == ENOSYS)
+            uh->noMmsg = 1;
+    }
+    if(uh->noMmsg)
+        n = udpRecvSingle(uh);
+
+    if(n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    for(i = 0; i < n; i++)
+    {
+        mh = &uh->rxMsgs[i].msg_hdr;
+        func(uh->iov[i].iov_base, uh->rxMsgs[i].msg_len,
+             (struct sockaddr *)mh->msg_name, mh->msg_namelen, ctxArg);
+    }
+
+    return n;
+}
+
+int misc_udpQueue(void *handle, const void *data, int len,
+                  const struct sockaddr *to, socklen_t toLen)
+{
+    udpHandle_t *uh = (udpHandle_t *)handle;
+    struct msghdr *mh;
+    struct iovec *iov;
+
+    if(len > uh->bufSize || toLen > sizeof(struct sockaddr_storage))
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if(uh->txCount == uh->batch && misc_udpFlush(uh) < 0)
+        return -1;
+
+    mh = &uh->txMsgs[uh->txCount].msg_hdr;
+    iov = mh->msg_iov;
+    memcpy(iov->iov_base, data, len);
+    iov->iov_len = len;
+    if(to != NULL)
+        memcpy(mh->msg_name, to, toLen);
+    mh->msg_namelen = to != NULL ? toLen : 0;
+    uh->txCount++;
+
+    return 0;
+}
+
+/* one sendmsg() per datagram, for kernels without sendmmsg */
+static int udpSendSingle(udpHandle_t *uh, int first)
+{
+    int i;
+
+    for(i = first; i < uh->txCount; i++)
+    {
+        if(sendmsg(uh->fd, &uh->txMsgs[i].msg_hdr, 0) < 0)
+            break;
+    }
+
+    if(i == first)
+        return -1;
+
+    return i - first;
+}
+
+int misc_udpFlush(void *handle)
+{
+    udpHandle_t *uh = (udpHandle_t *)handle;
+    int sent = 0, n;
+
+    while(sent < uh->txCount)
+    {
+        n = -1;
+        if(!uh->noMmsg)
+        {
+            n = sendmmsg(uh->fd, uh->txMsgs + sent, uh->txCount - sent, 0);
+            if(n < 0 && errno == ENOSYS)
+                uh->noMmsg = 1;
+        }
+        if(uh->noMmsg)
+            n = udpSendSingle(uh, sent);
+
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            /* the datagram that failed and the ones behind it are dropped */
+            uh->txCount = 0;
+            return -1;
+        }
+        sent += n;
+    }
+
+    uh->txCount = 0;
+
+    return sent;
+}
+
+int misc_udpSendSegmented(void *handle, const void *data, int len, int segSize,
+                          const struct sockaddr *to, socklen_t toLen)
+{
+    udpHandle_t *uh = (udpHandle_t *)handle;
+    char control[CMSG_SPACE(sizeof(unsigned short))];
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    const unsigned char *p = (const unsigned char *)data;
+    int off, chunk, segs;
+
+    if(segSize <= 0 || len < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    segs = (len + segSize - 1) / segSize;
+
+    if(!uh->noGso && segs > 1 && segs <= UDP_GSO_MAX_SEGS)
+    {
+        memset(&mh, 0, sizeof(mh));
+        iov.iov_base = (void *)data;
+        iov.iov_len = len;
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_name = (void *)to;
+        mh.msg_namelen = to != NULL ? toLen : 0;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+        *(unsigned short *)CMSG_DATA(cm) = segSize;
+
+        if(sendmsg(uh->fd, &mh, 0) == len)
+            return segs;
+
+        /*
+         * No checksum offload on the route (EIO), or this send does not
+         * suit GSO, e.g. a segment above the mtu (EINVAL): fall back for
+         * this call only.
+         */
+        if(errno == ENOPROTOOPT)
+            uh->noGso = 1;
+        else if(errno != EINVAL && errno != EIO)
+            return -1;
+    }
+
+    if(misc_udpFlush(uh) < 0)
+        return -1;
+    for(off = 0; off < len; off += chunk)
+    {
+        chunk = len - off < segSize ? len - off : segSize;
+        if(misc_udpQueue(uh, p + off, chunk, to, toLen) < 0)
+            return -1;
+    }
+    if(misc_udpFlush(uh) < 0)
+        return -1;
+
+    return segs;
+}
+
+static void udpLoopRead(int fd, int events, void *ctxArg)
+{
+    udpHandle_t *uh = (udpHandle_t *)ctxArg;
+
+    /* level triggered, a full batch per wakeup keeps other fds served */
+    misc_udpRecv(uh, uh->func, uh->ctxArg);
+}
+
+int misc_udpAttach(void *handle, void *loop, miscUdpFunc_t func, void *ctxArg)
+{
+    udpHandle_t *uh = (udpHandle_t *)handle;
+
+    uh->func = func;
+    uh->ctxArg = ctxArg;
+    if(misc_loopAddFd(loop, uh->fd, MISC_LOOP_READ, udpLoopRead, uh) != 0)
+        return -1;
+    uh->loop = loop;
+
+    return 0;
+}
+
 char *misc_getIpAddress(char *ifname)
 {
 	struct ifreq ifr;
 	struct sockaddr_in *saddr;
 	int fd;
 	char *address = "0.0.0.0";
+	const struct in_addr *primary;
+	miscNetIf_t nif;
+	char buf[INET_ADDRSTRLEN];
+
+	/* served from the interface cache when it runs, no syscalls */
+	if(netCacheFind(ifname, &nif) == 0)
+	{
+		if((primary = netIfPrimary(&nif)) != NULL &&
+		   inet_ntop(AF_INET, primary, buf, sizeof(buf)) != NULL)
+			address = strdup(buf);
+		return address;
+	}
 
 	fd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
 	if(fd == -1)
@@ -45,6 +1844,15 @@ char *misc_getMacAddress(char *ifname)
     int fd;
     char *address = NULL;
     static char pMac[18] = "";
+    miscNetIf_t nif;
+
+    if(netCacheFind(ifname, &nif) == 0)
+    {
+        address = (char *)nif.mac;
+        sprintf(pMac, "%02hhX:%02hhX:%02hhX:%02hhX:%02hhX:%02hhX" ,*address, *(address+1), *(address+2), *(address+3), *(address+4), *(address+5));
+        return pMac;
+    }
+
     fd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
     if(fd == -1)
     {
@@ -1,7 +1,376 @@
 #ifndef _MISC_NET_H_
 #define _MISC_NET_H_
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+
+#define MISC_NET_MAX_IFS    32
+#define MISC_NET_MAX_ADDRS  8   /**< addresses kept per interface */
+#define MISC_NET_MAC_LEN    6
+#define MISC_NET_IFNAMSIZ   16
+#define MISC_NET_MAX_NEIGH  512
+#define MISC_NET_NEIGH_MAX_SUBS 8
+
+/** Neighbor cache changes, passed to the miscNeighFunc_t subscribers */
+#define MISC_NET_NEIGH_NEW     1
+#define MISC_NET_NEIGH_CHANGE  2    /**< the MAC of an address changed */
+#define MISC_NET_NEIGH_DEL     3
+#define MISC_NET_NEIGH_RELOAD  4    /**< notifications were lost, neigh is NULL */
+
+/** One address of an interface */
+typedef struct miscNetAddr
+{
+    int            family;      /**< AF_INET or AF_INET6 */
+    int            prefixLen;
+    unsigned int   flags;       /**< IFA_F_XXX, e.g. IFA_F_SECONDARY */
+    unsigned char  scope;       /**< RT_SCOPE_XXX */
+    union
+    {
+        struct in_addr  v4;
+        struct in6_addr v6;
+    } addr;
+} miscNetAddr_t;
+
+/** One interface, as returned by misc_netGetInterfaces() */
+typedef struct miscNetIf
+{
+    int            index;
+    char           name[MISC_NET_IFNAMSIZ];
+    unsigned int   flags;       /**< IFF_XXX */
+    int            mtu;
+    unsigned char  mac[MISC_NET_MAC_LEN];
+    int            naddrs;
+    miscNetAddr_t  addrs[MISC_NET_MAX_ADDRS];
+} miscNetIf_t;
+
+/** Interface counters, as totals or per second rates */
+typedef struct miscNetCounters
+{
+    unsigned long long rxBytes;
+    unsigned long long rxPackets;
+    unsigned long long rxErrors;
+    unsigned long long rxDrops;
+    unsigned long long txBytes;
+    unsigned long long txPackets;
+    unsigned long long txErrors;
+    unsigned long long txDrops;
+} miscNetCounters_t;
+
+/** One interface, as returned by misc_netStatsSample() */
+typedef struct miscNetStats
+{
+    char              name[MISC_NET_IFNAMSIZ];
+    miscNetCounters_t total;    /**< counters at this sample */
+    miscNetCounters_t rate;     /**< per second since the previous sample */
+} miscNetStats_t;
+
+/** One resolved neighbor (ARP or NDP entry) */
+typedef struct miscNetNeigh
+{
+    int             ifindex;
+    int             family;     /**< AF_INET or AF_INET6 */
+    unsigned short  state;      /**< NUD_XXX */
+    unsigned char   flags;      /**< NTF_XXX */
+    union
+    {
+        struct in_addr  v4;
+        struct in6_addr v6;
+    } addr;
+    unsigned char   mac[MISC_NET_MAC_LEN];
+} miscNetNeigh_t;
+
+typedef void (*miscNeighFunc_t)(int change, const miscNetNeigh_t *neigh, void *ctxArg);
+
+/** Capture ring settings, zero fields take the defaults */
+typedef struct miscCaptureParams
+{
+    const char   *ifname;         /**< interface, NULL for all of them */
+    unsigned int  blockSize;      /**< ring block, power of 2 multiple of the page size, 1MB */
+    unsigned int  blockCount;     /**< ring blocks, 8 */
+    int           blockTimeoutMs; /**< hand over a partly filled block after, 10ms */
+    int           fanoutGroup;    /**< >0: share the traffic by flow hash with the
+                                   *   other sockets of this group, e.g. one per thread */
+    const struct sock_filter *filter; /**< classic BPF program, or NULL */
+    int           filterLen;      /**< instructions in filter */
+    int           ignoreOutgoing; /**< skip frames sent by this host, the
+                                   *   loopback interface shows every frame twice */
+} miscCaptureParams_t;
+
+/** A captured frame, data points into the ring and is only valid
+ *  during the callback */
+typedef struct miscCaptureFrame
+{
+    const unsigned char *data;
+    unsigned int         len;       /**< bytes captured */
+    unsigned int         wireLen;   /**< length on the wire */
+    unsigned int         sec;
+    unsigned int         nsec;
+    int                  ifindex;
+    unsigned int         rxhash;
+} miscCaptureFrame_t;
+
+typedef void (*miscCaptureFunc_t)(const miscCaptureFrame_t *frame, void *ctxArg);
+
+/** Called for every datagram received, data is only valid during the call */
+typedef void (*miscUdpFunc_t)(const unsigned char *data, int len,
+                              const struct sockaddr *from, socklen_t fromLen,
+                              void *ctxArg);
+
+/** 
+ * Get the IPv4 address of an interface as a strdup'd string, or
+ * "0.0.0.0" if it has none. Served from the interface cache when
+ * misc_netCacheInit() was called.
+ */
 char *misc_getIpAddress(char *ifname);
+
+/** 
+ * Get the MAC address of an interface, the string is static.
+ */
 char *misc_getMacAddress(char *ifname);
 
+/** 
+ * Start the interface cache: load all links (flags, mtu, mac) and
+ * their IPv4 and IPv6 addresses, up to MISC_NET_MAX_ADDRS each, with
+ * netlink dumps and subscribe to their change notifications.
+ * Lookups then read the cache without locks nor syscalls.
+ *
+ * The cache is updated by misc_netCacheUpdate(), call it when
+ * misc_netCacheFd() is readable, e.g. from a misc_loop fd callback.
+ * 
+ * @return 0 on success, -1 on error
+ */
+int misc_netCacheInit(void);
+
+int misc_netCacheFd(void);
+
+/** 
+ * Apply the pending netlink notifications to the cache, reloads it
+ * if notifications were lost. Only one thread may call it.
+ * 
+ * @return number of notifications applied, -1 on error
+ */
+int misc_netCacheUpdate(void);
+
+void misc_netCacheCleanup(void);
+
+/** 
+ * Start the neighbor cache: load the ARP and NDP tables with one
+ * netlink dump and follow their changes. Only resolved neighbors are
+ * kept. Lookups are hashed by IP and by MAC, lock-free and safe from
+ * any thread.
+ *
+ * Like the interface cache, call misc_netNeighUpdate() when
+ * misc_netNeighFd() is readable.
+ * 
+ * @return 0 on success, -1 on error
+ */
+int misc_netNeighInit(void);
+
+int misc_netNeighFd(void);
+
+/** 
+ * Apply the pending notifications and call the subscribers, from a
+ * single thread. Waits for the lookups still running on the old
+ * snapshot, so don't call it from a subscriber.
+ * 
+ * @return number of notifications applied, -1 on error
+ */
+int misc_netNeighUpdate(void);
+
+void misc_netNeighCleanup(void);
+
+/** 
+ * Look up a neighbor by address, on any interface.
+ * 
+ * @param family AF_INET or AF_INET6
+ * @param addr struct in_addr or struct in6_addr
+ * @param neigh filled on success
+ * 
+ * @return 0 on success, -1 if unknown
+ */
+int misc_netNeighByIp(int family, const void *addr, miscNetNeigh_t *neigh);
+
+/** 
+ * Look up a neighbor by MAC, the first match if several addresses
+ * (e.g. IPv4 and IPv6) share it.
+ */
+int misc_netNeighByMac(const unsigned char *mac, miscNetNeigh_t *neigh);
+
+/** 
+ * Copy all the neighbors of a consistent snapshot.
+ * 
+ * @return number of neighbors copied
+ */
+int misc_netNeighGetAll(miscNetNeigh_t *neighs, int max);
+
+/** 
+ * Call func from misc_netNeighUpdate() on every new, changed or
+ * deleted neighbor. State only transitions (REACHABLE, STALE ...)
+ * are not reported.
+ * 
+ * @return 0 on success, -1 if too many subscribers
+ */
+int misc_netNeighSubscribe(miscNeighFunc_t func, void *ctxArg);
+
+int misc_netNeighUnsubscribe(miscNeighFunc_t func, void *ctxArg);
+
+/** 
+ * Get the primary IPv4 address of an interface from the cache.
+ * 
+ * @return 0 on success, -1 if unknown or without address
+ */
+int misc_netCacheGetIp(const char *ifname, struct in_addr *addr);
+
+int misc_netCacheGetMac(const char *ifname, unsigned char *mac);
+
+/** 
+ * Get all interfaces with their IPv4 and IPv6 addresses in one pass:
+ * a copy of the cache when it runs, a single netlink dump otherwise.
+ * 
+ * @param ifs array filled by the call
+ * @param maxIfs number of entries in ifs
+ * 
+ * @return number of interfaces filled, -1 on error
+ */
+int misc_netGetInterfaces(miscNetIf_t *ifs, int maxIfs);
+
+/** 
+ * Format an address as "192.168.1.1/24" or "fe80::1/64".
+ * 
+ * @return length of the string, -1 on error
+ */
+int misc_netAddrToStr(const miscNetAddr_t *addr, char *buf, int size);
+
+int misc_netMacToStr(const unsigned char *mac, char *buf, int size);
+
+/** 
+ * Create an interface statistics sampler. It keeps /proc/net/dev
+ * open and the previous sample of every interface, so sampling does
+ * no allocation, no stdio and a single pread().
+ * 
+ * @param handle 
+ * 
+ * @return 0 on success, -1 on error
+ */
+int misc_netStatsInit(void **handle);
+
+void misc_netStatsCleanup(void **handle);
+
+/** 
+ * Sample all interfaces, the rates are per second since the previous
+ * call and 0 on the first one.
+ * 
+ * @param handle 
+ * @param stats array filled by the call
+ * @param max number of entries in stats
+ * 
+ * @return number of interfaces filled, -1 on error
+ */
+int misc_netStatsSample(void *handle, miscNetStats_t *stats, int max);
+
+/** 
+ * Open an AF_PACKET socket with a TPACKET_V3 mmap'ed ring, frames are
+ * handed to the callback in place, without any copy. Needs
+ * CAP_NET_RAW.
+ * 
+ * @param handle 
+ * @param params 
+ * 
+ * @return 0 on success, -1 on error
+ */
+int misc_captureOpen(void **handle, const miscCaptureParams_t *params);
+
+/** 
+ * The socket fd, readable when a block is ready, e.g. for misc_loop.
+ */
+int misc_captureFd(void *handle);
+
+/** 
+ * Pass the frames of all ready blocks to func and give the blocks
+ * back to the kernel. Waits up to timeoutMs if no block is ready.
+ * 
+ * @param handle 
+ * @param timeoutMs 0 does not wait, -1 waits forever
+ * @param func 
+ * @param ctxArg 
+ * 
+ * @return number of frames, -1 on error
+ */
+int misc_captureDispatch(void *handle, int timeoutMs,
+                         miscCaptureFunc_t func, void *ctxArg);
+
+/** 
+ * Get the frames received and dropped since the previous call.
+ */
+int misc_captureStats(void *handle, unsigned int *packets, unsigned int *drops);
+
+void misc_captureClose(void **handle);
+
+/** 
+ * Batched datagram I/O on a udp socket: up to batch datagrams per
+ * recvmmsg()/sendmmsg() call, into a cache aligned buffer pool
+ * allocated once. Falls back to one call per datagram on kernels
+ * without them.
+ * 
+ * @param handle 
+ * @param fd udp socket, owned by the caller
+ * @param batch datagrams per call, 0 for 32
+ * @param bufSize largest datagram, 0 for 2048
+ * 
+ * @return 0 on success, -1 on error
+ */
+int misc_udpInit(void **handle, int fd, int batch, int bufSize);
+
+void misc_udpCleanup(void **handle);
+
+/** 
+ * Receive up to one batch of datagrams without blocking.
+ * 
+ * @return datagrams passed to func, 0 if none was pending, -1 on error
+ */
+int misc_udpRecv(void *handle, miscUdpFunc_t func, void *ctxArg);
+
+/** 
+ * Copy a datagram into the send batch, the batch is flushed when it
+ * is full.
+ * 
+ * @param handle 
+ * @param data 
+ * @param len up to bufSize
+ * @param to destination, NULL on a connected socket
+ * @param toLen 
+ * 
+ * @return 0 on success, -1 on error
+ */
+int misc_udpQueue(void *handle, const void *data, int len,
+                  const struct sockaddr *to, socklen_t toLen);
+
+/** 
+ * Send the queued datagrams.
+ * 
+ * @return datagrams sent, -1 on error (the unsent ones are dropped)
+ */
+int misc_udpFlush(void *handle);
+
+/** 
+ * Send len bytes as datagrams of segSize bytes (the last one may be
+ * shorter) with a single UDP_SEGMENT (GSO) send, or through the batch
+ * if the kernel refuses it. Flushes the queued datagrams first when
+ * falling back.
+ * 
+ * @param len 0 or more
+ * @param segSize 1 or more
+ * 
+ * @return datagrams sent, -1 on error (EINVAL for a bad len or segSize)
+ */
+int misc_udpSendSegmented(void *handle, const void *data, int len, int segSize,
+                          const struct sockaddr *to, socklen_t toLen);
+
+/** 
+ * Receive from a misc_loop, func is called for every datagram.
+ * misc_udpCleanup() removes the fd from the loop.
+ */
+int misc_udpAttach(void *handle, void *loop, miscUdpFunc_t func, void *ctxArg);
+
 #endif
@@ -1,9 +1,10 @@
 /* #define F_DEBUG */
-#ifdef F_DEBUG
-#include <errno.h>
-#endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <time.h>
 #include <syslog.h>
@@ -12,8 +13,15 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/vfs.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "misc_oil.h"
+#include "misc_seqlock.h"
 #include "libmisc.h"
 
 #ifndef TIMESPEC_TO_TIMEVAL
@@ -48,6 +56,379 @@ void oil_tmsGet(oilTimeStamp_t *ts)
     }
 }
 
+/*
+ * Cycle counter timestamps. The counter is scaled with
+ * ns = baseNs + ((cycles - baseCycles) * mult >> 32), the parameters
+ * being recalibrated against CLOCK_MONOTONIC once per TMS_RECAL_NS by
+ * the first reader noticing it. A recalibration keeps the time
+ * continuous and steers the slope so the error is absorbed over the
+ * next period. The new base is a little ahead of what the readers
+ * still on the old parameters can reach, so the time never goes back.
+ *
+ * Only an invariant x86-64 TSC serves oil_tmsNs(): the MIPS Count
+ * register is 32 bits and wraps within seconds, so there it only times
+ * intervals through oil_tmsCycles().
+ */
+#if defined(__x86_64__)
+#include <cpuid.h>
+#elif defined(__mips__)
+#include <signal.h>
+#include <setjmp.h>
+#endif
+
+#define TMS_CLOCK       0               /* clock_gettime() only */
+#define TMS_CYCLES      1               /* counter for intervals only */
+#define TMS_COUNTER     2               /* counter for oil_tmsNs() too */
+#define TMS_RECAL_NS    1000000000ULL
+#define TMS_INIT_NS     2000000         /* first calibration interval */
+#define TMS_STEP_NS     50000000LL      /* errors above are stepped */
+#define TMS_HZ_SLEW     0.001           /* rate change per period, at most */
+#define TMS_GUARD_NS    1000            /* rebase ahead of the old readers */
+#ifdef __mips__
+#define TMS_MASK        0xffffffffULL   /* Count is 32 bits */
+#else
+#define TMS_MASK        (~0ULL)
+#endif
+
+typedef struct tmsParams
+{
+    unsigned long long baseCycles;
+    unsigned long long baseNs;
+    unsigned long long mult;            /**< ns per cycle << 32 */
+    unsigned long long recalCycles;
+    double             hz;
+} tmsParams_t;
+
+static struct
+{
+    pthread_once_t        once;
+    volatile int          ready;        /**< once done, skips pthread_once() */
+    int                   mode;         /**< TMS_XXX */
+    volatile int          calibrating;
+    unsigned long long    lastCycles;   /**< previous calibration point */
+    unsigned long long    lastNs;
+    volatile unsigned int seq;
+    tmsParams_t           params;
+} gbl_tms = { PTHREAD_ONCE_INIT };
+
+static unsigned long long tmsClockNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * NSECS_IN_SEC + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+static unsigned long long tmsCounter(void)
+{
+    unsigned int lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+/* the TSC only tells time if it ticks at a constant rate in all states */
+static int tmsProbe(void)
+{
+    unsigned int a, b, c, d;
+
+    if(__get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1 << 8)))
+        return TMS_COUNTER;
+
+    return TMS_CLOCK;
+}
+
+static unsigned long long tmsScale(const tmsParams_t *p, unsigned long long delta)
+{
+    return (unsigned long long)(((unsigned __int128)delta * p->mult) >> 32);
+}
+#elif defined(__mips__)
+static sigjmp_buf gbl_tmsJmp;
+
+static unsigned long long tmsCounter(void)
+{
+    unsigned int count;
+
+    __asm__ __volatile__(".set push\n"
+                         ".set mips32r2\n"
+                         "rdhwr %0, $2\n"
+                         ".set pop" : "=r"(count));
+
+    return count;
+}
+
+static void tmsSigill(int sig)
+{
+    siglongjmp(gbl_tmsJmp, 1);
+}
+
+/* rdhwr $2 traps unless the cpu is r2 and the kernel allows it */
+static int tmsProbe(void)
+{
+    struct sigaction sa, old;
+    volatile int mode = TMS_CLOCK;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = tmsSigill;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGILL, &sa, &old);
+
+    if(sigsetjmp(gbl_tmsJmp, 1) == 0)
+    {
+        tmsCounter();
+        mode = TMS_CYCLES;
+    }
+    sigaction(SIGILL, &old, NULL);
+
+    return mode;
+}
+
+static unsigned long long tmsScale(const tmsParams_t *p, unsigned long long delta)
+{
+    return (unsigned long long)(delta * 1e9 / p->hz);
+}
+#else
+static unsigned long long tmsCounter(void)
+{
+    return 0;
+}
+
+static int tmsProbe(void)
+{
+    return TMS_CLOCK;
+}
+
+static unsigned long long tmsScale(const tmsParams_t *p, unsigned long long delta)
+{
+    return 0;
+}
+#endif
+
+/* a (cycles, ns) pair, the tightest of a few clock reads */
+static void tmsSample(unsigned long long *cycles, unsigned long long *ns)
+{
+    unsigned long long c0, c1, n, best = ~0ULL;
+    int i;
+
+    for(i = 0; i < 3; i++)
+    {
+        c0 = tmsCounter();
+        n = tmsClockNs();
+        c1 = tmsCounter();
+        if(c1 - c0 < best)
+        {
+            best = c1 - c0;
+            *cycles = c0 + (c1 - c0) / 2;
+            *ns = n;
+        }
+    }
+}
+
+static void tmsSetParams(const tmsParams_t *p)
+{
+    misc_seqWriteBegin(&gbl_tms.seq);
+    gbl_tms.params = *p;
+    misc_seqWriteEnd(&gbl_tms.seq);
+}
+
+/* rate from a short interval, for the first period */
+static int tmsCalibrate(void)
+{
+    struct timespec ts = { 0, TMS_INIT_NS };
+    unsigned long long c0, n0, c1, n1;
+    tmsParams_t p;
+
+    tmsSample(&c0, &n0);
+    nanosleep(&ts, NULL);
+    tmsSample(&c1, &n1);
+
+    if(((c1 - c0) & TMS_MASK) == 0 || n1 == n0)
+        return -1;
+
+    memset(&p, 0, sizeof(p));
+    p.hz = (double)((c1 - c0) & TMS_MASK) * NSECS_IN_SEC / (n1 - n0);
+    p.baseCycles = c1;
+    p.baseNs = n1;
+    p.mult = (unsigned long long)(NSECS_IN_SEC * 4294967296.0 / p.hz);
+    p.recalCycles = (unsigned long long)(p.hz * TMS_RECAL_NS / NSECS_IN_SEC);
+    gbl_tms.lastCycles = c1;
+    gbl_tms.lastNs = n1;
+    tmsSetParams(&p);
+
+    return 0;
+}
+
+static void tmsInit(void)
+{
+    gbl_tms.mode = tmsProbe();
+    if(gbl_tms.mode != TMS_CLOCK && tmsCalibrate() != 0)
+        gbl_tms.mode = TMS_CLOCK;
+    __sync_synchronize();
+    gbl_tms.ready = 1;
+}
+
+/*
+ * Measure the rate over the time since the last calibration, and
+ * rebase from the current parameters so the time stays continuous,
+ * steering the slope to catch up the clock within the next period.
+ *
+ * @return the time now
+ */
+static unsigned long long tmsRecalibrate(void)
+{
+    tmsParams_t old = gbl_tms.params, p = old;
+    unsigned long long cycles, ns, dn, now, base;
+    double hz;
+    long long err;
+
+    tmsSample(&cycles, &ns);
+    now = old.baseNs + tmsScale(&old, cycles - old.baseCycles);
+
+    dn = ns - gbl_tms.lastNs;
+    if(dn >= TMS_RECAL_NS / 2)
+    {
+        /*
+         * The rate of an invariant counter does not change: a big
+         * difference is a distorted interval (a counter going on
+         * through a suspend or a paused VM), follow it slowly only.
+         */
+        hz = (double)(cycles - gbl_tms.lastCycles) * NSECS_IN_SEC / dn;
+        if(hz > p.hz * (1 + TMS_HZ_SLEW))
+            hz = p.hz * (1 + TMS_HZ_SLEW);
+        else if(hz < p.hz * (1 - TMS_HZ_SLEW))
+            hz = p.hz * (1 - TMS_HZ_SLEW);
+        p.hz = hz;
+        gbl_tms.lastCycles = cycles;
+        gbl_tms.lastNs = ns;
+    }
+    p.recalCycles = (unsigned long long)(p.hz * TMS_RECAL_NS / NSECS_IN_SEC);
+    p.mult = (unsigned long long)(NSECS_IN_SEC * 4294967296.0 / p.hz);
+
+    /* far behind (e.g. suspended): step, never back so steer if ahead */
+    err = (long long)(ns - now);
+    if(err <= TMS_STEP_NS)
+    {
+        if(err < -TMS_STEP_NS)
+            err = -TMS_STEP_NS;
+        p.mult += (long long)p.mult * err / (long long)TMS_RECAL_NS;
+    }
+
+    /*
+     * Readers which keep the old parameters read the counter before
+     * the write starts, give or take another cpu's skew: base the new
+     * ones past that, on the old slope. Until the counter gets there
+     * the time stands still.
+     */
+    misc_seqWriteBegin(&gbl_tms.seq);
+    base = tmsCounter() + (unsigned long long)(p.hz * TMS_GUARD_NS / NSECS_IN_SEC);
+    p.baseNs = old.baseNs + tmsScale(&old, base - old.baseCycles);
+    if(err > TMS_STEP_NS)
+    {
+        now = ns + tmsScale(&p, base - cycles);
+        if(now > p.baseNs)
+            p.baseNs = now;
+    }
+    p.baseCycles = base;
+    gbl_tms.params = p;
+    misc_seqWriteEnd(&gbl_tms.seq);
+
+    return p.baseNs;
+}
+
+unsigned long long oil_tmsNs(void)
+{
+    tmsParams_t p;
+    unsigned long long cycles, delta, ns;
+    unsigned int seq;
+
+    if(!gbl_tms.ready)
+        pthread_once(&gbl_tms.once, tmsInit);
+
+    if(gbl_tms.mode != TMS_COUNTER)
+        return tmsClockNs();
+
+    /*
+     * misc_seqReadBegin() would fence twice per read: x86 keeps loads
+     * in order, a compiler barrier is enough.
+     */
+    do
+    {
+        seq = gbl_tms.seq;
+        __asm__ __volatile__("" ::: "memory");
+        p = gbl_tms.params;
+        cycles = tmsCounter();
+        __asm__ __volatile__("" ::: "memory");
+    } while((seq & 1) || seq != gbl_tms.seq);
+
+    /* another cpu's counter may lag the base by a few cycles */
+    delta = cycles > p.baseCycles ? cycles - p.baseCycles : 0;
+
+    if(delta >= p.recalCycles &&
+       __sync_bool_compare_and_swap(&gbl_tms.calibrating, 0, 1))
+    {
+        /* the previous calibrator may just have finished */
+        if(gbl_tms.params.baseCycles != p.baseCycles)
+        {
+            gbl_tms.calibrating = 0;
+            return oil_tmsNs();
+        }
+        ns = tmsRecalibrate();
+        __sync_synchronize();
+        gbl_tms.calibrating = 0;
+        return ns;
+    }
+
+    return p.baseNs + tmsScale(&p, delta);
+}
+
+int oil_tmsCalibrate(void)
+{
+    pthread_once(&gbl_tms.once, tmsInit);
+
+    if(gbl_tms.mode == TMS_CLOCK)
+        return -1;
+
+    while(!__sync_bool_compare_and_swap(&gbl_tms.calibrating, 0, 1))
+        sched_yield();
+    if(gbl_tms.mode == TMS_COUNTER)
+        tmsRecalibrate();
+    else
+        tmsCalibrate();
+    __sync_synchronize();
+    gbl_tms.calibrating = 0;
+
+    return 0;
+}
+
+unsigned long long oil_tmsCycles(void)
+{
+    pthread_once(&gbl_tms.once, tmsInit);
+
+    return gbl_tms.mode != TMS_CLOCK ? tmsCounter() : 0;
+}
+
+unsigned long long oil_tmsCyclesToNs(unsigned long long cycles)
+{
+    tmsParams_t p;
+    unsigned int seq;
+
+    pthread_once(&gbl_tms.once, tmsInit);
+
+    if(gbl_tms.mode == TMS_CLOCK)
+        return 0;
+
+    do
+    {
+        seq = misc_seqReadBegin(&gbl_tms.seq);
+        p = gbl_tms.params;
+    } while(misc_seqReadRetry(&gbl_tms.seq, seq));
+
+    return (unsigned long long)((cycles & TMS_MASK) * 1e9 / p.hz);
+}
+
 void oil_openlog(void)
 {
    openlog(NULL, 0, LOG_DAEMON);
@@ -181,27 +562,936 @@ void oil_shmCleanup(int shmId, void *shmAddr)
    return;
 }
 
+/*
+ * Named shared memory regions: shm_open() (or memfd_create() for
+ * anonymous ones) + mmap(). The region starts with a header telling
+ * its layout version and size, the caller's data follows, cache line
+ * aligned.
+ */
+#define SHM_MAGIC       0x4f53484d      /* "OSHM" */
+#define SHM_HDR_SIZE    64
+#define SHM_HUGE_SIZE   (2 * 1024 * 1024)
+#define SHM_WAIT_MS     1000            /* for the creator to size it */
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC     0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB     0x0004U
+#endif
+#if !defined(SYS_memfd_create) && defined(__NR_memfd_create)
+#define SYS_memfd_create __NR_memfd_create
+#endif
+
+typedef struct shmHdr
+{
+    volatile unsigned int magic;    /**< set last, once initialized */
+    unsigned int          version;  /**< caller's layout version */
+    unsigned int          hdrSize;
+    unsigned int          flags;
+    volatile unsigned long long size;   /**< file size, grows only */
+} shmHdr_t;
+
+typedef struct shmRegion
+{
+    int       fd;
+    void     *map;
+    size_t    mapSize;
+    shmHdr_t *hdr;
+} shmRegion_t;
+
+static int shmMemfd(const char *name, int flags)
+{
+#ifdef SYS_memfd_create
+    int fd = -1;
+
+    if(flags & OIL_SHM_HUGETLB)
+        fd = syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_HUGETLB);
+    if(fd < 0)
+        fd = syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+
+    return fd;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static size_t shmRound(size_t size, size_t unit)
+{
+    return (size + unit - 1) / unit * unit;
+}
+
+/* map fd, created tells whether the header is ours to fill */
+static int shmMap(void **region, int fd, int created, int size,
+                  unsigned int version, int flags)
+{
+    shmRegion_t *sr;
+    struct stat st;
+    size_t want, unit;
+    int i, mflags = MAP_SHARED;
+
+    want = SHM_HDR_SIZE + size;
+
+    /* the creator may not have sized it yet */
+    for(i = 0; ; i++)
+    {
+        if(fstat(fd, &st) != 0)
+        {
+            perror("fstat");
+            return -1;
+        }
+        if(created || st.st_size > 0 || i >= SHM_WAIT_MS)
+            break;
+        usleep(1000);
+    }
+    if(!created && st.st_size == 0 && size == 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if((size_t)st.st_size < want)
+    {
+        /* openers racing to size it: look again under the lock so it
+           only ever grows under someone else's mapping */
+        flock(fd, LOCK_EX);
+        if(fstat(fd, &st) != 0)
+        {
+            perror("fstat");
+            flock(fd, LOCK_UN);
+            return -1;
+        }
+    }
+    if((size_t)st.st_size < want)
+    {
+        /* hugetlbfs files can only be sized in huge pages */
+        unit = (flags & OIL_SHM_HUGETLB) && (flags & OIL_SHM_ANON) ?
+            SHM_HUGE_SIZE : (size_t)getpagesize();
+        want = shmRound(want, unit);
+        if(ftruncate(fd, want) != 0 &&
+           ftruncate(fd, want = shmRound(SHM_HDR_SIZE + size, getpagesize())) != 0)
+        {
+            perror("ftruncate");
+            flock(fd, LOCK_UN);
+            return -1;
+        }
+    }
+    else
+        want = st.st_size;
+    flock(fd, LOCK_UN);
+
+    if(flags & OIL_SHM_POPULATE)
+        mflags |= MAP_POPULATE;
+
+    if((sr = calloc(1, sizeof(shmRegion_t))) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    sr->map = mmap(NULL, want, PROT_READ | PROT_WRITE, mflags, fd, 0);
+    if(sr->map == MAP_FAILED)
+    {
+        /* quiet when oil_shmOpen() retries without huge pages */
+        if((flags & (OIL_SHM_ANON | OIL_SHM_HUGETLB)) != (OIL_SHM_ANON | OIL_SHM_HUGETLB))
+            perror("mmap");
+        free(sr);
+        return -1;
+    }
+    sr->fd = fd;
+    sr->mapSize = want;
+    sr->hdr = sr->map;
+
+#ifdef MADV_HUGEPAGE
+    /* named regions live on tmpfs: transparent huge pages at best */
+    if(flags & OIL_SHM_HUGETLB)
+        madvise(sr->map, sr->mapSize, MADV_HUGEPAGE);
+#endif
+
+    if(created)
+    {
+        sr->hdr->version = version;
+        sr->hdr->hdrSize = SHM_HDR_SIZE;
+        sr->hdr->flags = flags;
+        sr->hdr->size = want;
+        __sync_synchronize();
+        sr->hdr->magic = SHM_MAGIC;
+    }
+    else
+    {
+        for(i = 0; sr->hdr->magic != SHM_MAGIC && i < SHM_WAIT_MS; i++)
+            usleep(1000);
+        __sync_synchronize();
+
+        if(sr->hdr->magic != SHM_MAGIC || sr->hdr->version != version ||
+           sr->hdr->hdrSize != SHM_HDR_SIZE)
+        {
+            munmap(sr->map, sr->mapSize);
+            free(sr);
+            errno = EPROTO;
+            return -1;
+        }
+        /* under the file lock like the resize, so it only grows */
+        flock(fd, LOCK_EX);
+        if(sr->hdr->size < want)
+            sr->hdr->size = want;
+        flock(fd, LOCK_UN);
+    }
+
+    if((flags & OIL_SHM_LOCK) && mlock(sr->map, sr->mapSize) != 0)
+        perror("mlock");
+
+    *region = sr;
+
+    return 0;
+}
+
+int oil_shmOpen(void **region, const char *name, int size,
+                unsigned int version, int flags)
+{
+    char path[OIL_MAX_STR_LEN];
+    int fd, created = 0;
+
+    if(size < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(flags & OIL_SHM_ANON)
+    {
+        if((fd = shmMemfd(name, flags)) < 0)
+            return -1;
+        if(shmMap(region, fd, 1, size, version, flags) == 0)
+            return 0;
+        close(fd);
+        if(!(flags & OIL_SHM_HUGETLB))
+            return -1;
+
+        /* no huge page reserved: mmap() of hugetlbfs fails, retry */
+        flags &= ~OIL_SHM_HUGETLB;
+        if((fd = shmMemfd(name, flags)) < 0)
+            return -1;
+        created = 1;
+    }
+    else
+    {
+        snprintf(path, sizeof(path), "/%s", name);
+
+        fd = -1;
+        if((flags & OIL_SHM_CREATE) && size > 0)
+        {
+            fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+            /* allow everyone to read/write, whatever the umask */
+            if((created = fd >= 0))
+                fchmod(fd, 0666);
+        }
+        if(fd < 0 && (fd = shm_open(path, O_RDWR | O_CLOEXEC, 0)) < 0)
+            return -1;
+    }
+
+    if(shmMap(region, fd, created, size, version, flags) != 0)
+    {
+        close(fd);
+        if(created && !(flags & OIL_SHM_ANON))
+            shm_unlink(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int oil_shmOpenFd(void **region, int fd, int size, unsigned int version, int flags)
+{
+    return shmMap(region, fd, 0, size, version, flags & ~OIL_SHM_ANON);
+}
+
+void *oil_shmAddr(void *region)
+{
+    return (char *)((shmRegion_t *)region)->map + SHM_HDR_SIZE;
+}
+
+int oil_shmSize(void *region)
+{
+    return ((shmRegion_t *)region)->mapSize - SHM_HDR_SIZE;
+}
+
+int oil_shmFd(void *region)
+{
+    return ((shmRegion_t *)region)->fd;
+}
+
+void oil_shmClose(void **region)
+{
+    shmRegion_t *sr = *region;
+
+    if(sr == NULL)
+        return;
+
+    munmap(sr->map, sr->mapSize);
+    close(sr->fd);
+    free(sr);
+
+    *region = NULL;
+}
+
+int oil_shmUnlink(const char *name)
+{
+    char path[OIL_MAX_STR_LEN];
+
+    snprintf(path, sizeof(path), "/%s", name);
+
+    return shm_unlink(path);
+}
+
 #ifdef CONFIG_SCM_SUPPORT
 #include "nvram.h"
+#endif
 
-char *oil_getCfgValue(const char *name)
+/*
+ * Config cache. Lookups go to an immutable snapshot: an open
+ * addressing table of (name, value) pointers to interned strings.
+ * A change builds a new snapshot and swaps the pointer; the old one is
+ * freed once the readers which may still use it are gone, tracked
+ * with two reader counters and an epoch (left-right). An interned
+ * string no snapshot refers to any more is freed CFG_RETIRE_MS later,
+ * so a returned value outlives the change which replaced it.
+ */
+#define CFG_INTERN_SLOTS  1024
+#define CFG_MIN_SLOTS     64
+#define CFG_LINE_MAX      1024
+#define CFG_RETIRE_MS     60000     /* unused strings kept that long */
+#define CFG_NVRAM_TTL_MS  1000      /* nvram values refetched after */
+
+typedef struct cfgEntry
 {
-    char *p;
-    static char attrValue[OIL_MAX_STR_LEN];
+    unsigned int  hash;
+    const char   *name;             /**< NULL for an empty slot */
+    const char   *value;
+    unsigned int  fetched;          /**< cfgStamp() of the nvram fetch,
+                                     *   0 if from the file or set */
+} cfgEntry_t;
 
-    attrValue[0] = '\0';
-    
-    if((p = nvram_get(name)) != NULL)
+typedef struct cfgSnap
+{
+    unsigned int mask;
+    int          count;
+    cfgEntry_t   ents[0];
+} cfgSnap_t;
+
+typedef struct cfgStr
+{
+    struct cfgStr *next;
+    unsigned int   hash;
+    unsigned int   mark;        /**< last publish which used it */
+    unsigned int   idleSince;   /**< cfgStamp(), 0 while used */
+    char           str[0];
+} cfgStr_t;
+
+typedef struct cfgSub
+{
+    char          prefix[OIL_MAX_STR_LEN];
+    int           prefixLen;
+    oilCfgFunc_t  func;
+    void         *ctxArg;
+} cfgSub_t;
+
+typedef struct cfgChange
+{
+    const char   *name;
+    const char   *value;     /**< NULL if removed */
+} cfgChange_t;
+
+static struct
+{
+    pthread_mutex_t     lock;       /**< writers */
+    pthread_once_t      once;
+    pthread_mutex_t     notifyLock; /**< before lock, notifying writers */
+    char                path[OIL_MAX_STR_LEN];
+    cfgSnap_t * volatile snap;
+    volatile int        epoch;
+    volatile int        readers[2];
+    cfgStr_t           *strs[CFG_INTERN_SLOTS];
+    unsigned int        gen;        /**< publishes, for the string marks */
+    int                 nsubs;
+    cfgSub_t            subs[OIL_CFG_MAX_SUBS];
+    /* changes to deliver once lock is released, under notifyLock */
+    cfgChange_t        *changes;
+    int                 nchanges;
+    int                 notifySubs;
+    cfgSub_t            notifyTo[OIL_CFG_MAX_SUBS];
+} gbl_cfg = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT,
+              PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int cfgHash(const char *str)
+{
+    unsigned int h = 2166136261u;
+
+    while(*str != '\0')
+        h = (h ^ (unsigned char)*str++) * 16777619u;
+
+    return h;
+}
+
+/* ms, never 0 */
+static unsigned int cfgStamp(void)
+{
+    return (unsigned int)(tmsClockNs() / NSECS_IN_MSEC) | 1;
+}
+
+/* with the lock held */
+static const char *cfgIntern(const char *str)
+{
+    unsigned int h = cfgHash(str);
+    cfgStr_t *cs;
+    int len;
+
+    for(cs = gbl_cfg.strs[h % CFG_INTERN_SLOTS]; cs != NULL; cs = cs->next)
+    {
+        if(cs->hash == h && strcmp(cs->str, str) == 0)
+            return cs->str;
+    }
+
+    len = strlen(str);
+    if((cs = malloc(sizeof(cfgStr_t) + len + 1)) == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    cs->hash = h;
+    cs->mark = gbl_cfg.gen;
+    cs->idleSince = 0;
+    memcpy(cs->str, str, len + 1);
+    cs->next = gbl_cfg.strs[h % CFG_INTERN_SLOTS];
+    gbl_cfg.strs[h % CFG_INTERN_SLOTS] = cs;
+
+    return cs->str;
+}
+
+static cfgSnap_t *cfgSnapNew(int count)
+{
+    cfgSnap_t *snap;
+    unsigned int slots = CFG_MIN_SLOTS;
+
+    /* at most half full */
+    while(slots < (unsigned int)count * 2)
+        slots <<= 1;
+
+    if((snap = calloc(1, sizeof(cfgSnap_t) + slots * sizeof(cfgEntry_t))) == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    snap->mask = slots - 1;
+
+    return snap;
+}
+
+static cfgEntry_t *cfgSnapFind(const cfgSnap_t *snap, const char *name,
+                               unsigned int hash)
+{
+    const cfgEntry_t *ent;
+    unsigned int i;
+
+    for(i = hash & snap->mask;; i = (i + 1) & snap->mask)
+    {
+        ent = &snap->ents[i];
+        if(ent->name == NULL)
+            return NULL;
+        if(ent->hash == hash && strcmp(ent->name, name) == 0)
+            return (cfgEntry_t *)ent;
+    }
+}
+
+/* name and value interned, the snapshot has room */
+static void cfgSnapPut(cfgSnap_t *snap, unsigned int hash, const char *name,
+                       const char *value, unsigned int fetched)
+{
+    cfgEntry_t *ent;
+    unsigned int i;
+
+    for(i = hash & snap->mask;; i = (i + 1) & snap->mask)
+    {
+        ent = &snap->ents[i];
+        if(ent->name == NULL)
+        {
+            snap->count++;
+            break;
+        }
+        /* interned: same name, same pointer */
+        if(ent->name == name)
+            break;
+    }
+    ent->hash = hash;
+    ent->name = name;
+    ent->value = value;
+    ent->fetched = fetched;
+}
+
+/* copy of snap with room for extra more entries */
+static cfgSnap_t *cfgSnapCopy(const cfgSnap_t *snap, int extra)
+{
+    cfgSnap_t *copy;
+    unsigned int i;
+
+    if((copy = cfgSnapNew((snap != NULL ? snap->count : 0) + extra)) == NULL)
+        return NULL;
+
+    for(i = 0; snap != NULL && i <= snap->mask; i++)
+    {
+        if(snap->ents[i].name != NULL)
+            cfgSnapPut(copy, snap->ents[i].hash, snap->ents[i].name,
+                       snap->ents[i].value, snap->ents[i].fetched);
+    }
+
+    return copy;
+}
+
+#define CFG_STR(p)  ((cfgStr_t *)((char *)(p) - offsetof(cfgStr_t, str)))
+
+/**
+ * Mark the strings of the snapshot just published, free the ones
+ * unused for CFG_RETIRE_MS: callers may still hold a value looked up
+ * before it changed, the subscribers a removed name.
+ */
+static void cfgRetire(const cfgSnap_t *snap)
+{
+    unsigned int i, now = cfgStamp();
+    cfgStr_t *cs, **prev;
+
+    gbl_cfg.gen++;
+    for(i = 0; i <= snap->mask; i++)
+    {
+        if(snap->ents[i].name != NULL)
+        {
+            CFG_STR(snap->ents[i].name)->mark = gbl_cfg.gen;
+            CFG_STR(snap->ents[i].value)->mark = gbl_cfg.gen;
+        }
+    }
+
+    for(i = 0; i < CFG_INTERN_SLOTS; i++)
+    {
+        prev = &gbl_cfg.strs[i];
+        while((cs = *prev) != NULL)
+        {
+            if(cs->mark == gbl_cfg.gen)
+                cs->idleSince = 0;
+            else if(cs->idleSince == 0)
+                cs->idleSince = now;
+            else if(now - cs->idleSince >= CFG_RETIRE_MS)
+            {
+                *prev = cs->next;
+                free(cs);
+                continue;
+            }
+            prev = &cs->next;
+        }
+    }
+}
+
+static void cfgWaitReaders(int idx)
+{
+    while(gbl_cfg.readers[idx] != 0)
+        sched_yield();
+}
+
+static void cfgQueue(const char *name, const char *value)
+{
+    gbl_cfg.changes[gbl_cfg.nchanges].name = name;
+    gbl_cfg.changes[gbl_cfg.nchanges].value = value;
+    gbl_cfg.nchanges++;
+}
+
+/**
+ * Call the subscribers with the changes queued by cfgPublish(), with
+ * notifyLock held but not lock: they may look values up, and a cache
+ * miss takes lock.
+ */
+static void cfgNotify(void)
+{
+    const cfgChange_t *c;
+    const cfgSub_t *sub;
+    int i;
+
+    for(c = gbl_cfg.changes; c < gbl_cfg.changes + gbl_cfg.nchanges; c++)
+    {
+        for(i = 0; i < gbl_cfg.notifySubs; i++)
+        {
+            sub = &gbl_cfg.notifyTo[i];
+            if(strncmp(c->name, sub->prefix, sub->prefixLen) == 0)
+                (sub->func)(c->name, c->value, sub->ctxArg);
+        }
+    }
+
+    free(gbl_cfg.changes);
+    gbl_cfg.changes = NULL;
+    gbl_cfg.nchanges = 0;
+}
+
+/**
+ * Swap in snap, with the lock held. Once no reader can see the old
+ * snapshot it is freed. With notify, notifyLock is held too and the
+ * values which differ (NULL for the removed names) are queued for
+ * cfgNotify(), along with a copy of the subscribers.
+ */
+static void cfgPublish(cfgSnap_t *snap, int notify)
+{
+    cfgSnap_t *old = gbl_cfg.snap;
+    const cfgEntry_t *ent, *other;
+    int prev = gbl_cfg.epoch & 1;
+    unsigned int i;
+
+    __sync_synchronize();
+    gbl_cfg.snap = snap;
+    __sync_synchronize();
+
+    cfgWaitReaders(!prev);
+    gbl_cfg.epoch = !prev;
+    __sync_synchronize();
+    cfgWaitReaders(prev);
+
+    cfgRetire(snap);
+
+    if(old == NULL)
+        return;
+
+    if(notify && gbl_cfg.nsubs > 0)
+    {
+        /* names and values are interned, they outlive the snapshots */
+        gbl_cfg.changes = malloc((snap->count + old->count) * sizeof(cfgChange_t));
+        if(gbl_cfg.changes == NULL)
+            perror("malloc");
+        gbl_cfg.notifySubs = gbl_cfg.nsubs;
+        memcpy(gbl_cfg.notifyTo, gbl_cfg.subs, gbl_cfg.nsubs * sizeof(cfgSub_t));
+    }
+    notify = gbl_cfg.changes != NULL;
+
+    for(i = 0; notify && i <= snap->mask; i++)
     {
-        snprintf(attrValue, sizeof(attrValue), "%s", p);
-        free(p);
+        ent = &snap->ents[i];
+        if(ent->name == NULL)
+            continue;
+        other = cfgSnapFind(old, ent->name, ent->hash);
+        /* interned values compare by pointer */
+        if(other == NULL || other->value != ent->value)
+            cfgQueue(ent->name, ent->value);
+    }
+    for(i = 0; notify && i <= old->mask; i++)
+    {
+        ent = &old->ents[i];
+        if(ent->name != NULL && cfgSnapFind(snap, ent->name, ent->hash) == NULL)
+            cfgQueue(ent->name, NULL);
     }
 
-    return attrValue;
+    free(old);
 }
+
+/**
+ * Build a snapshot from the key=value file, plus the nvram values of
+ * the old one refetched, with the lock held.
+ */
+static cfgSnap_t *cfgLoad(const cfgSnap_t *old)
+{
+    char line[CFG_LINE_MAX], *key, *val, *end;
+    const char *name, *value;
+    cfgSnap_t *snap, *bigger;
+    unsigned int i;
+    FILE *fp;
+#ifdef CONFIG_SCM_SUPPORT
+    char *p;
+#endif
+
+    if((snap = cfgSnapNew(old != NULL ? old->count : 0)) == NULL)
+        return NULL;
+
+    if(gbl_cfg.path[0] != '\0' && (fp = fopen(gbl_cfg.path, "r")) != NULL)
+    {
+        while(fgets(line, sizeof(line), fp) != NULL)
+        {
+            for(key = line; *key == ' ' || *key == '\t'; key++)
+                ;
+            if(*key == '#' || (val = strchr(key, '=')) == NULL)
+                continue;
+
+            for(end = val; end > key && (end[-1] == ' ' || end[-1] == '\t'); end--)
+                ;
+            *end = '\0';
+            for(val++; *val == ' ' || *val == '\t'; val++)
+                ;
+            end = val + strlen(val);
+            while(end > val && (end[-1] == '\n' || end[-1] == '\r'))
+                end--;
+            *end = '\0';
+            if(*key == '\0')
+                continue;
+
+            if((unsigned int)snap->count * 2 >= snap->mask)
+            {
+                if((bigger = cfgSnapCopy(snap, snap->count)) == NULL)
+                    break;
+                free(snap);
+                snap = bigger;
+            }
+            if((name = cfgIntern(key)) == NULL || (value = cfgIntern(val)) == NULL)
+                break;
+            cfgSnapPut(snap, cfgHash(name), name, value, 0);
+        }
+        fclose(fp);
+    }
+
+    for(i = 0; old != NULL && i <= old->mask; i++)
+    {
+        if(old->ents[i].name == NULL || old->ents[i].fetched == 0 ||
+           cfgSnapFind(snap, old->ents[i].name, old->ents[i].hash) != NULL)
+            continue;
+        if((unsigned int)snap->count * 2 >= snap->mask)
+        {
+            if((bigger = cfgSnapCopy(snap, snap->count)) == NULL)
+                break;
+            free(snap);
+            snap = bigger;
+        }
+#ifdef CONFIG_SCM_SUPPORT
+        value = "";
+        if((p = nvram_get(old->ents[i].name)) != NULL)
+        {
+            value = cfgIntern(p);
+            free(p);
+        }
 #else
+        value = old->ents[i].value;
+#endif
+        if(value != NULL)
+            cfgSnapPut(snap, old->ents[i].hash, old->ents[i].name, value, cfgStamp());
+    }
+
+    return snap;
+}
+
+static void cfgDefaultInit(void)
+{
+    const char *path = getenv(OIL_CFG_ENV);
+    cfgSnap_t *snap;
+
+    pthread_mutex_lock(&gbl_cfg.lock);
+    if(gbl_cfg.snap == NULL)
+    {
+        snprintf(gbl_cfg.path, sizeof(gbl_cfg.path), "%s",
+                 path != NULL ? path : OIL_CFG_FILE);
+        if((snap = cfgLoad(NULL)) != NULL)
+            cfgPublish(snap, 0);
+    }
+    pthread_mutex_unlock(&gbl_cfg.lock);
+}
+
+int oil_cfgInit(const char *path)
+{
+    cfgSnap_t *snap;
+
+    pthread_once(&gbl_cfg.once, cfgDefaultInit);
+
+    pthread_mutex_lock(&gbl_cfg.notifyLock);
+    pthread_mutex_lock(&gbl_cfg.lock);
+    snprintf(gbl_cfg.path, sizeof(gbl_cfg.path), "%s", path != NULL ? path : "");
+    if((snap = cfgLoad(gbl_cfg.snap)) != NULL)
+        cfgPublish(snap, 1);
+    pthread_mutex_unlock(&gbl_cfg.lock);
+    cfgNotify();
+    pthread_mutex_unlock(&gbl_cfg.notifyLock);
+
+    return snap != NULL ? 0 : -1;
+}
+
+int oil_cfgReload(void)
+{
+    cfgSnap_t *snap;
+
+    pthread_once(&gbl_cfg.once, cfgDefaultInit);
+
+    pthread_mutex_lock(&gbl_cfg.notifyLock);
+    pthread_mutex_lock(&gbl_cfg.lock);
+    if((snap = cfgLoad(gbl_cfg.snap)) != NULL)
+        cfgPublish(snap, 1);
+    pthread_mutex_unlock(&gbl_cfg.lock);
+    cfgNotify();
+    pthread_mutex_unlock(&gbl_cfg.notifyLock);
+
+    return snap != NULL ? 0 : -1;
+}
+
+/* with the lock held, and notifyLock for notify, NULL value removes name */
+static int cfgUpdate(const char *name, const char *value, unsigned int fetched,
+                     int notify)
+{
+    const char *iname, *ivalue = NULL;
+    cfgSnap_t *snap, *copy;
+    unsigned int h, i;
+
+    if((iname = cfgIntern(name)) == NULL ||
+       (value != NULL && (ivalue = cfgIntern(value)) == NULL))
+        return -1;
+    h = cfgHash(iname);
+
+    if(value != NULL)
+    {
+        if((snap = cfgSnapCopy(gbl_cfg.snap, 1)) == NULL)
+            return -1;
+        cfgSnapPut(snap, h, iname, ivalue, fetched);
+    }
+    else
+    {
+        /* no tombstones: copy all but name */
+        if((snap = cfgSnapNew(gbl_cfg.snap->count)) == NULL)
+            return -1;
+        copy = gbl_cfg.snap;
+        for(i = 0; i <= copy->mask; i++)
+        {
+            if(copy->ents[i].name != NULL && copy->ents[i].name != iname)
+                cfgSnapPut(snap, copy->ents[i].hash, copy->ents[i].name,
+                           copy->ents[i].value, copy->ents[i].fetched);
+        }
+    }
+    cfgPublish(snap, notify);
+
+    return 0;
+}
+
+int oil_cfgSet(const char *name, const char *value)
+{
+    int ret;
+
+    pthread_once(&gbl_cfg.once, cfgDefaultInit);
+
+    pthread_mutex_lock(&gbl_cfg.notifyLock);
+    pthread_mutex_lock(&gbl_cfg.lock);
+    ret = gbl_cfg.snap != NULL ? cfgUpdate(name, value, 0, 1) : -1;
+    pthread_mutex_unlock(&gbl_cfg.lock);
+    cfgNotify();
+    pthread_mutex_unlock(&gbl_cfg.notifyLock);
+
+    return ret;
+}
+
+int oil_cfgSubscribe(const char *prefix, oilCfgFunc_t func, void *ctxArg)
+{
+    cfgSub_t *sub;
+    int ret = -1;
+
+    pthread_mutex_lock(&gbl_cfg.lock);
+    if(gbl_cfg.nsubs < OIL_CFG_MAX_SUBS)
+    {
+        sub = &gbl_cfg.subs[gbl_cfg.nsubs++];
+        snprintf(sub->prefix, sizeof(sub->prefix), "%s", prefix != NULL ? prefix : "");
+        sub->prefixLen = strlen(sub->prefix);
+        sub->func = func;
+        sub->ctxArg = ctxArg;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&gbl_cfg.lock);
+
+    return ret;
+}
+
+int oil_cfgUnsubscribe(oilCfgFunc_t func, void *ctxArg)
+{
+    int i, ret = -1;
+
+    /* wait for a delivery which may still call it */
+    pthread_mutex_lock(&gbl_cfg.notifyLock);
+    pthread_mutex_lock(&gbl_cfg.lock);
+    for(i = 0; i < gbl_cfg.nsubs; i++)
+    {
+        if(gbl_cfg.subs[i].func == func && gbl_cfg.subs[i].ctxArg == ctxArg)
+        {
+            gbl_cfg.subs[i] = gbl_cfg.subs[--gbl_cfg.nsubs];
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gbl_cfg.lock);
+    pthread_mutex_unlock(&gbl_cfg.notifyLock);
+
+    return ret;
+}
+
+/* @return 1 and *value if name is cached, lock free */
+static int cfgLookup(const char *name, const char **value, unsigned int *fetched)
+{
+    const cfgEntry_t *ent;
+    cfgSnap_t *snap;
+    int idx, found = 0;
+
+    idx = gbl_cfg.epoch & 1;
+    __sync_fetch_and_add(&gbl_cfg.readers[idx], 1);
+
+    if((snap = gbl_cfg.snap) != NULL &&
+       (ent = cfgSnapFind(snap, name, cfgHash(name))) != NULL)
+    {
+        *value = ent->value;
+        if(fetched != NULL)
+            *fetched = ent->fetched;
+        found = 1;
+    }
+
+    __sync_fetch_and_sub(&gbl_cfg.readers[idx], 1);
+
+    return found;
+}
+
+#ifdef CONFIG_SCM_SUPPORT
+/* with the lock held, value just read from nvram */
+static void cfgRefresh(const char *name, const char *value)
+{
+    cfgEntry_t *ent;
+
+    ent = cfgSnapFind(gbl_cfg.snap, name, cfgHash(name));
+    /* in the file meanwhile, or refreshed by another thread */
+    if(ent != NULL && (ent->fetched == 0 ||
+                       cfgStamp() - ent->fetched < CFG_NVRAM_TTL_MS))
+        return;
+
+    /* unchanged: no new snapshot, the stamp is only read as a whole */
+    if(ent != NULL && strcmp(ent->value, value) == 0)
+        ent->fetched = cfgStamp();
+    else
+        cfgUpdate(name, value, cfgStamp(), 0);
+}
+#endif
+
 char *oil_getCfgValue(const char *name)
 {
+    const char *value = NULL;
+#ifdef CONFIG_SCM_SUPPORT
+    unsigned int fetched = 0;
+    char *p;
+#endif
+
+    pthread_once(&gbl_cfg.once, cfgDefaultInit);
+
+#ifdef CONFIG_SCM_SUPPORT
+    if(cfgLookup(name, &value, &fetched) &&
+       (fetched == 0 || cfgStamp() - fetched < CFG_NVRAM_TTL_MS))
+        return (char *)value;
+
+    /* missing, unknown names too so they are asked once a TTL, or old */
+    p = nvram_get(name);
+
+    pthread_mutex_lock(&gbl_cfg.lock);
+    if(gbl_cfg.snap != NULL)
+        cfgRefresh(name, p != NULL ? p : "");
+    pthread_mutex_unlock(&gbl_cfg.lock);
+
+    free(p);
+
+    if(cfgLookup(name, &value, NULL))
+        return (char *)value;
+
+    return "";
+#else
+    if(cfgLookup(name, &value, NULL))
+        return (char *)value;
+
     return NULL;
-}
 #endif
+}
@@ -5,6 +5,12 @@
 
 #define OIL_MAX_STR_LEN 256
 
+/** key=value file loaded in the config cache, unless overridden by
+ *  the OIL_CFG_ENV environment variable or oil_cfgInit() */
+#define OIL_CFG_FILE     "/etc/libmisc.conf"
+#define OIL_CFG_ENV      "MISC_CFG_FILE"
+#define OIL_CFG_MAX_SUBS 16
+
 /** Number of nanoseconds in 1 second. */
 #define NSECS_IN_SEC 1000000000
 
@@ -32,11 +38,157 @@ typedef struct
 } oilTimeStamp_t;
 
 void oil_tmsGet(oilTimeStamp_t *ts);
+
+/** 
+ * Monotonic time in ns, as CLOCK_MONOTONIC. Where the cpu has an
+ * invariant cycle counter (x86-64 TSC) it is read from the counter, a
+ * few ns per call for instrumentation hot paths: the first call
+ * calibrates it against CLOCK_MONOTONIC (2ms), then it is corrected
+ * every second. Elsewhere it is clock_gettime().
+ */
+unsigned long long oil_tmsNs(void);
+
+/** 
+ * Calibrate now, e.g. at startup rather than on the first
+ * oil_tmsNs(), or after a cpu frequency change on MIPS.
+ * 
+ * @return 0, -1 if there is no usable cycle counter
+ */
+int oil_tmsCalibrate(void);
+
+/** 
+ * Raw cycle counter, to time short intervals: the TSC on x86-64, the
+ * CP0 Count register on MIPS when user readable (r2 cpus, a probe at
+ * first use catches the SIGILL), 32 bits wrapping within seconds
+ * there.
+ * 
+ * @return cycles, 0 without a usable counter
+ */
+unsigned long long oil_tmsCycles(void);
+
+/** 
+ * @param cycles difference of two oil_tmsCycles()
+ * 
+ * @return ns, 0 without a usable counter
+ */
+unsigned long long oil_tmsCyclesToNs(unsigned long long cycles);
 void oil_openlog(void);
 void oil_syslog(int level, const char *buf);
 void oil_closelog(void);
+
+/** 
+ * SysV shared memory, the id has to be passed around by hand. See
+ * oil_shmOpen() for named regions.
+ */
 int oil_shmInit(int shmSize, int *shmId, void **shmAddr);
 void oil_shmCleanup(int shmId, void *shmAddr);
+
+/** oil_shmOpen() flags */
+#define OIL_SHM_CREATE    0x01  /**< create it if it does not exist */
+#define OIL_SHM_ANON      0x02  /**< memfd, no name: share it by fork() or
+                                 *   by passing oil_shmFd() */
+#define OIL_SHM_HUGETLB   0x04  /**< huge pages: hugetlb for OIL_SHM_ANON,
+                                 *   transparent huge pages otherwise, normal
+                                 *   pages if not available */
+#define OIL_SHM_POPULATE  0x08  /**< fault all the pages in at map time */
+#define OIL_SHM_LOCK      0x10  /**< mlock() it, never swapped nor faulted */
+
+/** 
+ * Open or create a named shared memory region (shm_open + mmap). The
+ * region starts with a small header: attaching checks the layout
+ * version, and waits for the creator to have initialized it. A new
+ * region is zero filled.
+ * 
+ * Size negotiation: the region grows to the largest size asked by any
+ * process, size 0 maps it as is (it must exist).
+ * 
+ * @param region handle
+ * @param name e.g. "misc_log", no '/'
+ * @param size data bytes needed
+ * @param version of the data layout, attaching with another one fails
+ * (EPROTO)
+ * @param flags OIL_SHM_XXX
+ * 
+ * @return 0 on success, -1 on error
+ */
+int oil_shmOpen(void **region, const char *name, int size,
+                unsigned int version, int flags);
+
+/** 
+ * Attach a region received as an fd, e.g. an OIL_SHM_ANON one passed
+ * over a unix socket. The fd belongs to the region afterwards.
+ */
+int oil_shmOpenFd(void **region, int fd, int size, unsigned int version, int flags);
+
+/** data address, cache line aligned */
+void *oil_shmAddr(void *region);
+
+/** data bytes mapped, may be more than asked */
+int oil_shmSize(void *region);
+
+int oil_shmFd(void *region);
+
+/** 
+ * Unmap, the region lives on until oil_shmUnlink().
+ */
+void oil_shmClose(void **region);
+
+int oil_shmUnlink(const char *name);
+
+/** 
+ * Config value, served from the config cache: lock free. The
+ * returned string stays valid at least a minute after the value
+ * changes, copy it to keep it longer. Don't modify it.
+ * 
+ * The cache is loaded from the OIL_CFG_FILE file at first use. With
+ * CONFIG_SCM_SUPPORT, names missing from it are fetched from nvram,
+ * and fetched again on a lookup once a second old, so nvram changes
+ * show within a second (the subscribers only hear of them from
+ * oil_cfgReload()).
+ * 
+ * @return value, "" (SCM) or NULL if unknown
+ */
 char *oil_getCfgValue(const char *name);
 
+/** 
+ * (Re)load the config cache from a key=value file: one name=value per
+ * line, '#' starts a comment line.
+ * 
+ * @param path NULL for none, only nvram (SCM) then
+ * 
+ * @return 0 on success, -1 on error
+ */
+int oil_cfgInit(const char *path);
+
+/** 
+ * Reload the file and refetch the nvram values, the subscribers are
+ * told about the changes.
+ */
+int oil_cfgReload(void);
+
+/** 
+ * Change a value in the cache only (not in nvram), NULL removes it.
+ */
+int oil_cfgSet(const char *name, const char *value);
+
+/** 
+ * Called with the new value of a changed name, NULL if removed, after
+ * the cache is unlocked: it may read values, not change them (the
+ * calls of one change are serialized with the next).
+ */
+typedef void (*oilCfgFunc_t)(const char *name, const char *value, void *ctxArg);
+
+/** 
+ * Get the changes of the names starting with prefix ("" for all).
+ * 
+ * @return 0 on success, -1 if there are too many subscribers
+ */
+int oil_cfgSubscribe(const char *prefix, oilCfgFunc_t func, void *ctxArg);
+
+/** 
+ * Once it returns func is not called any more, ctxArg may be freed.
+ * Not from a subscriber: it waits for the delivery in progress.
+ */
+int oil_cfgUnsubscribe(oilCfgFunc_t func, void *ctxArg);
+
 #endif
@@ -0,0 +1,605 @@
+/**
+ * @file   misc_proc.c
+ *
+ * @brief  /proc parsers working in a caller buffer. The number and
+ *         string helpers are local on purpose: strtoul(), sscanf()
+ *         and snprintf() are not async-signal-safe.
+ */
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "misc_proc.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* /proc/<pid>/stat fields, numbered like proc(5) */
+#define STAT_PPID         4
+#define STAT_MINFLT      10
+#define STAT_MAJFLT      12
+#define STAT_UTIME       14
+#define STAT_STIME       15
+#define STAT_PRIORITY    18
+#define STAT_NICE        19
+#define STAT_THREADS     20
+#define STAT_STARTTIME   22
+#define STAT_VSIZE       23
+#define STAT_RSS         24
+#define STAT_PROCESSOR   39
+
+typedef struct procKey
+{
+    const char *key;        /**< with its ':' */
+    int         offset;     /**< of the unsigned long in the struct */
+} procKey_t;
+
+static const procKey_t gbl_meminfoKeys[] =
+{
+    { "MemTotal:",     offsetof(miscProcMeminfo_t, memTotal) },
+    { "MemFree:",      offsetof(miscProcMeminfo_t, memFree) },
+    { "MemAvailable:", offsetof(miscProcMeminfo_t, memAvailable) },
+    { "Buffers:",      offsetof(miscProcMeminfo_t, buffers) },
+    { "Cached:",       offsetof(miscProcMeminfo_t, cached) },
+    { "SwapTotal:",    offsetof(miscProcMeminfo_t, swapTotal) },
+    { "SwapFree:",     offsetof(miscProcMeminfo_t, swapFree) },
+    { "Shmem:",        offsetof(miscProcMeminfo_t, shmem) },
+    { "Slab:",         offsetof(miscProcMeminfo_t, slab) },
+    { NULL, 0 }
+};
+
+static const procKey_t gbl_statusKeys[] =
+{
+    { "VmPeak:",       offsetof(miscProcStatus_t, vmPeak) },
+    { "VmSize:",       offsetof(miscProcStatus_t, vmSize) },
+    { "VmHWM:",        offsetof(miscProcStatus_t, vmHWM) },
+    { "VmRSS:",        offsetof(miscProcStatus_t, vmRSS) },
+    { "VmData:",       offsetof(miscProcStatus_t, vmData) },
+    { "VmStk:",        offsetof(miscProcStatus_t, vmStk) },
+    { "voluntary_ctxt_switches:",
+                       offsetof(miscProcStatus_t, volCtxtSwitches) },
+    { "nonvoluntary_ctxt_switches:",
+                       offsetof(miscProcStatus_t, nonvolCtxtSwitches) },
+    { NULL, 0 }
+};
+
+static void procZero(void *ptr, int len)
+{
+    char *p = ptr;
+
+    while(len-- > 0)
+        *p++ = 0;
+}
+
+static char *procSkipBlanks(char *p)
+{
+    while(*p == ' ' || *p == '\t')
+        p++;
+
+    return p;
+}
+
+/* decimal, optionally negative, *p is left after the number */
+static long long procNum(char **p)
+{
+    char *s = procSkipBlanks(*p);
+    unsigned long long val = 0;
+    int neg = 0;
+
+    if(*s == '-')
+    {
+        neg = 1;
+        s++;
+    }
+    while(*s >= '0' && *s <= '9')
+        val = val * 10 + (*s++ - '0');
+    *p = s;
+
+    return neg ? -(long long)val : (long long)val;
+}
+
+static unsigned long procHex(char **p)
+{
+    char *s = procSkipBlanks(*p);
+    unsigned long val = 0;
+
+    for(;; s++)
+    {
+        if(*s >= '0' && *s <= '9')
+            val = (val << 4) | (*s - '0');
+        else if(*s >= 'a' && *s <= 'f')
+            val = (val << 4) | (*s - 'a' + 10);
+        else if(*s >= 'A' && *s <= 'F')
+            val = (val << 4) | (*s - 'A' + 10);
+        else
+            break;
+    }
+    *p = s;
+
+    return val;
+}
+
+/* copy the next blank separated word, truncated to size - 1 */
+static void procWord(char **p, char *out, int size)
+{
+    char *s = procSkipBlanks(*p);
+    int i = 0;
+
+    while(*s != '\0' && *s != ' ' && *s != '\t' && *s != '\n')
+    {
+        if(i < size - 1)
+            out[i++] = *s;
+        s++;
+    }
+    out[i] = '\0';
+    *p = s;
+}
+
+/* @return what follows key in line, NULL if line does not start with it */
+static char *procPrefix(char *line, const char *key)
+{
+    while(*key != '\0')
+    {
+        if(*line++ != *key++)
+            return NULL;
+    }
+
+    return line;
+}
+
+/* parse the "Key: value" lines listed in keys into the struct at base */
+static void procKeys(char *buf, const procKey_t *keys, void *base,
+                     char *(*other)(char *line, void *base))
+{
+    const procKey_t *k;
+    char *cur = buf, *line, *val;
+
+    while((line = misc_procNextLine(&cur)) != NULL)
+    {
+        for(k = keys; k->key != NULL; k++)
+        {
+            if((val = procPrefix(line, k->key)) != NULL)
+            {
+                *(unsigned long *)((char *)base + k->offset) = procNum(&val);
+                break;
+            }
+        }
+        if(k->key == NULL && other != NULL)
+            other(line, base);
+    }
+}
+
+char *misc_procPath(char *path, int size, int pid, const char *file)
+{
+    char digits[16];
+    int len = 0, n = 0;
+    const char *s;
+
+#define PROC_PUTC(c)  do { if(len >= size - 1) return NULL; path[len++] = (c); } while(0)
+
+    for(s = "/proc/"; *s != '\0'; s++)
+        PROC_PUTC(*s);
+
+    if(pid <= 0)
+    {
+        for(s = "self"; *s != '\0'; s++)
+            PROC_PUTC(*s);
+    }
+    else
+    {
+        while(pid > 0)
+        {
+            digits[n++] = '0' + pid % 10;
+            pid /= 10;
+        }
+        while(n > 0)
+            PROC_PUTC(digits[--n]);
+    }
+
+    PROC_PUTC('/');
+    for(s = file; *s != '\0'; s++)
+        PROC_PUTC(*s);
+
+#undef PROC_PUTC
+
+    path[len] = '\0';
+
+    return path;
+}
+
+int misc_procReadFd(int fd, char *buf, int size)
+{
+    ssize_t n;
+    int len = 0;
+
+    if(size <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while(len < size - 1)
+    {
+        n = pread(fd, buf + len, size - 1 - len, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(n == 0)
+            break;
+        len += n;
+    }
+    buf[len] = '\0';
+
+    return len;
+}
+
+int misc_procRead(const char *path, char *buf, int size)
+{
+    int fd, len, err;
+
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    len = misc_procReadFd(fd, buf, size);
+    err = errno;
+    close(fd);
+    errno = err;
+
+    return len;
+}
+
+char *misc_procNextLine(char **cursor)
+{
+    char *line = *cursor, *p;
+
+    if(line == NULL || *line == '\0')
+        return NULL;
+
+    for(p = line; *p != '\0' && *p != '\n'; p++)
+        ;
+    if(*p == '\n')
+        *p++ = '\0';
+    *cursor = p;
+
+    return line;
+}
+
+static void procCpuTimes(char *p, miscProcCpuTimes_t *ct)
+{
+    ct->user = procNum(&p);
+    ct->nice = procNum(&p);
+    ct->system = procNum(&p);
+    ct->idle = procNum(&p);
+    ct->iowait = procNum(&p);
+    ct->irq = procNum(&p);
+    ct->softirq = procNum(&p);
+    ct->steal = procNum(&p);
+}
+
+int misc_procParseSysStat(char *buf, miscProcSysStat_t *ss)
+{
+    char *cur = buf, *line, *val;
+    int found = 0;
+
+    procZero(ss, sizeof(*ss));
+
+    while((line = misc_procNextLine(&cur)) != NULL)
+    {
+        if((val = procPrefix(line, "cpu")) != NULL)
+        {
+            if(*val == ' ')
+            {
+                procCpuTimes(val, &ss->total);
+                found = 1;
+            }
+            else
+            {
+                procNum(&val);      /* cpu number */
+                if(ss->ncpu < MISC_PROC_MAX_CPUS)
+                    procCpuTimes(val, &ss->cpu[ss->ncpu]);
+                ss->ncpu++;
+            }
+        }
+        else if((val = procPrefix(line, "intr ")) != NULL)
+            ss->intr = procNum(&val);
+        else if((val = procPrefix(line, "ctxt ")) != NULL)
+            ss->ctxt = procNum(&val);
+        else if((val = procPrefix(line, "processes ")) != NULL)
+            ss->processes = procNum(&val);
+        else if((val = procPrefix(line, "procs_running ")) != NULL)
+            ss->procsRunning = procNum(&val);
+        else if((val = procPrefix(line, "procs_blocked ")) != NULL)
+            ss->procsBlocked = procNum(&val);
+    }
+
+    return found ? 0 : -1;
+}
+
+int misc_procParseMeminfo(char *buf, miscProcMeminfo_t *mi)
+{
+    procZero(mi, sizeof(*mi));
+    procKeys(buf, gbl_meminfoKeys, mi, NULL);
+
+    return mi->memTotal != 0 ? 0 : -1;
+}
+
+int misc_procParseStat(char *buf, miscProcStat_t *st)
+{
+    char *p, *end = NULL;
+    long long val;
+    int field, i;
+
+    procZero(st, sizeof(*st));
+
+    p = buf;
+    st->pid = procNum(&p);
+
+    /* comm may hold spaces and parentheses, it ends at the last ')' */
+    for(p = buf; *p != '\0'; p++)
+    {
+        if(*p == ')')
+            end = p;
+    }
+    for(p = buf; *p != '\0' && *p != '('; p++)
+        ;
+    if(*p != '(' || end == NULL || end < p)
+        return -1;
+
+    for(i = 0, p++; p < end && i < MISC_PROC_COMM_LEN - 1; p++)
+        st->comm[i++] = *p;
+
+    p = procSkipBlanks(end + 1);
+    st->state = *p;
+    if(*p != '\0')
+        p++;
+
+    for(field = STAT_PPID; field <= STAT_PROCESSOR; field++)
+    {
+        p = procSkipBlanks(p);
+        if(*p == '\0' || *p == '\n')
+            break;
+        val = procNum(&p);
+
+        switch(field)
+        {
+            case STAT_PPID:      st->ppid = val; break;
+            case STAT_MINFLT:    st->minflt = val; break;
+            case STAT_MAJFLT:    st->majflt = val; break;
+            case STAT_UTIME:     st->utime = val; break;
+            case STAT_STIME:     st->stime = val; break;
+            case STAT_PRIORITY:  st->priority = val; break;
+            case STAT_NICE:      st->nice = val; break;
+            case STAT_THREADS:   st->numThreads = val; break;
+            case STAT_STARTTIME: st->starttime = val; break;
+            case STAT_VSIZE:     st->vsize = val; break;
+            case STAT_RSS:       st->rss = val; break;
+            case STAT_PROCESSOR: st->processor = val; break;
+        }
+    }
+
+    /* very old kernels stop before processor */
+    return field > STAT_RSS ? 0 : -1;
+}
+
+int misc_procParseStatm(char *buf, miscProcStatm_t *sm)
+{
+    char *p = buf;
+
+    procZero(sm, sizeof(*sm));
+
+    sm->size = procNum(&p);
+    sm->resident = procNum(&p);
+    sm->shared = procNum(&p);
+    sm->text = procNum(&p);
+    procNum(&p);                /* lib, always 0 */
+    sm->data = procNum(&p);
+
+    return p != buf ? 0 : -1;
+}
+
+static char *procStatusOther(char *line, void *base)
+{
+    miscProcStatus_t *ss = base;
+    char *val;
+    int i;
+
+    if((val = procPrefix(line, "Name:")) != NULL)
+    {
+        /* names may hold blanks, take the whole line */
+        val = procSkipBlanks(val);
+        for(i = 0; val[i] != '\0' && i < MISC_PROC_COMM_LEN - 1; i++)
+            ss->name[i] = val[i];
+        ss->name[i] = '\0';
+    }
+    else if((val = procPrefix(line, "State:")) != NULL)
+        ss->state = *procSkipBlanks(val);
+    else if((val = procPrefix(line, "Tgid:")) != NULL)
+        ss->tgid = procNum(&val);
+    else if((val = procPrefix(line, "Pid:")) != NULL)
+        ss->pid = procNum(&val);
+    else if((val = procPrefix(line, "PPid:")) != NULL)
+        ss->ppid = procNum(&val);
+    else if((val = procPrefix(line, "Threads:")) != NULL)
+        ss->threads = procNum(&val);
+
+    return val;
+}
+
+int misc_procParseStatus(char *buf, miscProcStatus_t *ss)
+{
+    procZero(ss, sizeof(*ss));
+    procKeys(buf, gbl_statusKeys, ss, procStatusOther);
+
+    return ss->pid != 0 ? 0 : -1;
+}
+
+int misc_procMeminfo(miscProcMeminfo_t *mi, char *buf, int size)
+{
+    if(misc_procRead("/proc/meminfo", buf, size) < 0)
+        return -1;
+
+    return misc_procParseMeminfo(buf, mi);
+}
+
+int misc_procStat(int pid, miscProcStat_t *st, char *buf, int size)
+{
+    char path[64];
+
+    if(misc_procPath(path, sizeof(path), pid, "stat") == NULL ||
+       misc_procRead(path, buf, size) < 0)
+        return -1;
+
+    return misc_procParseStat(buf, st);
+}
+
+int misc_procStatm(int pid, miscProcStatm_t *sm, char *buf, int size)
+{
+    char path[64];
+
+    if(misc_procPath(path, sizeof(path), pid, "statm") == NULL ||
+       misc_procRead(path, buf, size) < 0)
+        return -1;
+
+    return misc_procParseStatm(buf, sm);
+}
+
+int misc_procStatus(int pid, miscProcStatus_t *ss, char *buf, int size)
+{
+    char path[64];
+
+    if(misc_procPath(path, sizeof(path), pid, "status") == NULL ||
+       misc_procRead(path, buf, size) < 0)
+        return -1;
+
+    return misc_procParseStatus(buf, ss);
+}
+
+int misc_procParseMap(char *line, miscProcMap_t *map)
+{
+    char *p = line;
+
+    map->start = procHex(&p);
+    if(*p != '-')
+        return -1;
+    p++;
+    map->end = procHex(&p);
+    procWord(&p, map->perms, sizeof(map->perms));
+    map->offset = procHex(&p);
+    procWord(&p, map->dev, sizeof(map->dev));
+    map->inode = procNum(&p);
+    map->path = procSkipBlanks(p);
+
+    return 0;
+}
+
+int misc_procMapsNext(char **cursor, miscProcMap_t *map)
+{
+    char *line = *cursor, *p;
+
+    if(line == NULL)
+        return 0;
+
+    /* only whole lines, the last one may be cut */
+    for(p = line; *p != '\0' && *p != '\n'; p++)
+        ;
+    if(*p != '\n')
+        return 0;
+
+    *p = '\0';
+    *cursor = p + 1;
+
+    misc_procParseMap(line, map);
+
+    return 1;
+}
+
+int misc_procLinesOpen(miscProcLines_t *pl, const char *path, char *buf, int size)
+{
+    if(size < 2)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while((pl->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if(pl->fd < 0)
+        return -1;
+
+    pl->buf = buf;
+    pl->size = size;
+    pl->len = 0;
+    pl->pos = 0;
+    pl->eof = 0;
+    pl->split = 0;
+
+    return 0;
+}
+
+char *misc_procLinesNext(miscProcLines_t *pl)
+{
+    char *line, *p;
+    ssize_t n;
+    int i;
+
+    pl->split = 0;
+    for(;;)
+    {
+        line = pl->buf + pl->pos;
+        for(p = line; p < pl->buf + pl->len && *p != '\n'; p++)
+            ;
+        if(p < pl->buf + pl->len)
+        {
+            *p = '\0';
+            pl->pos = p + 1 - pl->buf;
+            return line;
+        }
+
+        if(pl->eof)
+        {
+            /* last line without its '\n' */
+            if(pl->pos == pl->len)
+                return NULL;
+            pl->buf[pl->len] = '\0';
+            pl->pos = pl->len;
+            return line;
+        }
+
+        if(pl->pos > 0)
+        {
+            /* keep the partial line, read the rest behind it */
+            for(i = 0; pl->pos + i < pl->len; i++)
+                pl->buf[i] = pl->buf[pl->pos + i];
+            pl->len = i;
+            pl->pos = 0;
+        }
+        else if(pl->len == pl->size - 1)
+        {
+            /* longer than the buffer, hand it over in pieces */
+            pl->split = 1;
+            pl->buf[pl->len] = '\0';
+            pl->pos = pl->len;
+            return line;
+        }
+
+        n = read(pl->fd, pl->buf + pl->len, pl->size - 1 - pl->len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            pl->eof = 1;
+        else
+            pl->len += n;
+    }
+}
+
+void misc_procLinesClose(miscProcLines_t *pl)
+{
+    if(pl->fd >= 0)
+        close(pl->fd);
+    pl->fd = -1;
+}
@@ -0,0 +1,214 @@
+#ifndef _MISC_PROC_H_
+#define _MISC_PROC_H_
+
+/**
+ * /proc and sysfs parsing without allocation: files are pread() into a
+ * buffer given by the caller and tokenized in place, the returned
+ * strings point into that buffer. Only open/pread/close are called,
+ * no stdio, malloc nor locale, so every function can be used from a
+ * signal handler (with a static buffer) as well as from a monitoring
+ * loop (keep the fd open and use misc_procReadFd()).
+ *
+ * pid 0 means the calling process.
+ */
+
+#define MISC_PROC_COMM_LEN  16
+#define MISC_PROC_MAX_CPUS  16
+
+/** /proc/stat times of a cpu line, clock ticks */
+typedef struct miscProcCpuTimes
+{
+    unsigned long long user;
+    unsigned long long nice;
+    unsigned long long system;
+    unsigned long long idle;
+    unsigned long long iowait;
+    unsigned long long irq;
+    unsigned long long softirq;
+    unsigned long long steal;
+} miscProcCpuTimes_t;
+
+/** /proc/stat */
+typedef struct miscProcSysStat
+{
+    miscProcCpuTimes_t total;
+    int                ncpu;        /**< cpus found, cpu[] keeps the first
+                                     *   MISC_PROC_MAX_CPUS */
+    miscProcCpuTimes_t cpu[MISC_PROC_MAX_CPUS];
+    unsigned long long intr;
+    unsigned long long ctxt;
+    unsigned long long processes;   /**< forks since boot */
+    unsigned long      procsRunning;
+    unsigned long      procsBlocked;
+} miscProcSysStat_t;
+
+typedef struct miscProcMeminfo
+{
+    /* kB, 0 if the kernel does not report it */
+    unsigned long memTotal;
+    unsigned long memFree;
+    unsigned long memAvailable;
+    unsigned long buffers;
+    unsigned long cached;
+    unsigned long swapTotal;
+    unsigned long swapFree;
+    unsigned long shmem;
+    unsigned long slab;
+} miscProcMeminfo_t;
+
+/** /proc/<pid>/stat, the fields used by ps and top */
+typedef struct miscProcStat
+{
+    int                pid;
+    char               comm[MISC_PROC_COMM_LEN];
+    char               state;
+    int                ppid;
+    unsigned long      minflt;
+    unsigned long      majflt;
+    unsigned long      utime;       /**< clock ticks */
+    unsigned long      stime;
+    long               priority;
+    long               nice;
+    long               numThreads;
+    unsigned long long starttime;   /**< clock ticks after boot */
+    unsigned long      vsize;       /**< bytes */
+    long               rss;         /**< pages */
+    int                processor;
+} miscProcStat_t;
+
+/** /proc/<pid>/statm, in pages */
+typedef struct miscProcStatm
+{
+    unsigned long size;
+    unsigned long resident;
+    unsigned long shared;
+    unsigned long text;
+    unsigned long data;
+} miscProcStatm_t;
+
+/** /proc/<pid>/status */
+typedef struct miscProcStatus
+{
+    char          name[MISC_PROC_COMM_LEN];
+    char          state;
+    int           tgid;
+    int           pid;
+    int           ppid;
+    int           threads;
+    /* kB */
+    unsigned long vmPeak;
+    unsigned long vmSize;
+    unsigned long vmHWM;
+    unsigned long vmRSS;
+    unsigned long vmData;
+    unsigned long vmStk;
+    unsigned long volCtxtSwitches;
+    unsigned long nonvolCtxtSwitches;
+} miscProcStatus_t;
+
+/** One /proc/<pid>/maps line */
+typedef struct miscProcMap
+{
+    unsigned long  start;
+    unsigned long  end;
+    char           perms[5];    /**< e.g. "r-xp" */
+    unsigned long  offset;
+    char           dev[8];      /**< "major:minor" */
+    unsigned long  inode;
+    const char    *path;        /**< points into the buffer, "" if none */
+} miscProcMap_t;
+
+/** Line reader over a file of any size through a caller buffer */
+typedef struct miscProcLines
+{
+    int   fd;
+    char *buf;
+    int   size;
+    int   len;      /**< bytes in buf */
+    int   pos;      /**< start of the next line */
+    int   eof;
+    int   split;    /**< the last line returned goes on in the next one */
+} miscProcLines_t;
+
+/**
+ * Build "/proc/<pid>/<file>", or "/proc/self/<file>" for pid 0.
+ *
+ * @return path, NULL if it does not fit
+ */
+char *misc_procPath(char *path, int size, int pid, const char *file);
+
+/**
+ * Read a whole file into buf, NUL terminated.
+ *
+ * @return length, size - 1 if the file may have been truncated,
+ * -1 on error
+ */
+int misc_procRead(const char *path, char *buf, int size);
+
+/**
+ * Same as misc_procRead() on a file kept open: /proc files are
+ * regenerated on every read from offset 0, so pollers save the open().
+ */
+int misc_procReadFd(int fd, char *buf, int size);
+
+/**
+ * Split buf in lines in place.
+ *
+ *     char *cur = buf, *line;
+ *     while((line = misc_procNextLine(&cur)) != NULL)
+ *
+ * @return next line without its '\n', NULL at the end
+ */
+char *misc_procNextLine(char **cursor);
+
+/* Parse a buffer read by the caller, 0 on success, -1 if malformed */
+int misc_procParseSysStat(char *buf, miscProcSysStat_t *ss);
+int misc_procParseMeminfo(char *buf, miscProcMeminfo_t *mi);
+int misc_procParseStat(char *buf, miscProcStat_t *st);
+int misc_procParseStatm(char *buf, miscProcStatm_t *sm);
+int misc_procParseStatus(char *buf, miscProcStatus_t *ss);
+
+/* Read and parse, buf is the scratch space, 0 on success, -1 on error */
+int misc_procMeminfo(miscProcMeminfo_t *mi, char *buf, int size);
+int misc_procStat(int pid, miscProcStat_t *st, char *buf, int size);
+int misc_procStatm(int pid, miscProcStatm_t *sm, char *buf, int size);
+int misc_procStatus(int pid, miscProcStatus_t *ss, char *buf, int size);
+
+/**
+ * Iterate over a maps file read with misc_procRead(). A last line cut
+ * by a too small buffer is ignored.
+ *
+ *     char *cur = buf;
+ *     while(misc_procMapsNext(&cur, &map) > 0)
+ *
+ * @return 1 with map filled, 0 at the end
+ */
+int misc_procMapsNext(char **cursor, miscProcMap_t *map);
+
+/**
+ * Parse one maps line without its '\n', path points into it.
+ *
+ * @return 0, -1 if malformed
+ */
+int misc_procParseMap(char *line, miscProcMap_t *map);
+
+/**
+ * Open path for misc_procLinesNext(). Unlike misc_procRead() nothing
+ * is lost past size: the file is read in pieces and a line cut at the
+ * end of a piece is carried over to the next. No allocation, usable
+ * from a signal handler.
+ *
+ * @return 0, -1 on error
+ */
+int misc_procLinesOpen(miscProcLines_t *pl, const char *path, char *buf, int size);
+
+/**
+ * @return next line without its '\n', valid until the next call,
+ * NULL at the end. A line longer than size - 1 comes in several
+ * pieces, pl->split is set on all but the last.
+ */
+char *misc_procLinesNext(miscProcLines_t *pl);
+
+void misc_procLinesClose(miscProcLines_t *pl);
+
+#endif
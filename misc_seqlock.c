@@ -0,0 +1,174 @@
+/**
+ * @file   misc_seqlock.c
+ *
+ * @brief  Latch: a sequence counter over two copies of the data.
+ *
+ * A write is two phases: seq goes odd and copy 0 is written while the
+ * readers use copy 1, then seq goes even and copy 1 is written while
+ * the readers use copy 0. Readers pick copy (seq & 1), so there is
+ * always a stable one.
+ */
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "misc_seqlock.h"
+
+#define SEQLOCK_MAGIC    0x5345514c     /* "SEQL" */
+#define SEQLOCK_INITING  1
+#define SEQLOCK_READY    2
+#define SEQLOCK_LINE     64             /* copies start on their own line */
+
+typedef struct seqlockHdr
+{
+    volatile unsigned int state;        /**< 0, SEQLOCK_INITING, SEQLOCK_READY */
+    unsigned int          magic;
+    unsigned int          dataSize;
+    unsigned int          stride;       /**< copy size, line aligned */
+    volatile int          wlock;
+    volatile unsigned int seq;
+} seqlockHdr_t;
+
+#define SEQLOCK_COPY(sh, i) \
+    ((char *)(sh) + SEQLOCK_LINE + (i) * (sh)->stride)
+
+static unsigned int seqlockStride(int dataSize)
+{
+    return (dataSize + SEQLOCK_LINE - 1) & ~(SEQLOCK_LINE - 1);
+}
+
+static void seqlockWLock(seqlockHdr_t *sh)
+{
+    while(!__sync_bool_compare_and_swap(&sh->wlock, 0, 1))
+        sched_yield();
+}
+
+static void seqlockWUnlock(seqlockHdr_t *sh)
+{
+    __sync_synchronize();
+    sh->wlock = 0;
+}
+
+int misc_seqlockSize(int dataSize)
+{
+    return SEQLOCK_LINE + 2 * seqlockStride(dataSize);
+}
+
+void *misc_seqlockOpen(void *mem, int dataSize, const void *initial)
+{
+    seqlockHdr_t *sh = mem;
+
+    if(dataSize <= 0 || ((unsigned long)mem & 7) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(__sync_bool_compare_and_swap(&sh->state, 0, SEQLOCK_INITING))
+    {
+        sh->magic = SEQLOCK_MAGIC;
+        sh->dataSize = dataSize;
+        sh->stride = seqlockStride(dataSize);
+        if(initial != NULL)
+        {
+            memcpy(SEQLOCK_COPY(sh, 0), initial, dataSize);
+            memcpy(SEQLOCK_COPY(sh, 1), initial, dataSize);
+        }
+        __sync_synchronize();
+        sh->state = SEQLOCK_READY;
+    }
+
+    while(sh->state == SEQLOCK_INITING)
+        sched_yield();
+    __sync_synchronize();
+
+    if(sh->state != SEQLOCK_READY || sh->magic != SEQLOCK_MAGIC ||
+       sh->dataSize != (unsigned int)dataSize)
+    {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return sh;
+}
+
+void misc_seqlockWrite(void *latch, const void *data)
+{
+    seqlockHdr_t *sh = latch;
+
+    seqlockWLock(sh);
+
+    misc_seqWriteBegin(&sh->seq);
+    memcpy(SEQLOCK_COPY(sh, 0), data, sh->dataSize);
+    misc_seqWriteEnd(&sh->seq);
+    memcpy(SEQLOCK_COPY(sh, 1), data, sh->dataSize);
+
+    seqlockWUnlock(sh);
+}
+
+void misc_seqlockUpdate(void *latch, void (*func)(void *data, void *ctxArg),
+                        void *ctxArg)
+{
+    seqlockHdr_t *sh = latch;
+
+    seqlockWLock(sh);
+
+    /* both copies hold the current value between writes */
+    misc_seqWriteBegin(&sh->seq);
+    func(SEQLOCK_COPY(sh, 0), ctxArg);
+    misc_seqWriteEnd(&sh->seq);
+    memcpy(SEQLOCK_COPY(sh, 1), SEQLOCK_COPY(sh, 0), sh->dataSize);
+
+    seqlockWUnlock(sh);
+}
+
+unsigned int misc_seqlockRead(void *latch, void *out)
+{
+    seqlockHdr_t *sh = latch;
+    unsigned int seq;
+
+    do
+    {
+        seq = sh->seq;
+        __sync_synchronize();
+        memcpy(out, SEQLOCK_COPY(sh, seq & 1), sh->dataSize);
+        __sync_synchronize();
+    } while(sh->seq != seq);
+
+    return seq / 2;
+}
+
+unsigned int misc_seqlockVersion(void *latch)
+{
+    return ((seqlockHdr_t *)latch)->seq / 2;
+}
+
+void misc_seqWriteBegin(volatile unsigned int *seq)
+{
+    (*seq)++;
+    __sync_synchronize();
+}
+
+void misc_seqWriteEnd(volatile unsigned int *seq)
+{
+    __sync_synchronize();
+    (*seq)++;
+}
+
+unsigned int misc_seqReadBegin(const volatile unsigned int *seq)
+{
+    unsigned int start;
+
+    while((start = *seq) & 1)
+        sched_yield();
+    __sync_synchronize();
+
+    return start;
+}
+
+int misc_seqReadRetry(const volatile unsigned int *seq, unsigned int start)
+{
+    __sync_synchronize();
+
+    return *seq != start;
+}
@@ -0,0 +1,83 @@
+#ifndef _MISC_SEQLOCK_H_
+#define _MISC_SEQLOCK_H_
+
+/**
+ * Publication of a struct to many readers, in this process or others
+ * through shared memory, without locks on the read side: readers only
+ * load, so they don't bounce a cache line between cpus, and never wait
+ * for the writer.
+ *
+ * The latch keeps two copies of the struct and a sequence counter: the
+ * writer updates one copy while the readers are sent to the other, so
+ * a read only retries if a whole write phase happened during its copy.
+ * Writers are serialized by a lock in the latch.
+ *
+ *     oil_shmOpen(&region, "cfg", misc_seqlockSize(sizeof(cfg_t)), 1,
+ *                 OIL_SHM_CREATE);
+ *     latch = misc_seqlockOpen(oil_shmAddr(region), sizeof(cfg_t), &defaults);
+ *
+ *     writer: misc_seqlockWrite(latch, &cfg);
+ *     reader: if(misc_seqlockVersion(latch) != seen)
+ *                 seen = misc_seqlockRead(latch, &cfg);
+ */
+
+/**
+ * @return bytes needed for a latch of dataSize bytes
+ */
+int misc_seqlockSize(int dataSize);
+
+/**
+ * Format mem as a latch, or attach to the one already in it. Like
+ * misc_arenaOpen(), mem must be zero filled the first time.
+ *
+ * @param mem 8 bytes aligned, misc_seqlockSize(dataSize) bytes
+ * @param dataSize size of the struct, attaching with another size fails
+ * @param initial the first value, NULL for zeros, only used when
+ * formatting
+ *
+ * @return latch, NULL if mem holds something else
+ */
+void *misc_seqlockOpen(void *mem, int dataSize, const void *initial);
+
+/**
+ * Publish a new value.
+ */
+void misc_seqlockWrite(void *latch, const void *data);
+
+/**
+ * Modify the value in place: func gets the current value and changes
+ * it, then the change is published. Other writers wait meanwhile, so
+ * several processes can each update their part of a shared table.
+ */
+void misc_seqlockUpdate(void *latch, void (*func)(void *data, void *ctxArg),
+                        void *ctxArg);
+
+/**
+ * Copy a consistent value.
+ *
+ * @return version of the value copied
+ */
+unsigned int misc_seqlockRead(void *latch, void *out);
+
+/**
+ * Number of writes so far, a single load: compare it to the version
+ * last read to know whether reading again is needed.
+ */
+unsigned int misc_seqlockVersion(void *latch);
+
+/*
+ * Bare sequence counter, for data the latch does not fit, e.g. a ring
+ * of samples. Odd while written, readers retry if it moved:
+ *
+ *     do
+ *     {
+ *         seq = misc_seqReadBegin(&ring->seq);
+ *         copy = ...;
+ *     } while(misc_seqReadRetry(&ring->seq, seq));
+ */
+void misc_seqWriteBegin(volatile unsigned int *seq);
+void misc_seqWriteEnd(volatile unsigned int *seq);
+unsigned int misc_seqReadBegin(const volatile unsigned int *seq);
+int misc_seqReadRetry(const volatile unsigned int *seq, unsigned int start);
+
+#endif
@@ -0,0 +1,1477 @@
+/**
+ * @file   misc_spawn.c
+ *
+ * @brief  posix_spawn() based command runner, see misc_spawn.h.
+ *
+ * A job goes through three states:
+ *   - SPAWN_READING: the output pipe is open and read when readable
+ *   - SPAWN_EXITING: the pipe hit EOF, waiting for the child to exit
+ *   - SPAWN_DONE:    the child is reaped, the result is ready
+ * A timeout kills the child and closes the pipe, a shell child may
+ * have left a grandchild holding it.
+ */
+/* #define F_DEBUG */
+#define _GNU_SOURCE             /* pipe2() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+
+#include "misc_loop.h"
+#include "misc_spawn.h"
+
+#ifdef F_DEBUG
+#define DPRINTF(fmt, args...) printf("%s(%d): " fmt, __FUNCTION__, __LINE__, ## args)
+#else
+#define DPRINTF(fmt, args...)
+#endif
+
+#define SPAWN_FIRST_BUF    16384
+#define SPAWN_MIN_ROOM     4096    /* grow when less is free */
+#define SPAWN_EXIT_POLL_MS 1       /* exit polling while a timeout runs */
+#define SPAWN_MAX_ASYNC    64      /* children awaited by misc_spawnAsync() */
+#define SPAWN_MAX_SPEC     32      /* one printf conversion of a template */
+#define SPAWN_MAX_PARALLEL 64      /* jobs of misc_spawnBatch() at once */
+
+#define SPAWN_SRV_ENV          "MISC_SPAWN_SERVER"
+#define SPAWN_SRV_MAX_REQ      8192    /* packed argv of one request */
+#define SPAWN_SRV_MAX_ARGS     256
+#define SPAWN_SRV_MAX_CHILDREN 256     /* commands running at once */
+#define SPAWN_SRV_MAX_FD       65536   /* fds closed at server start */
+#define SPAWN_SRV_FDS          4       /* reply socket, stdin, stdout, stderr */
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open     434     /* same number on every architecture */
+#endif
+
+extern char **environ;
+
+enum
+{
+    SPAWN_READING,
+    SPAWN_EXITING,
+    SPAWN_DONE
+};
+
+/** Internal job handle. */
+typedef struct spawnJob
+{
+    int                state;
+    pid_t              pid;
+    int                fd;          /**< read end of the output pipe */
+    int                replyFd;     /**< fork server status socket, -1 for
+                                     *   a child of ours */
+    char              *buf;
+    int                len;
+    int                size;
+    miscSpawnOpts_t    opts;
+    unsigned long long deadline;    /**< monotonic ms, 0 for none */
+    int                status;
+    int                timedOut;
+    int                truncated;
+} spawnJob_t;
+
+static unsigned long long spawnNowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Fork server: a helper forked by misc_spawnServerStart() while the
+ * process is still small. It owns a SOCK_SEQPACKET socket, gets one
+ * request per message: the packed argv plus, through SCM_RIGHTS, a
+ * reply socket and the stdin, stdout, stderr of the command. It
+ * answers on the reply socket with the pid, then with the exit status.
+ * gbl_spawnServer.lock serializes the requests, from the sendmsg() to
+ * the pid reply, and keeps the server fd open meanwhile: the server
+ * forks one at a time anyway. Waiting for the exit status needs no
+ * lock, every request has its own reply socket.
+ */
+typedef struct spawnSrvReq
+{
+    int  argc;
+    char args[SPAWN_SRV_MAX_REQ];   /**< argv strings, NUL separated */
+} spawnSrvReq_t;
+
+typedef struct spawnSrvMsg
+{
+    int pid;        /**< -1 if the command could not be run */
+    int err;        /**< errno of the failure */
+    int status;     /**< waitpid() status, in the second message */
+} spawnSrvMsg_t;
+
+typedef struct spawnSrvChild
+{
+    int pid;        /**< 0 for a free slot */
+    int replyFd;
+} spawnSrvChild_t;
+
+static struct
+{
+    pthread_mutex_t lock;   /**< requests, start and stop */
+    int             fd;     /**< -1 when not running */
+    int             pid;
+} gbl_spawnServer = { PTHREAD_MUTEX_INITIALIZER, -1, 0 };
+
+static void spawnSrvReply(int fd, int pid, int err, int status)
+{
+    spawnSrvMsg_t msg;
+
+    msg.pid = pid;
+    msg.err = err;
+    msg.status = status;
+    send(fd, &msg, sizeof(msg), MSG_NOSIGNAL);
+}
+
+/* fork + exec one request, in the server */
+static void spawnSrvExec(spawnSrvReq_t *req, int len, int *fds,
+                         spawnSrvChild_t *children)
+{
+    char *argv[SPAWN_SRV_MAX_ARGS + 1];
+    spawnSrvChild_t *slot = NULL;
+    sigset_t mask;
+    char *p, *end;
+    int i, pid, errPipe[2], err = 0;
+
+    for(i = 0; i < SPAWN_SRV_MAX_CHILDREN; i++)
+    {
+        if(children[i].pid == 0)
+        {
+            slot = &children[i];
+            break;
+        }
+    }
+
+    p = req->args;
+    end = (char *)req + len;
+    for(i = 0; i < req->argc && i < SPAWN_SRV_MAX_ARGS && p < end; i++)
+    {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[i] = NULL;
+
+    if(slot == NULL || i == 0 || i != req->argc || pipe2(errPipe, O_CLOEXEC) != 0)
+    {
+        spawnSrvReply(fds[0], -1, slot == NULL ? EAGAIN : EINVAL, 0);
+        return;
+    }
+
+    pid = fork();
+    if(pid == 0)
+    {
+        dup2(fds[1], STDIN_FILENO);
+        dup2(fds[2], STDOUT_FILENO);
+        dup2(fds[3], STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        execvp(argv[0], argv);
+        err = errno;
+        write(errPipe[1], &err, sizeof(err));
+        _exit(127);
+    }
+
+    /* the exec closes errPipe, a failure writes its errno first */
+    close(errPipe[1]);
+    if(pid < 0)
+        err = errno;
+    else if(read(errPipe[0], &err, sizeof(err)) != sizeof(err))
+        err = 0;
+    close(errPipe[0]);
+
+    if(err != 0)
+    {
+        if(pid > 0)
+            waitpid(pid, NULL, 0);
+        spawnSrvReply(fds[0], -1, err, 0);
+        return;
+    }
+
+    spawnSrvReply(fds[0], pid, 0, 0);
+    slot->pid = pid;
+    /* not inherited by the commands forked later */
+    slot->replyFd = fcntl(fds[0], F_DUPFD_CLOEXEC, 0);
+}
+
+static void spawnSrvMain(int sock)
+{
+    spawnSrvChild_t children[SPAWN_SRV_MAX_CHILDREN];
+    char control[CMSG_SPACE(SPAWN_SRV_FDS * sizeof(int))];
+    struct signalfd_siginfo si;
+    struct pollfd pfd[2];
+    struct cmsghdr *cm;
+    struct msghdr mh;
+    struct iovec iov;
+    spawnSrvReq_t req;
+    sigset_t mask;
+    int fds[SPAWN_SRV_FDS];
+    int i, n, fd, pid, status, maxFd;
+
+    /* keep only stdio and the socket, the commands inherit the rest */
+    maxFd = sysconf(_SC_OPEN_MAX);
+    for(fd = 3; fd < maxFd && fd < SPAWN_SRV_MAX_FD; fd++)
+    {
+        if(fd != sock)
+            close(fd);
+    }
+
+    for(i = 1; i < NSIG; i++)
+        signal(i, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    memset(children, 0, sizeof(children));
+
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    pfd[1].events = POLLIN;
+
+    while(1)
+    {
+        if(poll(pfd, 2, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+
+        if(pfd[1].revents)
+        {
+            while(read(pfd[1].fd, &si, sizeof(si)) > 0)
+                ;
+            while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                for(i = 0; i < SPAWN_SRV_MAX_CHILDREN; i++)
+                {
+                    if(children[i].pid == pid)
+                    {
+                        spawnSrvReply(children[i].replyFd, pid, 0, status);
+                        close(children[i].replyFd);
+                        children[i].pid = 0;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if(pfd[0].revents == 0)
+            continue;
+
+        memset(&mh, 0, sizeof(mh));
+        iov.iov_base = &req;
+        iov.iov_len = sizeof(req);
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+        if(n < 0 && errno == EINTR)
+            continue;
+        /* the library side is gone */
+        if(n <= 0)
+            break;
+
+        cm = CMSG_FIRSTHDR(&mh);
+        if(cm == NULL || cm->cmsg_type != SCM_RIGHTS ||
+           cm->cmsg_len != CMSG_LEN(SPAWN_SRV_FDS * sizeof(int)))
+        {
+            /* malformed, drop whatever fds came with it */
+            if(cm != NULL && cm->cmsg_type == SCM_RIGHTS)
+            {
+                for(i = 0; i < (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++)
+                    close(((int *)CMSG_DATA(cm))[i]);
+            }
+            continue;
+        }
+        memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+        if(n > (int)offsetof(spawnSrvReq_t, args))
+            spawnSrvExec(&req, n, fds, children);
+        else
+            spawnSrvReply(fds[0], -1, EINVAL, 0);
+
+        for(i = 0; i < SPAWN_SRV_FDS; i++)
+            close(fds[i]);
+    }
+
+    _exit(0);
+}
+
+int misc_spawnServerStart(void)
+{
+    int sp[2], pid, ret = -1;
+
+    pthread_mutex_lock(&gbl_spawnServer.lock);
+
+    if(gbl_spawnServer.fd >= 0)
+    {
+        ret = 0;
+        goto out;
+    }
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sp) != 0)
+    {
+        perror("socketpair");
+        goto out;
+    }
+
+    pid = fork();
+    if(pid < 0)
+    {
+        perror("fork");
+        close(sp[0]);
+        close(sp[1]);
+        goto out;
+    }
+    if(pid == 0)
+    {
+        close(sp[0]);
+        spawnSrvMain(sp[1]);
+    }
+
+    close(sp[1]);
+    gbl_spawnServer.fd = sp[0];
+    gbl_spawnServer.pid = pid;
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&gbl_spawnServer.lock);
+
+    return ret;
+}
+
+/* with the lock held */
+static void spawnServerStop(void)
+{
+    if(gbl_spawnServer.fd < 0)
+        return;
+
+    /* the server exits on EOF, the running commands keep running */
+    close(gbl_spawnServer.fd);
+    gbl_spawnServer.fd = -1;
+    waitpid(gbl_spawnServer.pid, NULL, 0);
+}
+
+void misc_spawnServerStop(void)
+{
+    pthread_mutex_lock(&gbl_spawnServer.lock);
+    spawnServerStop();
+    pthread_mutex_unlock(&gbl_spawnServer.lock);
+}
+
+int misc_spawnServerRunning(void)
+{
+    return gbl_spawnServer.fd >= 0;
+}
+
+/* started at load time if asked by the environment, while still small */
+static void __attribute__((constructor)) spawnServerAutoStart(void)
+{
+    const char *env = getenv(SPAWN_SRV_ENV);
+
+    if(env != NULL && env[0] == '1')
+        misc_spawnServerStart();
+}
+
+/** 
+ * Run a command through the fork server.
+ * 
+ * @param replyFd set to the socket the exit status comes from
+ * 
+ * @return pid, 0 if the server is not available, -1 on error
+ */
+static int spawnServerRequest(char *const argv[], int outFd, int errFd,
+                              int *replyFd)
+{
+    char control[CMSG_SPACE(SPAWN_SRV_FDS * sizeof(int))];
+    spawnSrvReq_t req;
+    spawnSrvMsg_t msg;
+    struct cmsghdr *cm;
+    struct msghdr mh;
+    struct iovec iov;
+    int sp[2], fds[SPAWN_SRV_FDS];
+    int len, n, off = 0;
+
+    for(req.argc = 0; argv[req.argc] != NULL; req.argc++)
+    {
+        len = strlen(argv[req.argc]) + 1;
+        if(req.argc == SPAWN_SRV_MAX_ARGS || off + len > SPAWN_SRV_MAX_REQ)
+            return 0;
+        memcpy(req.args + off, argv[req.argc], len);
+        off += len;
+    }
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sp) != 0)
+        return 0;
+
+    fds[0] = sp[1];
+    fds[1] = STDIN_FILENO;
+    fds[2] = outFd;
+    fds[3] = errFd;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &req;
+    iov.iov_len = offsetof(spawnSrvReq_t, args) + off;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    /* one request at a time, and the fd stays open meanwhile */
+    pthread_mutex_lock(&gbl_spawnServer.lock);
+    if(gbl_spawnServer.fd < 0)
+    {
+        pthread_mutex_unlock(&gbl_spawnServer.lock);
+        close(sp[0]);
+        close(sp[1]);
+        return 0;
+    }
+
+    n = sendmsg(gbl_spawnServer.fd, &mh, MSG_NOSIGNAL);
+    close(sp[1]);
+    if(n < 0 && errno == EBADF)
+    {
+        /* no stdin/stdout of ours to pass, posix_spawn copes with that */
+        pthread_mutex_unlock(&gbl_spawnServer.lock);
+        close(sp[0]);
+        return 0;
+    }
+    if(n > 0)
+    {
+        while((n = recv(sp[0], &msg, sizeof(msg), 0)) < 0 && errno == EINTR)
+            ;
+    }
+
+    if(n != sizeof(msg))
+    {
+        /* the server died, run locally from now on */
+        close(sp[0]);
+        fprintf(stderr, "spawn server gone, spawning locally\n");
+        spawnServerStop();
+        pthread_mutex_unlock(&gbl_spawnServer.lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&gbl_spawnServer.lock);
+
+    if(msg.pid < 0)
+    {
+        close(sp[0]);
+        errno = msg.err;
+        /* out of slots: not worth failing the command */
+        return msg.err == EAGAIN ? 0 : -1;
+    }
+
+    *replyFd = sp[0];
+
+    return msg.pid;
+}
+
+int misc_spawnStart(void **job, char *const argv[], const miscSpawnOpts_t *opts)
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    spawnJob_t *sj;
+    int fds[2], err, pid;
+    short flags;
+
+    *job = NULL;
+
+    if((sj = calloc(1, sizeof(spawnJob_t))) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    if(opts != NULL)
+        sj->opts = *opts;
+
+    sj->replyFd = -1;
+
+    if(pipe2(fds, O_CLOEXEC) != 0)
+    {
+        perror("pipe");
+        free(sj);
+        return -1;
+    }
+
+    if(gbl_spawnServer.fd >= 0)
+    {
+        pid = spawnServerRequest(argv,
+                                 sj->opts.passOutput ? STDOUT_FILENO : fds[1],
+                                 sj->opts.passOutput || !sj->opts.mergeStderr ?
+                                 STDERR_FILENO : fds[1],
+                                 &sj->replyFd);
+        if(pid != 0)
+        {
+            err = pid < 0 ? errno : 0;
+            sj->pid = pid;
+            goto spawned;
+        }
+    }
+
+    posix_spawn_file_actions_init(&fa);
+    if(!sj->opts.passOutput)
+    {
+        posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+        if(sj->opts.mergeStderr)
+            posix_spawn_file_actions_adddup2(&fa, fds[1], STDERR_FILENO);
+    }
+
+    /* the caller may block signals for a misc_loop or ignore SIGPIPE,
+     * the command must not inherit that */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigfillset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+    /* older libcs only avoid copying the page tables when asked */
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    err = posix_spawnp(&sj->pid, argv[0], &fa, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+
+spawned:
+    close(fds[1]);
+
+    if(err != 0)
+    {
+        errno = err;
+        perror("posix_spawn");
+        close(fds[0]);
+        free(sj);
+        return -1;
+    }
+
+    if(sj->opts.passOutput)
+    {
+        close(fds[0]);
+        sj->fd = -1;
+        sj->state = SPAWN_EXITING;
+    }
+    else
+    {
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        sj->fd = fds[0];
+        sj->state = SPAWN_READING;
+    }
+    if(sj->opts.timeoutMs > 0)
+        sj->deadline = spawnNowMs() + sj->opts.timeoutMs;
+
+    DPRINTF("%s: pid %d\n", argv[0], (int)sj->pid);
+
+    *job = sj;
+
+    return 0;
+}
+
+int misc_spawnJobFd(void *job)
+{
+    spawnJob_t *sj = (spawnJob_t *)job;
+
+    if(sj->state == SPAWN_READING)
+        return sj->fd;
+    if(sj->state == SPAWN_EXITING)
+        return sj->replyFd;
+
+    return -1;
+}
+
+int misc_spawnJobRemainingMs(void *job)
+{
+    spawnJob_t *sj = (spawnJob_t *)job;
+    unsigned long long now;
+
+    if(sj->deadline == 0 || sj->state == SPAWN_DONE)
+        return -1;
+
+    now = spawnNowMs();
+
+    return now >= sj->deadline ? 0 : (int)(sj->deadline - now);
+}
+
+/* double the buffer when it is nearly full, up to maxOutput */
+static int spawnGrow(spawnJob_t *sj)
+{
+    char *nbuf;
+    int nsize;
+
+    if(sj->size - sj->len > SPAWN_MIN_ROOM)
+        return 0;
+
+    nsize = sj->size ? sj->size * 2 : SPAWN_FIRST_BUF;
+    if(sj->opts.maxOutput > 0 && nsize > sj->opts.maxOutput + 1)
+        nsize = sj->opts.maxOutput + 1;
+    if(nsize <= sj->size)
+        return 0;
+
+    if((nbuf = realloc(sj->buf, nsize)) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    sj->buf = nbuf;
+    sj->size = nsize;
+
+    return 0;
+}
+
+static void spawnCloseFd(spawnJob_t *sj)
+{
+    if(sj->fd >= 0)
+    {
+        close(sj->fd);
+        sj->fd = -1;
+    }
+}
+
+/* read until EAGAIN or EOF */
+static int spawnRead(spawnJob_t *sj)
+{
+    char drop[4096];
+    ssize_t n;
+    int room;
+
+    while(1)
+    {
+        if(spawnGrow(sj) != 0)
+            return -1;
+
+        /* keep one byte for the NUL */
+        room = sj->size - sj->len - 1;
+        if(room > 0)
+            n = read(sj->fd, sj->buf + sj->len, room);
+        else
+            n = read(sj->fd, drop, sizeof(drop));
+
+        if(n > 0)
+        {
+            if(room > 0)
+                sj->len += n;
+            else
+                sj->truncated = 1;
+            continue;
+        }
+        if(n == 0)
+        {
+            spawnCloseFd(sj);
+            sj->state = SPAWN_EXITING;
+            return 0;
+        }
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+
+        perror("read");
+        return -1;
+    }
+}
+
+/* get the exit status, from waitpid() or from the fork server */
+static int spawnReap(spawnJob_t *sj, int block)
+{
+    spawnSrvMsg_t msg;
+    pid_t ret;
+
+    if(sj->replyFd >= 0)
+    {
+        do
+        {
+            ret = recv(sj->replyFd, &msg, sizeof(msg), block ? 0 : MSG_DONTWAIT);
+        } while(ret < 0 && errno == EINTR);
+
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if(ret != sizeof(msg))
+        {
+            fprintf(stderr, "spawn server: no status for pid %d\n", (int)sj->pid);
+            errno = ECHILD;
+            return -1;
+        }
+        sj->status = msg.status;
+    }
+    else
+    {
+        do
+        {
+            ret = waitpid(sj->pid, &sj->status, block ? 0 : WNOHANG);
+        } while(ret < 0 && errno == EINTR);
+
+        if(ret < 0 && errno == ECHILD)
+        {
+            /* SIGCHLD ignored: reaped by the kernel, the status is lost */
+            sj->status = MISC_SPAWN_STATUS_UNKNOWN;
+        }
+        else if(ret < 0)
+        {
+            perror("waitpid");
+            return -1;
+        }
+        else if(ret == 0)
+            return 0;
+    }
+
+    sj->state = SPAWN_DONE;
+
+    return 1;
+}
+
+int misc_spawnJobStep(void *job)
+{
+    spawnJob_t *sj = (spawnJob_t *)job;
+
+    if(sj->state == SPAWN_READING && spawnRead(sj) != 0)
+        return -1;
+
+    if(sj->state != SPAWN_DONE && sj->deadline != 0 &&
+       !sj->timedOut && spawnNowMs() >= sj->deadline)
+    {
+        DPRINTF("pid %d timed out\n", (int)sj->pid);
+        kill(sj->pid, SIGKILL);
+        sj->timedOut = 1;
+        spawnCloseFd(sj);
+        sj->state = SPAWN_EXITING;
+    }
+
+    /* a killed child is reaped at once, don't poll for it */
+    if(sj->state == SPAWN_EXITING && spawnReap(sj, sj->timedOut) < 0)
+        return -1;
+
+    return sj->state == SPAWN_DONE ? MISC_SPAWN_DONE : MISC_SPAWN_RUNNING;
+}
+
+static void spawnFree(spawnJob_t *sj)
+{
+    if(sj->state != SPAWN_DONE)
+    {
+        /* not reaped yet, the pid is still ours */
+        kill(sj->pid, SIGKILL);
+        if(sj->replyFd < 0)
+            waitpid(sj->pid, NULL, 0);
+    }
+    if(sj->replyFd >= 0)
+        close(sj->replyFd);
+    spawnCloseFd(sj);
+    free(sj->buf);
+    free(sj);
+}
+
+int misc_spawnFinish(void **job, miscSpawnResult_t *res)
+{
+    spawnJob_t *sj = (spawnJob_t *)(*job);
+    struct pollfd pfd;
+    int ret, timeout;
+
+    memset(res, 0, sizeof(miscSpawnResult_t));
+
+    while((ret = misc_spawnJobStep(sj)) == MISC_SPAWN_RUNNING)
+    {
+        timeout = misc_spawnJobRemainingMs(sj);
+
+        if(sj->state == SPAWN_EXITING)
+        {
+            /* output closed but the child still runs */
+            if(timeout < 0)
+            {
+                ret = spawnReap(sj, 1) < 0 ? -1 : MISC_SPAWN_DONE;
+                break;
+            }
+            if(sj->replyFd < 0)
+            {
+                usleep(SPAWN_EXIT_POLL_MS * 1000);
+                continue;
+            }
+        }
+
+        pfd.fd = misc_spawnJobFd(sj);
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            ret = -1;
+            break;
+        }
+    }
+
+    if(ret != MISC_SPAWN_DONE)
+    {
+        spawnFree(sj);
+        *job = NULL;
+        return -1;
+    }
+
+    /* hand the buffer over instead of copying it */
+    if(sj->buf == NULL && (sj->buf = malloc(1)) == NULL)
+    {
+        perror("malloc");
+        spawnFree(sj);
+        *job = NULL;
+        return -1;
+    }
+    sj->buf[sj->len] = '\0';
+
+    res->output = sj->buf;
+    res->len = sj->len;
+    res->status = sj->status;
+    res->timedOut = sj->timedOut;
+    res->truncated = sj->truncated;
+
+    sj->buf = NULL;
+    spawnFree(sj);
+    *job = NULL;
+
+    return 0;
+}
+
+int misc_spawnRun(char *const argv[], const miscSpawnOpts_t *opts,
+                  miscSpawnResult_t *res)
+{
+    void *job;
+
+    if(misc_spawnStart(&job, argv, opts) != 0)
+    {
+        memset(res, 0, sizeof(miscSpawnResult_t));
+        return -1;
+    }
+
+    return misc_spawnFinish(&job, res);
+}
+
+int misc_spawnShell(const char *cmd, const miscSpawnOpts_t *opts,
+                    miscSpawnResult_t *res)
+{
+    char *argv[] = { "/bin/sh", "-c", (char *)cmd, NULL };
+
+    return misc_spawnRun(argv, opts, res);
+}
+
+void misc_spawnResultFree(miscSpawnResult_t *res)
+{
+    free(res->output);
+    res->output = NULL;
+    res->len = 0;
+}
+
+int misc_spawnv(char *const argv[])
+{
+    miscSpawnOpts_t opts;
+    miscSpawnResult_t res;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.passOutput = 1;
+    if(misc_spawnRun(argv, &opts, &res) != 0)
+        return -1;
+    misc_spawnResultFree(&res);
+
+    return res.status;
+}
+
+/* hand over the results that are ready, in the order asked for */
+static void spawnBatchDeliver(miscSpawnCmd_t *cmds, int n, char *ready,
+                              int *next, int idx, int order,
+                              miscSpawnBatchFunc_t func, void *ctxArg)
+{
+    ready[idx] = 1;
+    if(func == NULL)
+        return;
+
+    if(order == MISC_SPAWN_ORDER_COMPLETION)
+    {
+        (func)(idx, &cmds[idx], ctxArg);
+        return;
+    }
+
+    while(*next < n && ready[*next])
+    {
+        (func)(*next, &cmds[*next], ctxArg);
+        (*next)++;
+    }
+}
+
+int misc_spawnBatch(miscSpawnCmd_t *cmds, int n, int maxParallel,
+                    const miscSpawnOpts_t *opts, int order,
+                    miscSpawnBatchFunc_t func, void *ctxArg)
+{
+    struct pollfd pfd[SPAWN_MAX_PARALLEL];
+    void *jobs[SPAWN_MAX_PARALLEL];
+    int idx[SPAWN_MAX_PARALLEL];
+    char *ready;
+    int started = 0, running = 0, next = 0, ok = 0;
+    int i, j, ret, timeout, remaining;
+
+    if(maxParallel <= 0 || maxParallel > SPAWN_MAX_PARALLEL)
+        maxParallel = SPAWN_MAX_PARALLEL;
+
+    if((ready = calloc(n > 0 ? n : 1, 1)) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    while(started < n || running > 0)
+    {
+        /* keep maxParallel commands going */
+        while(started < n && running < maxParallel)
+        {
+            miscSpawnCmd_t *cmd = &cmds[started];
+            char *shArgv[] = { "/bin/sh", "-c", (char *)cmd->cmd, NULL };
+
+            memset(&cmd->res, 0, sizeof(miscSpawnResult_t));
+            cmd->err = misc_spawnStart(&jobs[running],
+                                       cmd->argv != NULL ? cmd->argv : shArgv, opts);
+            if(cmd->err != 0)
+            {
+                spawnBatchDeliver(cmds, n, ready, &next, started, order, func, ctxArg);
+                started++;
+                continue;
+            }
+            idx[running++] = started++;
+        }
+        if(running == 0)
+            break;
+
+        /* one poll for every pipe and status socket */
+        timeout = -1;
+        for(i = 0; i < running; i++)
+        {
+            pfd[i].fd = misc_spawnJobFd(jobs[i]);
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+            remaining = misc_spawnJobRemainingMs(jobs[i]);
+            /* a local child past EOF has nothing to poll on */
+            if(pfd[i].fd < 0 && (remaining < 0 || remaining > SPAWN_EXIT_POLL_MS))
+                remaining = SPAWN_EXIT_POLL_MS;
+            if(remaining >= 0 && (timeout < 0 || remaining < timeout))
+                timeout = remaining;
+        }
+
+        if(poll(pfd, running, timeout) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+
+        for(i = j = 0; i < running; i++)
+        {
+            if(pfd[i].revents == 0 && pfd[i].fd >= 0 &&
+               misc_spawnJobRemainingMs(jobs[i]) != 0)
+            {
+                jobs[j] = jobs[i];
+                idx[j++] = idx[i];
+                continue;
+            }
+
+            ret = misc_spawnJobStep(jobs[i]);
+            if(ret == MISC_SPAWN_RUNNING)
+            {
+                jobs[j] = jobs[i];
+                idx[j++] = idx[i];
+                continue;
+            }
+
+            cmds[idx[i]].err = misc_spawnFinish(&jobs[i], &cmds[idx[i]].res);
+            if(cmds[idx[i]].err == 0)
+                ok++;
+            spawnBatchDeliver(cmds, n, ready, &next, idx[i], order, func, ctxArg);
+        }
+        running = j;
+    }
+
+    /* only after a poll failure */
+    for(i = 0; i < running; i++)
+    {
+        cmds[idx[i]].err = misc_spawnFinish(&jobs[i], &cmds[idx[i]].res);
+        if(cmds[idx[i]].err == 0)
+            ok++;
+        spawnBatchDeliver(cmds, n, ready, &next, idx[i], order, func, ctxArg);
+    }
+
+    free(ready);
+
+    return ok;
+}
+
+/** Growing string for the word being built */
+typedef struct spawnStr
+{
+    char *buf;
+    int   len;
+    int   size;
+} spawnStr_t;
+
+static int spawnStrRoom(spawnStr_t *str, int n)
+{
+    char *nbuf;
+    int nsize;
+
+    if(str->len + n + 1 <= str->size)
+        return 0;
+
+    nsize = str->size ? str->size : 64;
+    while(nsize < str->len + n + 1)
+        nsize *= 2;
+    if((nbuf = realloc(str->buf, nsize)) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    str->buf = nbuf;
+    str->size = nsize;
+
+    return 0;
+}
+
+static int spawnStrAdd(spawnStr_t *str, const char *data, int n)
+{
+    if(spawnStrRoom(str, n) != 0)
+        return -1;
+    memcpy(str->buf + str->len, data, n);
+    str->len += n;
+    str->buf[str->len] = '\0';
+
+    return 0;
+}
+
+/* format one conversion of the given type at the end of the word */
+#define SPAWN_FMT(str, spec, ap, type)                                  \
+    do {                                                                \
+        type value = va_arg(ap, type);                                  \
+        int n_ = snprintf(NULL, 0, spec, value);                        \
+        if(n_ < 0 || spawnStrRoom(str, n_) != 0)                        \
+            goto err;                                                   \
+        snprintf((str)->buf + (str)->len, n_ + 1, spec, value);         \
+        (str)->len += n_;                                               \
+    } while(0)
+
+char **misc_vspawnArgv(const char *format, va_list ap)
+{
+    spawnStr_t word = { NULL, 0, 0 };
+    char **argv = NULL, **nargv;
+    char spec[SPAWN_MAX_SPEC], conv;
+    const char *p, *start;
+    int argc = 0, inWord = 0, sq = 0, dq = 0;
+    int lng, n, star;
+
+    for(p = format; ; p++)
+    {
+        /* end of a word */
+        if(*p == '\0' || (!sq && !dq && (*p == ' ' || *p == '\t' || *p == '\n')))
+        {
+            if(inWord)
+            {
+                if((nargv = realloc(argv, (argc + 2) * sizeof(char *))) == NULL)
+                {
+                    perror("malloc");
+                    goto err;
+                }
+                argv = nargv;
+                if(word.buf == NULL && spawnStrRoom(&word, 0) != 0)
+                    goto err;
+                word.buf[word.len] = '\0';
+                argv[argc++] = word.buf;
+                argv[argc] = NULL;
+                memset(&word, 0, sizeof(word));
+                inWord = 0;
+            }
+            if(*p == '\0')
+                break;
+            continue;
+        }
+
+        inWord = 1;
+
+        if(*p == '\'' && !dq)
+        {
+            sq = !sq;
+            continue;
+        }
+        if(*p == '"' && !sq)
+        {
+            dq = !dq;
+            continue;
+        }
+        if(*p == '\\' && !sq && p[1] != '\0')
+        {
+            p++;
+            if(spawnStrAdd(&word, p, 1) != 0)
+                goto err;
+            continue;
+        }
+        if(*p != '%' || sq)
+        {
+            if(spawnStrAdd(&word, p, 1) != 0)
+                goto err;
+            continue;
+        }
+
+        /* a conversion, it only ever adds to the current word */
+        if(p[1] == '%')
+        {
+            p++;
+            if(spawnStrAdd(&word, "%", 1) != 0)
+                goto err;
+            continue;
+        }
+
+        start = p++;
+        star = 0;
+        while(*p != '\0' && strchr("-+ #0", *p) != NULL)
+            p++;
+        while((*p >= '0' && *p <= '9') || *p == '*' || *p == '.')
+        {
+            if(*p == '*')
+                star++;
+            p++;
+        }
+        lng = 0;
+        while(*p != '\0' && strchr("hlqjzt", *p) != NULL)
+        {
+            if(*p == 'q' || *p == 'j')
+                lng += 2;
+            else if(*p != 'h')
+                lng++;
+            p++;
+        }
+        conv = *p;
+        n = p - start + 1;
+        if(conv == '\0' || n >= SPAWN_MAX_SPEC || star > 0)
+        {
+            /* '*' would need several arguments per conversion */
+            errno = EINVAL;
+            goto err;
+        }
+        memcpy(spec, start, n);
+        spec[n] = '\0';
+
+        switch(conv)
+        {
+            case 'd': case 'i':
+                if(lng >= 2)
+                    SPAWN_FMT(&word, spec, ap, long long);
+                else if(lng == 1)
+                    SPAWN_FMT(&word, spec, ap, long);
+                else
+                    SPAWN_FMT(&word, spec, ap, int);
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                if(lng >= 2)
+                    SPAWN_FMT(&word, spec, ap, unsigned long long);
+                else if(lng == 1)
+                    SPAWN_FMT(&word, spec, ap, unsigned long);
+                else
+                    SPAWN_FMT(&word, spec, ap, unsigned int);
+                break;
+            case 'c':
+                SPAWN_FMT(&word, spec, ap, int);
+                break;
+            case 's':
+                SPAWN_FMT(&word, spec, ap, const char *);
+                break;
+            case 'p':
+                SPAWN_FMT(&word, spec, ap, void *);
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+                SPAWN_FMT(&word, spec, ap, double);
+                break;
+            default:
+                errno = EINVAL;
+                goto err;
+        }
+    }
+
+    if(sq || dq || argv == NULL)
+    {
+        errno = EINVAL;
+        goto err;
+    }
+
+    return argv;
+
+err:
+    free(word.buf);
+    misc_spawnArgvFree(argv);
+    return NULL;
+}
+
+char **misc_spawnArgv(const char *format, ...)
+{
+    char **argv;
+    va_list ap;
+
+    va_start(ap, format);
+    argv = misc_vspawnArgv(format, ap);
+    va_end(ap);
+
+    return argv;
+}
+
+void misc_spawnArgvFree(char **argv)
+{
+    int i;
+
+    if(argv == NULL)
+        return;
+
+    for(i = 0; argv[i] != NULL; i++)
+        free(argv[i]);
+    free(argv);
+}
+
+int misc_spawnf(const char *format, ...)
+{
+    char **argv;
+    va_list ap;
+    int status;
+
+    va_start(ap, format);
+    argv = misc_vspawnArgv(format, ap);
+    va_end(ap);
+
+    if(argv == NULL)
+    {
+        fprintf(stderr, "misc_spawnf: bad template \"%s\"\n", format);
+        return -1;
+    }
+
+    status = misc_spawnv(argv);
+    misc_spawnArgvFree(argv);
+
+    return status;
+}
+
+/** A child awaited by misc_spawnAsync() */
+typedef struct spawnAsync
+{
+    int                 pid;        /**< 0 for a free slot, -1 while
+                                     *   misc_spawnAsync() sets it up */
+    int                 pidfd;      /**< pidfd or fork server socket, -1
+                                     *   when waited through SIGCHLD */
+    int                 server;     /**< started by the fork server */
+    void               *loop;
+    miscSpawnDoneFunc_t func;
+    void               *ctxArg;
+} spawnAsync_t;
+
+static spawnAsync_t gbl_spawnAsync[SPAWN_MAX_ASYNC];
+static void *gbl_spawnSigLoop;      /**< loop the SIGCHLD fallback uses */
+/* the slots and gbl_spawnSigLoop: loops of several threads may spawn */
+static pthread_mutex_t gbl_spawnAsyncLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* reap one child if it exited, free its slot before the callback */
+static int spawnAsyncReap(spawnAsync_t *sa)
+{
+    spawnAsync_t done;
+    spawnSrvMsg_t msg;
+    int status = 0, n, ready = 0;
+
+    /* the spawning thread and the SIGCHLD loop may both try */
+    pthread_mutex_lock(&gbl_spawnAsyncLock);
+    done = *sa;
+    if(sa->pid > 0 && sa->server)
+    {
+        n = recv(sa->pidfd, &msg, sizeof(msg), MSG_DONTWAIT);
+        if(n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            /* a dead server reports as killed */
+            status = n == sizeof(msg) ? msg.status : SIGKILL;
+            ready = 1;
+        }
+    }
+    else if(sa->pid > 0)
+    {
+        if((n = waitpid(sa->pid, &status, WNOHANG)) > 0)
+            ready = 1;
+        else if(n < 0 && errno == ECHILD)
+        {
+            /* SIGCHLD ignored, the kernel reaped it */
+            status = MISC_SPAWN_STATUS_UNKNOWN;
+            ready = 1;
+        }
+    }
+
+    if(ready)
+    {
+        if(sa->pidfd >= 0)
+        {
+            misc_loopDelFd(sa->loop, sa->pidfd);
+            close(sa->pidfd);
+        }
+        sa->pid = 0;
+    }
+    pthread_mutex_unlock(&gbl_spawnAsyncLock);
+
+    if(!ready)
+        return 0;
+
+    (done.func)(done.pid, status, done.ctxArg);
+
+    return 1;
+}
+
+static void spawnPidfdRead(int fd, int events, void *ctxArg)
+{
+    spawnAsyncReap((spawnAsync_t *)ctxArg);
+}
+
+static void spawnSigchld(int signo, void *ctxArg)
+{
+    int i, mine;
+
+    /* SIGCHLD are merged, check every child waited this way */
+    for(i = 0; i < SPAWN_MAX_ASYNC; i++)
+    {
+        pthread_mutex_lock(&gbl_spawnAsyncLock);
+        mine = gbl_spawnAsync[i].pid > 0 && gbl_spawnAsync[i].pidfd < 0 &&
+            gbl_spawnAsync[i].loop == ctxArg;
+        pthread_mutex_unlock(&gbl_spawnAsyncLock);
+        if(mine)
+            spawnAsyncReap(&gbl_spawnAsync[i]);
+    }
+}
+
+/* the child can't be waited for: kill it, free the slot, fail */
+static int spawnAsyncAbort(spawnAsync_t *sa, int pid)
+{
+    int err = errno;
+
+    kill(pid, SIGKILL);
+    if(sa->server)
+        close(sa->pidfd);
+    else
+    {
+        while(waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+
+    pthread_mutex_lock(&gbl_spawnAsyncLock);
+    sa->pid = 0;
+    pthread_mutex_unlock(&gbl_spawnAsyncLock);
+
+    errno = err;
+
+    return -1;
+}
+
+int misc_spawnAsync(void *loop, char *const argv[], miscSpawnDoneFunc_t func,
+                    void *ctxArg)
+{
+    miscSpawnOpts_t opts;
+    spawnAsync_t *sa = NULL;
+    spawnJob_t *sj;
+    void *job;
+    int i, pid, ret;
+
+    pthread_mutex_lock(&gbl_spawnAsyncLock);
+    for(i = 0; i < SPAWN_MAX_ASYNC; i++)
+    {
+        if(gbl_spawnAsync[i].pid == 0)
+        {
+            sa = &gbl_spawnAsync[i];
+            sa->pid = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gbl_spawnAsyncLock);
+    if(sa == NULL)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.passOutput = 1;
+    if(misc_spawnStart(&job, argv, &opts) != 0)
+    {
+        pthread_mutex_lock(&gbl_spawnAsyncLock);
+        sa->pid = 0;
+        pthread_mutex_unlock(&gbl_spawnAsyncLock);
+        return -1;
+    }
+
+    /* the job only served to start the child, the slot waits for it */
+    sj = (spawnJob_t *)job;
+    pid = sj->pid;
+    sa->loop = loop;
+    sa->func = func;
+    sa->ctxArg = ctxArg;
+    sa->server = sj->replyFd >= 0;
+    sa->pidfd = sj->replyFd;
+    sj->replyFd = -1;
+    sj->state = SPAWN_DONE;
+    spawnFree(sj);
+
+    if(!sa->server)
+        sa->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if(sa->pidfd >= 0)
+    {
+        fcntl(sa->pidfd, F_SETFD, FD_CLOEXEC);
+        pthread_mutex_lock(&gbl_spawnAsyncLock);
+        sa->pid = pid;
+        ret = misc_loopAddFd(loop, sa->pidfd, MISC_LOOP_READ, spawnPidfdRead, sa);
+        if(ret != 0)
+            sa->pid = -1;
+        pthread_mutex_unlock(&gbl_spawnAsyncLock);
+        if(ret == 0)
+            return pid;
+
+        /* the fork server's child only reports on its socket */
+        if(sa->server)
+            return spawnAsyncAbort(sa, pid);
+        close(sa->pidfd);
+        sa->pidfd = -1;
+    }
+
+    /* kernels before 5.3: SIGCHLD through the first loop that needed it */
+    pthread_mutex_lock(&gbl_spawnAsyncLock);
+    if(gbl_spawnSigLoop == NULL &&
+       misc_loopAddSignal(loop, SIGCHLD, spawnSigchld, loop) == 0)
+        gbl_spawnSigLoop = loop;
+    if((ret = gbl_spawnSigLoop != NULL))
+    {
+        sa->loop = gbl_spawnSigLoop;
+        sa->pid = pid;
+    }
+    pthread_mutex_unlock(&gbl_spawnAsyncLock);
+    if(!ret)
+        return spawnAsyncAbort(sa, pid);
+
+    /* it may have exited before SIGCHLD was caught by the loop */
+    spawnAsyncReap(sa);
+
+    return pid;
+}
@@ -0,0 +1,228 @@
+#ifndef _MISC_SPAWN_H_
+#define _MISC_SPAWN_H_
+
+#include <stdarg.h>
+
+/**
+ * Command runner: posix_spawn() with a raw output pipe, no popen()
+ * nor stdio. The output is read in large chunks into a buffer grown
+ * geometrically, so reading it is linear in its size.
+ *
+ * A run is a job, a small state machine advanced by
+ * misc_spawnJobStep() whenever its fd is readable, so many jobs can
+ * be driven from one poll loop. misc_spawnRun() is the blocking
+ * start + wait of a single job.
+ */
+
+/** misc_spawnJobStep() results */
+#define MISC_SPAWN_RUNNING  0
+#define MISC_SPAWN_DONE     1
+
+/** status of a child reaped by the kernel (SIGCHLD set to SIG_IGN):
+ *  neither WIFEXITED() nor WIFSIGNALED() */
+#define MISC_SPAWN_STATUS_UNKNOWN  (-1)
+
+/** misc_spawnBatch() delivery order */
+#define MISC_SPAWN_ORDER_COMPLETION  0
+#define MISC_SPAWN_ORDER_SUBMISSION  1
+
+typedef struct miscSpawnOpts
+{
+    int timeoutMs;      /**< kill the child (SIGKILL) after, 0 for none */
+    int maxOutput;      /**< output bytes kept, the rest is read and dropped,
+                         *   0 for no limit */
+    int mergeStderr;    /**< stderr goes to the output too */
+    int passOutput;     /**< don't capture, the child writes to our
+                         *   stdout/stderr like with system() */
+} miscSpawnOpts_t;
+
+typedef struct miscSpawnResult
+{
+    char *output;       /**< malloc'ed and NUL terminated, never NULL
+                         *   on success, free with misc_spawnResultFree() */
+    int   len;
+    int   status;       /**< waitpid() status, test it with WIFEXITED() ...,
+                         *   MISC_SPAWN_STATUS_UNKNOWN when SIGCHLD is
+                         *   ignored */
+    int   timedOut;
+    int   truncated;    /**< output was longer than maxOutput */
+} miscSpawnResult_t;
+
+/**
+ * Start a job, argv[0] is searched in PATH. No shell is involved, so
+ * the arguments need no quoting.
+ *
+ * @param job
+ * @param argv NULL terminated
+ * @param opts NULL for the defaults
+ *
+ * @return 0 on success, -1 on error
+ */
+int misc_spawnStart(void **job, char *const argv[], const miscSpawnOpts_t *opts);
+
+/**
+ * The fd to wait for before calling misc_spawnJobStep(): the output
+ * pipe, then the fork server status socket. -1 if the exit of a local
+ * child is awaited, step it again after a short delay.
+ */
+int misc_spawnJobFd(void *job);
+
+/**
+ * Time left before the job is killed.
+ *
+ * @return ms, -1 if the job has no timeout
+ */
+int misc_spawnJobRemainingMs(void *job);
+
+/**
+ * Read the available output, enforce the timeout and reap the child,
+ * never blocks.
+ *
+ * @return MISC_SPAWN_RUNNING, MISC_SPAWN_DONE or -1 on error
+ */
+int misc_spawnJobStep(void *job);
+
+/**
+ * Wait for the job to be done, fill res and free the job.
+ *
+ * @return 0 on success, -1 on error (res->output is then NULL)
+ */
+int misc_spawnFinish(void **job, miscSpawnResult_t *res);
+
+/**
+ * Run a command and collect its output and exit status.
+ *
+ * @return 0 if it ran (whatever its exit status), -1 on error
+ */
+int misc_spawnRun(char *const argv[], const miscSpawnOpts_t *opts,
+                  miscSpawnResult_t *res);
+
+/**
+ * Same as misc_spawnRun() through "/bin/sh -c cmd", for commands
+ * using pipes, redirections or globbing.
+ */
+int misc_spawnShell(const char *cmd, const miscSpawnOpts_t *opts,
+                    miscSpawnResult_t *res);
+
+void misc_spawnResultFree(miscSpawnResult_t *res);
+
+/** One command of a misc_spawnBatch() */
+typedef struct miscSpawnCmd
+{
+    char *const       *argv;    /**< command, or NULL to run cmd */
+    const char        *cmd;     /**< shell command, used if argv is NULL */
+    int                err;     /**< out: -1 if it could not be run */
+    miscSpawnResult_t  res;     /**< out: free with misc_spawnResultFree() */
+} miscSpawnCmd_t;
+
+typedef void (*miscSpawnBatchFunc_t)(int idx, miscSpawnCmd_t *cmd, void *ctxArg);
+
+/**
+ * Run independent commands in parallel, at most maxParallel at once,
+ * all driven from a single poll() loop. The results stay in cmds,
+ * func (if not NULL) is also called for each one as it is ready:
+ * as the commands end (MISC_SPAWN_ORDER_COMPLETION) or in the cmds
+ * order (MISC_SPAWN_ORDER_SUBMISSION), holding back the results of
+ * the commands that ended early.
+ *
+ * @param cmds
+ * @param n
+ * @param maxParallel 0 for the max (64)
+ * @param opts applied to every command, NULL for the defaults
+ * @param order
+ * @param func
+ * @param ctxArg
+ *
+ * @return number of commands that ran, -1 on error
+ */
+int misc_spawnBatch(miscSpawnCmd_t *cmds, int n, int maxParallel,
+                    const miscSpawnOpts_t *opts, int order,
+                    miscSpawnBatchFunc_t func, void *ctxArg);
+
+/**
+ * Start the fork server: a small helper process forked now, which
+ * forks the commands from then on instead of this process. Call it
+ * early in main(), before the process grows, or let libmisc start it
+ * when loaded by setting MISC_SPAWN_SERVER=1 in the environment.
+ *
+ * Every misc_spawn API goes through it once started, and falls back
+ * to a local posix_spawn() if it is gone. The commands get the
+ * environment and working directory of the process at start time.
+ *
+ * @return 0 on success, -1 on error
+ */
+int misc_spawnServerStart(void);
+
+/**
+ * Stop the fork server, the commands it started keep running.
+ */
+void misc_spawnServerStop(void);
+
+int misc_spawnServerRunning(void);
+
+/**
+ * Run a command without a shell and wait for it, the output is not
+ * captured. posix_spawn() does not copy the caller's page tables, so
+ * the cost does not grow with the caller's memory as system() does.
+ *
+ * @param argv NULL terminated, argv[0] is searched in PATH
+ *
+ * @return waitpid() status, -1 if it could not be run or SIGCHLD is
+ * ignored (MISC_SPAWN_STATUS_UNKNOWN)
+ */
+int misc_spawnv(char *const argv[]);
+
+/**
+ * Build an argv from a printf like template. The template is split in
+ * words first, shell like, then every conversion is formatted into
+ * its own word: a "%s" value with spaces or quotes stays one
+ * argument, nothing is re-parsed.
+ *
+ *     misc_spawnf("ip addr add %s/%d dev %s", ip, len, ifname);
+ *     misc_spawnf("logger -t app 'done: %s'", msg);    -> literal %s
+ *     misc_spawnf("logger -t app \"done: %s\"", msg); -> formatted
+ *
+ * Words are split on blanks outside quotes, '...' is literal, "..."
+ * and unquoted text take conversions, a backslash escapes the next
+ * character.
+ * Conversions: d i u x X o c s p f e g with h l ll z j t, no '*'.
+ *
+ * @return malloc'ed argv, free it with misc_spawnArgvFree(), NULL if
+ * the template is invalid
+ */
+char **misc_spawnArgv(const char *format, ...);
+
+/* va_list flavour of misc_spawnArgv() */
+char **misc_vspawnArgv(const char *format, va_list ap);
+
+void misc_spawnArgvFree(char **argv);
+
+/**
+ * misc_spawnv() of a misc_spawnArgv() template.
+ *
+ * @return waitpid() status, -1 if the template is bad or the command
+ * could not be run
+ */
+int misc_spawnf(const char *format, ...);
+
+typedef void (*miscSpawnDoneFunc_t)(int pid, int status, void *ctxArg);
+
+/**
+ * Start a command and get its exit status from a misc_loop, through a
+ * pidfd. Kernels without pidfd_open() fall back to SIGCHLD, taken by
+ * the first loop that needs it; func is then always called from that
+ * loop.
+ *
+ * @param loop misc_loop handle
+ * @param argv
+ * @param func called once with the waitpid() status,
+ * MISC_SPAWN_STATUS_UNKNOWN if SIGCHLD is ignored
+ * @param ctxArg
+ *
+ * @return pid, -1 on error, also when the child could not be waited
+ * for through the loop (it is killed then)
+ */
+int misc_spawnAsync(void *loop, char *const argv[], miscSpawnDoneFunc_t func,
+                    void *ctxArg);
+
+#endif
@@ -0,0 +1,430 @@
+/**
+ * @file   misc_sysmon.c
+ *
+ * @brief  Resource sampler on persistent /proc fds.
+ *
+ * The history ring is written by one sampler and read by anyone,
+ * possibly from another process through shared memory, so it holds no
+ * pointer. The ring seq is a misc_seqlock sequence counter: odd while a
+ * sample is written, readers copy the sample and retry if it moved.
+ */
+/* #define F_DEBUG */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "misc_proc.h"
+#include "misc_sysmon.h"
+#include "misc_seqlock.h"
+
+#ifdef F_DEBUG
+#define DPRINTF(fmt, args...) printf(fmt, ##args)
+#else
+#define DPRINTF(fmt, args...)
+#endif
+
+#define SYSMON_MAGIC        0x534d4f4e      /* "SMON" */
+#define SYSMON_VERSION      1
+#define SYSMON_HISTORY_DEF  60
+#define SYSMON_BUF_INIT     8192
+#define SYSMON_BUF_MAX      (1024 * 1024)
+
+typedef struct sysmonRing
+{
+    unsigned int          magic;
+    unsigned int          version;
+    unsigned int          sampleSize;   /**< sizeof(miscSysmonSample_t) */
+    unsigned int          slots;
+    volatile unsigned int seq;          /**< odd while writing */
+    volatile unsigned int count;        /**< samples written so far */
+    miscSysmonSample_t    samples[0];
+} sysmonRing_t;
+
+typedef struct sysmonPid
+{
+    int                pid;
+    int                fd;
+    int                alive;
+    unsigned long long ticks;           /**< utime + stime */
+    unsigned long      minflt;
+    unsigned long      majflt;
+} sysmonPid_t;
+
+typedef struct sysmonHandle
+{
+    int                statFd;
+    int                meminfoFd;
+    char              *buf;
+    int                bufSize;
+    long               pageKb;
+    unsigned long long prevMs;
+    miscProcSysStat_t  prev;
+    int                npids;
+    sysmonPid_t        pids[MISC_SYSMON_MAX_PIDS];
+    sysmonRing_t      *ring;
+    int                ownRing;
+} sysmonHandle_t;
+
+static unsigned long long sysmonNowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* read a whole /proc file, growing the buffer for big /proc/stat */
+static int sysmonRead(sysmonHandle_t *sh, int fd)
+{
+    char *buf;
+    int len;
+
+    for(;;)
+    {
+        if((len = misc_procReadFd(fd, sh->buf, sh->bufSize)) < 0)
+            return -1;
+        if(len < sh->bufSize - 1 || sh->bufSize >= SYSMON_BUF_MAX)
+            return len;
+
+        if((buf = realloc(sh->buf, sh->bufSize * 2)) == NULL)
+            return len;
+        sh->buf = buf;
+        sh->bufSize *= 2;
+    }
+}
+
+static unsigned long long sysmonTotal(const miscProcCpuTimes_t *ct)
+{
+    return ct->user + ct->nice + ct->system + ct->idle + ct->iowait +
+        ct->irq + ct->softirq + ct->steal;
+}
+
+static unsigned int sysmonPermille(unsigned long long part, unsigned long long total)
+{
+    return total != 0 ? (unsigned int)(part * 1000 / total) : 0;
+}
+
+static unsigned int sysmonBusy(const miscProcCpuTimes_t *cur,
+                               const miscProcCpuTimes_t *prev)
+{
+    unsigned long long total, idle;
+
+    total = sysmonTotal(cur) - sysmonTotal(prev);
+    idle = (cur->idle - prev->idle) + (cur->iowait - prev->iowait);
+
+    return total > idle ? sysmonPermille(total - idle, total) : 0;
+}
+
+static int sysmonSysStat(sysmonHandle_t *sh, miscProcSysStat_t *ss)
+{
+    if(sysmonRead(sh, sh->statFd) < 0)
+        return -1;
+
+    return misc_procParseSysStat(sh->buf, ss);
+}
+
+/* @return 0, -1 if the process is gone */
+static int sysmonPidStat(sysmonHandle_t *sh, sysmonPid_t *sp, miscProcStat_t *st)
+{
+    if(sp->fd < 0 || sysmonRead(sh, sp->fd) <= 0 ||
+       misc_procParseStat(sh->buf, st) != 0)
+        return -1;
+
+    return 0;
+}
+
+int misc_sysmonRingSize(int history)
+{
+    if(history <= 0)
+        history = SYSMON_HISTORY_DEF;
+
+    return sizeof(sysmonRing_t) + history * sizeof(miscSysmonSample_t);
+}
+
+int misc_sysmonInit(void **handle, int history, void *mem, int memSize)
+{
+    sysmonHandle_t *sh;
+
+    if(history <= 0)
+        history = SYSMON_HISTORY_DEF;
+
+    if(mem != NULL && memSize < misc_sysmonRingSize(history))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((sh = calloc(1, sizeof(sysmonHandle_t))) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    sh->statFd = sh->meminfoFd = -1;
+    sh->bufSize = SYSMON_BUF_INIT;
+    sh->pageKb = sysconf(_SC_PAGESIZE) / 1024;
+
+    if((sh->buf = malloc(sh->bufSize)) == NULL)
+    {
+        perror("malloc");
+        goto error;
+    }
+
+    if(mem == NULL)
+    {
+        if((mem = calloc(1, misc_sysmonRingSize(history))) == NULL)
+        {
+            perror("malloc");
+            goto error;
+        }
+        sh->ownRing = 1;
+    }
+    sh->ring = mem;
+    memset(sh->ring, 0, sizeof(sysmonRing_t));
+    sh->ring->version = SYSMON_VERSION;
+    sh->ring->sampleSize = sizeof(miscSysmonSample_t);
+    sh->ring->slots = history;
+    __sync_synchronize();
+    sh->ring->magic = SYSMON_MAGIC;
+
+    if((sh->statFd = open("/proc/stat", O_RDONLY | O_CLOEXEC)) < 0 ||
+       (sh->meminfoFd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        perror("open");
+        goto error;
+    }
+
+    /* the first sample gets its rates from here */
+    if(sysmonSysStat(sh, &sh->prev) != 0)
+        goto error;
+    sh->prevMs = sysmonNowMs();
+
+    *handle = sh;
+
+    return 0;
+
+error:
+    *handle = sh;
+    misc_sysmonCleanup(handle);
+
+    return -1;
+}
+
+void misc_sysmonCleanup(void **handle)
+{
+    sysmonHandle_t *sh = *handle;
+    int i;
+
+    if(sh == NULL)
+        return;
+
+    for(i = 0; i < sh->npids; i++)
+    {
+        if(sh->pids[i].fd >= 0)
+            close(sh->pids[i].fd);
+    }
+    if(sh->statFd >= 0)
+        close(sh->statFd);
+    if(sh->meminfoFd >= 0)
+        close(sh->meminfoFd);
+    if(sh->ownRing)
+        free(sh->ring);
+    free(sh->buf);
+    free(sh);
+
+    *handle = NULL;
+}
+
+int misc_sysmonWatch(void *handle, int pid)
+{
+    sysmonHandle_t *sh = handle;
+    sysmonPid_t *sp;
+    miscProcStat_t st;
+    char path[64];
+    int i;
+
+    for(i = 0; i < sh->npids; i++)
+    {
+        if(sh->pids[i].pid == pid)
+            return 0;
+    }
+    if(sh->npids >= MISC_SYSMON_MAX_PIDS)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    sp = &sh->pids[sh->npids];
+    memset(sp, 0, sizeof(*sp));
+    sp->pid = pid;
+    if(misc_procPath(path, sizeof(path), pid, "stat") == NULL ||
+       (sp->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    if(sysmonPidStat(sh, sp, &st) != 0)
+    {
+        close(sp->fd);
+        return -1;
+    }
+    sp->alive = 1;
+    sp->ticks = (unsigned long long)st.utime + st.stime;
+    sp->minflt = st.minflt;
+    sp->majflt = st.majflt;
+    sh->npids++;
+
+    return 0;
+}
+
+int misc_sysmonUnwatch(void *handle, int pid)
+{
+    sysmonHandle_t *sh = handle;
+    int i;
+
+    for(i = 0; i < sh->npids; i++)
+    {
+        if(sh->pids[i].pid == pid)
+        {
+            if(sh->pids[i].fd >= 0)
+                close(sh->pids[i].fd);
+            sh->pids[i] = sh->pids[--sh->npids];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void sysmonPublish(sysmonRing_t *ring, const miscSysmonSample_t *sample)
+{
+    misc_seqWriteBegin(&ring->seq);
+
+    memcpy(&ring->samples[ring->count % ring->slots], sample, sizeof(*sample));
+    ring->count++;
+
+    misc_seqWriteEnd(&ring->seq);
+}
+
+int misc_sysmonSample(void *handle, miscSysmonSample_t *out)
+{
+    sysmonHandle_t *sh = handle;
+    miscSysmonSample_t sample;
+    miscSysmonProc_t *proc;
+    miscProcSysStat_t cur;
+    miscProcStat_t st;
+    sysmonPid_t *sp;
+    unsigned long long now, total, ticks;
+    unsigned int ms;
+    int i, ncpu;
+
+    if(sysmonSysStat(sh, &cur) != 0)
+        return -1;
+    now = sysmonNowMs();
+
+    memset(&sample, 0, sizeof(sample));
+    sample.timeMs = now;
+    sample.intervalMs = ms = now - sh->prevMs;
+    sample.ncpu = ncpu = cur.ncpu > 0 ? cur.ncpu : 1;
+
+    total = sysmonTotal(&cur.total) - sysmonTotal(&sh->prev.total);
+    sample.cpuBusy = sysmonBusy(&cur.total, &sh->prev.total);
+    sample.cpuUser = sysmonPermille((cur.total.user - sh->prev.total.user) +
+                                    (cur.total.nice - sh->prev.total.nice),
+                                    total);
+    sample.cpuSystem = sysmonPermille((cur.total.system - sh->prev.total.system) +
+                                      (cur.total.irq - sh->prev.total.irq) +
+                                      (cur.total.softirq - sh->prev.total.softirq),
+                                      total);
+    sample.cpuIowait = sysmonPermille(cur.total.iowait - sh->prev.total.iowait,
+                                      total);
+    for(i = 0; i < ncpu && i < MISC_PROC_MAX_CPUS; i++)
+        sample.cpuPerCore[i] = sysmonBusy(&cur.cpu[i], &sh->prev.cpu[i]);
+
+    if(ms > 0)
+    {
+        sample.ctxtPerSec = (cur.ctxt - sh->prev.ctxt) * 1000 / ms;
+        sample.intrPerSec = (cur.intr - sh->prev.intr) * 1000 / ms;
+        sample.forksPerSec = (cur.processes - sh->prev.processes) * 1000 / ms;
+    }
+    sample.procsRunning = cur.procsRunning;
+    sample.procsBlocked = cur.procsBlocked;
+
+    if(sysmonRead(sh, sh->meminfoFd) > 0)
+        misc_procParseMeminfo(sh->buf, &sample.mem);
+
+    for(i = 0; i < sh->npids; i++)
+    {
+        sp = &sh->pids[i];
+        proc = &sample.procs[sample.nprocs++];
+        proc->pid = sp->pid;
+
+        if(!sp->alive || sysmonPidStat(sh, sp, &st) != 0)
+        {
+            /* keep reporting it, the caller decides to unwatch */
+            sp->alive = 0;
+            continue;
+        }
+
+        memcpy(proc->comm, st.comm, sizeof(proc->comm));
+        proc->alive = 1;
+        proc->state = st.state;
+        proc->threads = st.numThreads;
+        proc->vsizeKb = st.vsize / 1024;
+        proc->rssKb = st.rss * sh->pageKb;
+
+        /* share of one cpu: ticks over the cpu ticks of one core */
+        ticks = (unsigned long long)st.utime + st.stime;
+        proc->cpu = sysmonPermille((ticks - sp->ticks) * ncpu, total);
+        proc->minflt = st.minflt - sp->minflt;
+        proc->majflt = st.majflt - sp->majflt;
+
+        sp->ticks = ticks;
+        sp->minflt = st.minflt;
+        sp->majflt = st.majflt;
+    }
+
+    sh->prev = cur;
+    sh->prevMs = now;
+
+    sysmonPublish(sh->ring, &sample);
+
+    DPRINTF("sysmon: cpu %u%% mem free %lu kB\n",
+            sample.cpuBusy / 10, sample.mem.memFree);
+
+    if(out != NULL)
+        *out = sample;
+
+    return 0;
+}
+
+void *misc_sysmonRing(void *handle)
+{
+    return ((sysmonHandle_t *)handle)->ring;
+}
+
+int misc_sysmonRead(const void *ringArg, int back, miscSysmonSample_t *out)
+{
+    const sysmonRing_t *ring = ringArg;
+    unsigned int seq, count;
+
+    if(ring->magic != SYSMON_MAGIC || ring->version != SYSMON_VERSION ||
+       ring->sampleSize != sizeof(miscSysmonSample_t) || back < 0)
+        return -1;
+
+    do
+    {
+        seq = misc_seqReadBegin(&ring->seq);
+
+        count = ring->count;
+        if((unsigned int)back >= count || (unsigned int)back >= ring->slots)
+            return -1;
+
+        memcpy(out, &ring->samples[(count - 1 - back) % ring->slots],
+               sizeof(*out));
+    } while(misc_seqReadRetry(&ring->seq, seq));
+
+    return 0;
+}
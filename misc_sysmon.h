@@ -0,0 +1,114 @@
+#ifndef _MISC_SYSMON_H_
+#define _MISC_SYSMON_H_
+
+#include "misc_proc.h"
+
+/**
+ * System and per process resource sampler, the replacement of polling
+ * ps and top. /proc/stat, /proc/meminfo and the /proc/<pid>/stat of
+ * the watched processes stay open and are pread() on every sample,
+ * rates are computed from the previous sample.
+ *
+ * Samples are kept in a fixed size history ring, which may be put in
+ * shared memory so that other processes read it without asking:
+ *
+ *     size = misc_sysmonRingSize(60);
+ *     oil_shmInit(size, &shmId, &mem);
+ *     misc_sysmonInit(&mon, 60, mem, size);
+ *     misc_periodicRun(1000000, sample, mon);
+ *
+ *     reader: misc_sysmonRead(mem, 0, &last);
+ */
+
+#define MISC_SYSMON_MAX_PIDS  16
+
+/** Rates are in per mille over the sampling interval */
+typedef struct miscSysmonProc
+{
+    int                pid;
+    char               comm[MISC_PROC_COMM_LEN];
+    int                alive;       /**< 0 once the process is gone */
+    char               state;
+    unsigned int       cpu;         /**< per mille of one cpu */
+    int                threads;
+    unsigned long      vsizeKb;
+    unsigned long      rssKb;
+    unsigned long      minflt;      /**< faults during the interval */
+    unsigned long      majflt;
+} miscSysmonProc_t;
+
+typedef struct miscSysmonSample
+{
+    unsigned long long timeMs;      /**< CLOCK_MONOTONIC */
+    unsigned int       intervalMs;  /**< since the previous sample */
+    int                ncpu;
+    unsigned int       cpuBusy;     /**< per mille of all cpus */
+    unsigned int       cpuUser;     /**< user + nice */
+    unsigned int       cpuSystem;   /**< system + irq + softirq */
+    unsigned int       cpuIowait;
+    unsigned int       cpuPerCore[MISC_PROC_MAX_CPUS];  /**< busy */
+    unsigned long      ctxtPerSec;
+    unsigned long      intrPerSec;
+    unsigned long      forksPerSec;
+    unsigned long      procsRunning;
+    unsigned long      procsBlocked;
+    miscProcMeminfo_t  mem;
+    int                nprocs;
+    miscSysmonProc_t   procs[MISC_SYSMON_MAX_PIDS];
+} miscSysmonSample_t;
+
+/**
+ * @return bytes needed for a ring of history samples
+ */
+int misc_sysmonRingSize(int history);
+
+/**
+ * @param handle
+ * @param history samples kept, 0 for 60
+ * @param mem where to put the ring, e.g. shared memory, NULL to
+ * allocate it
+ * @param memSize at least misc_sysmonRingSize(history)
+ *
+ * @return 0 on success, -1 on error
+ */
+int misc_sysmonInit(void **handle, int history, void *mem, int memSize);
+
+void misc_sysmonCleanup(void **handle);
+
+/**
+ * Watch a process, from the next sample on.
+ *
+ * @return 0 on success, -1 if it does not exist or too many are watched
+ */
+int misc_sysmonWatch(void *handle, int pid);
+
+int misc_sysmonUnwatch(void *handle, int pid);
+
+/**
+ * Take a sample and add it to the ring.
+ *
+ * @param handle
+ * @param out NULL or a copy of the sample
+ *
+ * @return 0 on success, -1 on error
+ */
+int misc_sysmonSample(void *handle, miscSysmonSample_t *out);
+
+/**
+ * The ring, to share its address or to pass to misc_sysmonRead().
+ */
+void *misc_sysmonRing(void *handle);
+
+/**
+ * Read a sample from a ring, possibly while another process writes it.
+ *
+ * @param ring misc_sysmonRing() or the shared memory it lives in
+ * @param back 0 for the latest sample, 1 for the one before ...
+ * @param out
+ *
+ * @return 0 on success, -1 if there is no such sample or ring is not
+ * a sysmon ring
+ */
+int misc_sysmonRead(const void *ring, int back, miscSysmonSample_t *out);
+
+#endif
@@ -1,11 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <time.h>
 
 #include "misc_timer.h"
 
-#define PRINTF printf
+static int timer_debug = 0;
+
+#define PRINTF(fmt, args...) do { if(timer_debug) printf(fmt, ##args); } while(0)
+
+#define USECS_IN_SEC 1000000
+#define USECS_IN_MSEC 1000
 
 /** This macro will evaluate TRUE if a is earlier than b */
 #define IS_EARLIER_THAN(a, b) (((a)->tv_sec < (b)->tv_sec) ||   \
@@ -21,14 +28,19 @@ typedef struct timer_event
                                     *   timer event will expire. */
     event_func          func;   /**< handler func to call when event expires. */
     void               *ctx_data; /**< context data to pass to func */
+    int                 stats_idx; /**< slot in the stats table, or -1 */
     char                name[EVENT_TIMER_NAME_LENGTH]; /**< name of this timer */
 } timer_event_t;
 
 /** Internal timer handle. */
 typedef struct timer_handle
 {
-   timer_event_t *events;       /**< Singly linked list of events */
+   timer_event_t *events[TIMER_NUM_PRIOS]; /**< Sorted list of events per priority */
    int            number;       /**< Number of events in this handle. */
+   int            max_events;   /**< Callbacks per execute call, 0 is unlimited */
+   int            max_usec;     /**< Time per execute call, 0 is unlimited */
+   int            nstats;       /**< Used entries in stats */
+   timer_stats_t  stats[TIMER_STATS_MAX_ENTRIES]; /**< Per name statistics */
 } timer_handle_t;
 
 static int timer_get_tv(struct timeval *tv)
@@ -40,6 +52,69 @@ static int timer_get_tv(struct timeval *tv)
     return n;
 }
 
+static long timer_diff_usec(const struct timeval *a, const struct timeval *b)
+{
+    return (a->tv_sec - b->tv_sec) * USECS_IN_SEC + (a->tv_usec - b->tv_usec);
+}
+
+/** 
+ * Find the stats slot of a timer name, allocate one on first use.
+ * Done when adding, so firing a timer never has to search or allocate.
+ * 
+ * @return slot index, or -1 if the table is full
+ */
+static int timer_stats_slot(timer_handle_t *th, const char *name)
+{
+    int i;
+
+    for(i = 0; i < th->nstats; i++)
+    {
+        if(strncmp(th->stats[i].name, name, EVENT_TIMER_NAME_LENGTH) == 0)
+            return i;
+    }
+
+    if(th->nstats == TIMER_STATS_MAX_ENTRIES)
+        return -1;
+
+    snprintf(th->stats[i].name, sizeof(th->stats[i].name), "%s", name);
+    th->nstats++;
+
+    return i;
+}
+
+static void timer_stats_update(timer_stats_t *st, long late, long cb)
+{
+    int i;
+
+    if(late < 0)
+        late = 0;
+    if(cb < 0)
+        cb = 0;
+
+    for(i = 0; i < TIMER_STATS_HIST_BUCKETS - 1 && (1L << i) <= late; i++)
+        ;
+    st->lateness[i]++;
+
+    st->fire_count++;
+    st->total_cb_usec += cb;
+    if((unsigned long)cb > st->max_cb_usec)
+        st->max_cb_usec = cb;
+    if((unsigned long)late > st->max_late_usec)
+        st->max_late_usec = late;
+}
+
+static void timer_add_usec(struct timeval *tv, int usec)
+{
+    tv->tv_sec += usec / USECS_IN_SEC;
+    tv->tv_usec += usec % USECS_IN_SEC;
+
+    if(tv->tv_usec >= USECS_IN_SEC)
+    {
+        tv->tv_sec++;
+        tv->tv_usec -= USECS_IN_SEC;
+    }
+}
+
 static void timer_add_msec(struct timeval *tv, int ms)
 {
     int sec, msec;
@@ -50,6 +125,12 @@ static void timer_add_msec(struct timeval *tv, int ms)
     tv->tv_sec += sec;
     tv->tv_usec += msec;
 
+    if(tv->tv_usec >= USECS_IN_SEC)
+    {
+        tv->tv_sec++;
+        tv->tv_usec -= USECS_IN_SEC;
+    }
+
     return;
 }
 
@@ -69,11 +150,15 @@ void timer_cleanup(void **handle)
 {
     timer_handle_t *th = (timer_handle_t *)(*handle);
     timer_event_t *event;
+    int prio;
 
-    while((event = th->events) != NULL)
+    for(prio = 0; prio < TIMER_NUM_PRIOS; prio++)
     {
-        th->events = event->next;
-        free(event);
+        while((event = th->events[prio]) != NULL)
+        {
+            th->events[prio] = event->next;
+            free(event);
+        }
     }
 
     free(*handle);
@@ -84,15 +169,19 @@ void timer_cleanup(void **handle)
 static int timer_is_event_present(void *handle, event_func func, void *ctx_data)
 {
     const timer_handle_t *th = (const timer_handle_t *)handle;
-    timer_event_t *event;
-    
-    event = th->events;
+    timer_event_t *event = NULL;
+    int prio;
 
-    while(event != NULL)
+    for(prio = 0; prio < TIMER_NUM_PRIOS && event == NULL; prio++)
     {
-        if(event->func == func && event->ctx_data == ctx_data)
-            break;
-        event = event->next;
+        event = th->events[prio];
+
+        while(event != NULL)
+        {
+            if(event->func == func && event->ctx_data == ctx_data)
+                break;
+            event = event->next;
+        }
     }
 
     return (event != NULL);
@@ -100,14 +189,27 @@ static int timer_is_event_present(void *handle, event_func func, void *ctx_data)
 
 int timer_event_add(void *handle, event_func func, void *ctx_data,
                     int ms, const char *name)
+{
+    return timer_event_add_prio(handle, func, ctx_data, ms, name,
+                                TIMER_PRIO_NORMAL);
+}
+
+int timer_event_add_prio(void *handle, event_func func, void *ctx_data,
+                         int ms, const char *name, int prio)
 {
     timer_handle_t *th = (timer_handle_t *)handle;
     timer_event_t *curr, *prev, *new;
 
+    if(prio < 0 || prio >= TIMER_NUM_PRIOS)
+    {
+        PRINTF("invalid priority %d for event %s\n", prio, name);
+        return -1;
+    }
+
     if(timer_is_event_present(handle, func, ctx_data))
     {
-        printf("There is already an event func 0x%x, ctx_data 0x%x\n",
-               func, ctx_data);
+        PRINTF("There is already an event func %p, ctx_data %p\n",
+               (void *)func, ctx_data);
         return -1;
     }
 
@@ -118,8 +220,10 @@ int timer_event_add(void *handle, event_func func, void *ctx_data,
         return -1;
     }
 
+    new->next = NULL;
     new->func = func;
     new->ctx_data = ctx_data;
+    new->name[0] = '\0';
     
     timer_get_tv(&new->expire);
     timer_add_msec(&new->expire, ms);
@@ -128,43 +232,37 @@ int timer_event_add(void *handle, event_func func, void *ctx_data,
     {
         snprintf(new->name, sizeof(new->name), "%s", name);
     }
+    new->stats_idx = timer_stats_slot(th, new->name);
 
-    if(th->number == 0)
+    curr = th->events[prio];
+
+    if((curr == NULL) || IS_EARLIER_THAN(&new->expire, &curr->expire))
     {
-        th->events = new;
+        new->next = curr;
+        th->events[prio] = new;
     }
     else
     {
-        curr = th->events;
-        
-        if(IS_EARLIER_THAN(&new->expire, &curr->expire))
-        {
-            new->next = curr;
-            th->events = new;
-        }
-        else
+        while(1)
         {
-            while(1)
-            {
-                prev = curr;
-                curr = curr->next;
+            prev = curr;
+            curr = curr->next;
 
-                if((curr == NULL) ||
-                   (IS_EARLIER_THAN(&new->expire, &curr->expire)))
-                {
-                    new->next = prev->next;
-                    prev->next = new;
-                    break;
-                }
+            if((curr == NULL) ||
+               (IS_EARLIER_THAN(&new->expire, &curr->expire)))
+            {
+                new->next = prev->next;
+                prev->next = new;
+                break;
             }
         }
     }
 
     th->number++;
 
-    PRINTF("added event %s, expires in %ums(at %u.%03u), func = 0x%x, ctx_data = 0x%x\n",
-           new->name, ms, new->expire.tv_sec, new->expire.tv_usec,
-           func, ctx_data);
+    PRINTF("added event %s, prio %d, expires in %ums(at %ld.%03ld), func = %p, ctx_data = %p\n",
+           new->name, prio, ms, (long)new->expire.tv_sec, (long)new->expire.tv_usec,
+           (void *)func, ctx_data);
 
     return 0;
 }
@@ -172,33 +270,40 @@ int timer_event_add(void *handle, event_func func, void *ctx_data,
 int timer_event_delete(void *handle, event_func func, void *ctx_data)
 {
     timer_handle_t *th = (timer_handle_t *)handle;
-    timer_event_t *curr, *prev;
+    timer_event_t *curr = NULL, *prev;
+    int prio;
 
-    if((curr = th->events) == NULL)
+    if(th->number == 0)
     {
-        PRINTF("no events to delete (func=0x%x data=%p)\n", func, ctx_data);
+        PRINTF("no events to delete (func=%p data=%p)\n", (void *)func, ctx_data);
         return -1;
     }
 
-    if(curr->func == func && curr->ctx_data == ctx_data)
-    {
-        th->events = curr->next;
-        curr->next = NULL;        
-    }
-    else
+    for(prio = 0; prio < TIMER_NUM_PRIOS && curr == NULL; prio++)
     {
-        while(curr != NULL)
-        {
-            prev = curr;
-            curr = curr->next;
+        if((curr = th->events[prio]) == NULL)
+            continue;
 
-            if(curr != NULL &&
-               curr->func == func &&
-               curr->ctx_data == ctx_data)
+        if(curr->func == func && curr->ctx_data == ctx_data)
+        {
+            th->events[prio] = curr->next;
+            curr->next = NULL;        
+        }
+        else
+        {
+            while(curr != NULL)
             {
-                prev->next = curr->next;
-                curr->next = NULL;
-                break;
+                prev = curr;
+                curr = curr->next;
+
+                if(curr != NULL &&
+                   curr->func == func &&
+                   curr->ctx_data == ctx_data)
+                {
+                    prev->next = curr->next;
+                    curr->next = NULL;
+                    break;
+                }
             }
         }
     }
@@ -212,37 +317,193 @@ int timer_event_delete(void *handle, event_func func, void *ctx_data)
     }
     else
     {
-        PRINTF("could not find requested event to delete, func=0x%x ctx_data=%p count=%d\n",
-               func, ctx_data, th->number);        
+        PRINTF("could not find requested event to delete, func=%p ctx_data=%p count=%d\n",
+               (void *)func, ctx_data, th->number);        
     }
 
     return 0;
 }
 
+/** 
+ * Get the list holding the most urgent expired event, higher
+ * priorities first.
+ * 
+ * @return the list head, or NULL if nothing is expired at tv
+ */
+static timer_event_t **timer_expired_list(timer_handle_t *th,
+                                          const struct timeval *tv)
+{
+    int prio;
+
+    for(prio = 0; prio < TIMER_NUM_PRIOS; prio++)
+    {
+        if(th->events[prio] != NULL &&
+           IS_EARLIER_THAN(&th->events[prio]->expire, tv))
+            return &th->events[prio];
+    }
+
+    return NULL;
+}
+
 void timer_execute_expire_events(void *handle)
 {
     timer_handle_t *th = (timer_handle_t *)handle;
-    timer_event_t *curr;
-    struct timeval tv;
+    timer_event_t *curr, **list;
+    struct timeval tv, start, end, deadline;
+    int executed = 0;
 
     timer_get_tv(&tv);
-    curr = th->events;
-    
-    while((curr != NULL) && IS_EARLIER_THAN(&curr->expire, &tv))
+    deadline = tv;
+    timer_add_usec(&deadline, th->max_usec);
+
+    while((list = timer_expired_list(th, &tv)) != NULL)
     {
-        th->events = curr->next;
+        /* leave the rest for the next call once the budget is used up */
+        if(th->max_events > 0 && executed >= th->max_events)
+            break;
+        if(th->max_usec > 0 && executed > 0 && !IS_EARLIER_THAN(&end, &deadline))
+            break;
+
+        curr = *list;
+        *list = curr->next;
         curr->next = NULL;
         th->number--;
         
-        PRINTF("executing timer event %s func 0x%x ctx_data 0x%x\n",
-               curr->name, curr->func, curr->ctx_data);
-        
+        PRINTF("executing timer event %s func %p ctx_data %p\n",
+               curr->name, (void *)curr->func, curr->ctx_data);
+
+        timer_get_tv(&start);
         (curr->func)(curr->ctx_data);
+        timer_get_tv(&end);
+        executed++;
+
+        if(curr->stats_idx >= 0)
+        {
+            timer_stats_update(&th->stats[curr->stats_idx],
+                               timer_diff_usec(&start, &curr->expire),
+                               timer_diff_usec(&end, &start));
+        }
    
         free(curr);
-        
-        curr = th->events;
     }
 
     return;
 }
+
+int timer_nextExpireMs(void *handle)
+{
+    timer_handle_t *th = (timer_handle_t *)handle;
+    struct timeval tv, *next = NULL;
+    long usec;
+    int prio;
+
+    for(prio = 0; prio < TIMER_NUM_PRIOS; prio++)
+    {
+        if(th->events[prio] != NULL &&
+           (next == NULL || IS_EARLIER_THAN(&th->events[prio]->expire, next)))
+            next = &th->events[prio]->expire;
+    }
+
+    if(next == NULL)
+        return -1;
+
+    timer_get_tv(&tv);
+    usec = timer_diff_usec(next, &tv);
+    if(usec < 0)
+        return 0;
+
+    /* round up, waking up early would just spin */
+    return (int)((usec + USECS_IN_MSEC - 1) / USECS_IN_MSEC);
+}
+
+void timer_setBudget(void *handle, int max_events, int max_usec)
+{
+    timer_handle_t *th = (timer_handle_t *)handle;
+
+    th->max_events = (max_events > 0) ? max_events : 0;
+    th->max_usec = (max_usec > 0) ? max_usec : 0;
+}
+
+int timer_hasExpired(void *handle)
+{
+    timer_handle_t *th = (timer_handle_t *)handle;
+    struct timeval tv;
+
+    timer_get_tv(&tv);
+
+    return (timer_expired_list(th, &tv) != NULL);
+}
+
+void timer_setDebug(int on)
+{
+    timer_debug = on;
+}
+
+int timer_getStats(void *handle, timer_stats_t *stats, int max)
+{
+    const timer_handle_t *th = (const timer_handle_t *)handle;
+    int n;
+
+    n = (th->nstats < max) ? th->nstats : max;
+    memcpy(stats, th->stats, n * sizeof(timer_stats_t));
+
+    return n;
+}
+
+void timer_dumpStats(void *handle, int fd)
+{
+    const timer_handle_t *th = (const timer_handle_t *)handle;
+    const timer_stats_t *st;
+    char buf[512];
+    int i, j, len;
+
+    len = snprintf(buf, sizeof(buf), "%-16s %10s %12s %10s %10s %10s\n",
+                   "name", "fired", "cb_total_us", "cb_avg_us",
+                   "cb_max_us", "late_max_us");
+    write(fd, buf, len);
+
+    for(i = 0; i < th->nstats; i++)
+    {
+        st = &th->stats[i];
+
+        len = snprintf(buf, sizeof(buf), "%-16s %10lu %12llu %10llu %10lu %10lu\n",
+                       st->name[0] ? st->name : "-", st->fire_count,
+                       st->total_cb_usec,
+                       st->fire_count ? st->total_cb_usec / st->fire_count : 0ULL,
+                       st->max_cb_usec, st->max_late_usec);
+
+        if(st->fire_count)
+        {
+            len += snprintf(buf + len, sizeof(buf) - len, "  lateness");
+            for(j = 0; j < TIMER_STATS_HIST_BUCKETS && len < (int)sizeof(buf); j++)
+            {
+                if(st->lateness[j] == 0)
+                    continue;
+                if(j == TIMER_STATS_HIST_BUCKETS - 1)
+                    len += snprintf(buf + len, sizeof(buf) - len, " >=%luus:%lu",
+                                    1UL << (j - 1), st->lateness[j]);
+                else
+                    len += snprintf(buf + len, sizeof(buf) - len, " <%luus:%lu",
+                                    1UL << j, st->lateness[j]);
+            }
+            if(len < (int)sizeof(buf))
+                len += snprintf(buf + len, sizeof(buf) - len, "\n");
+        }
+
+        if(len >= (int)sizeof(buf))
+            len = sizeof(buf) - 1;
+        write(fd, buf, len);
+    }
+}
+
+void timer_resetStats(void *handle)
+{
+    timer_handle_t *th = (timer_handle_t *)handle;
+    int i;
+
+    for(i = 0; i < th->nstats; i++)
+    {
+        memset((char *)&th->stats[i] + EVENT_TIMER_NAME_LENGTH, 0,
+               sizeof(timer_stats_t) - EVENT_TIMER_NAME_LENGTH);
+    }
+}
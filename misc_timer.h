@@ -7,17 +7,125 @@
 
 #define TIMER_FLAG_LOOP (1<<0)
 
+/** Timer priority classes, expired events of a higher class (lower
+ *  value) always run before those of a lower class. */
+#define TIMER_PRIO_HIGH    0
+#define TIMER_PRIO_NORMAL  1
+#define TIMER_PRIO_LOW     2
+#define TIMER_NUM_PRIOS    3
+
+/** Max number of distinct timer names tracked per handle */
+#define TIMER_STATS_MAX_ENTRIES  32
+
+/** Lateness histogram, bucket i counts lateness below 2^i usec, the
+ *  last bucket counts everything beyond. */
+#define TIMER_STATS_HIST_BUCKETS 20
+
+/** Runtime statistics of all timers sharing one name. */
+typedef struct timer_stats
+{
+    char               name[EVENT_TIMER_NAME_LENGTH];
+    unsigned long      fire_count;
+    unsigned long long total_cb_usec;  /**< cumulative callback time */
+    unsigned long      max_cb_usec;    /**< longest callback */
+    unsigned long      max_late_usec;  /**< worst expiry lateness */
+    unsigned long      lateness[TIMER_STATS_HIST_BUCKETS];
+} timer_stats_t;
+
 typedef void (*event_func)(void*);
 
 int timer_init(void **timer_handle);
 
 void timer_cleanup(void **handle);
 
+/** 
+ * Add an event with TIMER_PRIO_NORMAL priority.
+ */
 int timer_event_add(void *handle, event_func func, void *ctx_data,
                     int ms, const char *name);
 
+/** 
+ * Add an event in one of the TIMER_PRIO_XXX classes.
+ * 
+ * @param handle 
+ * @param func 
+ * @param ctx_data 
+ * @param ms expire in ms from now
+ * @param name 
+ * @param prio TIMER_PRIO_HIGH, TIMER_PRIO_NORMAL or TIMER_PRIO_LOW
+ * 
+ * @return 0 on success, -1 on error
+ */
+int timer_event_add_prio(void *handle, event_func func, void *ctx_data,
+                         int ms, const char *name, int prio);
+
 int timer_event_delete(void *handle, event_func func, void *ctx_data);
 
+/** 
+ * Run the expired events, highest priority first and earliest
+ * deadline first within a priority. If a budget is set with
+ * timer_setBudget(), the call returns once it is used up and the
+ * remaining expired events run on the next call.
+ * 
+ * @param handle 
+ */
 void timer_execute_expire_events(void *handle);
 
+/** 
+ * Bound the work done by one timer_execute_expire_events() call, so
+ * that an event loop keeps a predictable latency after a stall.
+ * 
+ * @param handle 
+ * @param max_events max callbacks per call, 0 for unlimited
+ * @param max_usec stop starting callbacks after this time, 0 for unlimited
+ */
+void timer_setBudget(void *handle, int max_events, int max_usec);
+
+/** 
+ * @return 1 if expired events are pending, e.g. left over by a
+ *         budgeted timer_execute_expire_events() call, 0 otherwise.
+ */
+int timer_hasExpired(void *handle);
+
+/** 
+ * Get the time until the next event expires, used by event loops to
+ * compute their poll timeout.
+ * 
+ * @param handle 
+ * 
+ * @return ms until the earliest event, 0 if one is already expired,
+ *         -1 if there are no events
+ */
+int timer_nextExpireMs(void *handle);
+
+/** 
+ * Turn the debug messages of all timer handles on or off, they are
+ * off by default.
+ * 
+ * @param on 
+ */
+void timer_setDebug(int on);
+
+/** 
+ * Copy the statistics of a handle, e.g. into a shared memory region
+ * for an external monitor.
+ * 
+ * @param handle 
+ * @param stats array to fill
+ * @param max number of entries in stats
+ * 
+ * @return number of entries copied
+ */
+int timer_getStats(void *handle, timer_stats_t *stats, int max);
+
+/** 
+ * Write the statistics of a handle as text to fd.
+ * 
+ * @param handle 
+ * @param fd 
+ */
+void timer_dumpStats(void *handle, int fd);
+
+void timer_resetStats(void *handle);
+
 #endif
@@ -23,12 +23,14 @@
 #endif
 
 /** This macro will evaluate TRUE if a is earlier than b */
-#define IS_LE_TIMEVAL(a, b) (((a)->tv_sec <= (b)->tv_sec) ||    \
+#define IS_LE_TIMEVAL(a, b) (((a)->tv_sec < (b)->tv_sec) ||     \
                              (((a)->tv_sec == (b)->tv_sec) &&   \
                               ((a)->tv_usec <= (b)->tv_usec)))
 
 #define IS_ZERO_TIMEVAL(a) (((a)->tv_sec == 0)&&((a)->tv_usec == 0))
 
+#define USECS_IN_SEC 1000000
+
 typedef struct timerEvent {
     struct timerEvent *next;
     int                interval; /**< millon second */
@@ -44,6 +46,7 @@ typedef struct timerHandle
 {
    timerEvent_t  *events;       /**< Singly linked list of events */
    int            number;       /**< Number of events in this handle. */
+   int            executing;    /**< Set while expired events are running */
 } timerHandle_t;
 
 static int getTimeval(struct timeval *tv)
@@ -66,6 +69,12 @@ static struct timeval tvAdd(struct timeval *tv, int ms)
     tvRet.tv_sec  = tv->tv_sec + sec;
     tvRet.tv_usec = tv->tv_usec + msec;
 
+    if(tvRet.tv_usec >= USECS_IN_SEC)
+    {
+        tvRet.tv_sec++;
+        tvRet.tv_usec -= USECS_IN_SEC;
+    }
+
     return tvRet;
 }
 
@@ -79,6 +88,12 @@ static void addMillionSec(struct timeval *tv, int ms)
     tv->tv_sec += sec;
     tv->tv_usec += msec;
 
+    if(tv->tv_usec >= USECS_IN_SEC)
+    {
+        tv->tv_sec++;
+        tv->tv_usec -= USECS_IN_SEC;
+    }
+
     return;
 }
 
@@ -131,7 +146,7 @@ int mTimer_add(void *handle, eventFunc_t func, void *ctxArg,
                int interval, int count, const char *name)
 {
     timerHandle_t *th = (timerHandle_t *)handle;
-    timerEvent_t *curr, *prev, *new;
+    timerEvent_t *new;
 
     if(isEventPresent(handle, func, ctxArg))
     {
@@ -149,6 +164,7 @@ int mTimer_add(void *handle, eventFunc_t func, void *ctxArg,
 
     new->func = func;
     new->ctxArg = ctxArg;
+    new->name[0] = '\0';
     new->interval = interval;
     new->count = count;
     getTimeval(&new->lastTime);
@@ -160,17 +176,9 @@ int mTimer_add(void *handle, eventFunc_t func, void *ctxArg,
         snprintf(new->name, sizeof(new->name), "%s", name);
     }
 
-    if(th->number == 0)
-    {
-        th->events = new;
-    }
-    else
-    {
-        curr = th->events;
-        
-        new->next = curr;
-        th->events = new;
-    }
+    /* dead events may still be linked, so always push to the head */
+    new->next = th->events;
+    th->events = new;
 
     th->number++;
 
@@ -192,6 +200,30 @@ int mTimer_delete(void *handle, eventFunc_t func, void *ctxArg)
         return -1;
     }
 
+    if(th->executing)
+    {
+        /*
+         * Called from a timer callback, unlinking now would break the
+         * walk in mTimer_executeExpireEvents(). Just mark the event
+         * dead, it is freed once the walk finished.
+         */
+        while(curr != NULL)
+        {
+            if(curr->func == func && curr->ctxArg == ctxArg)
+            {
+                curr->func = NULL;
+                th->number--;
+                DPRINTF("canceled event %s, count=%d\n", curr->name, th->number);
+                return 0;
+            }
+            curr = curr->next;
+        }
+
+        DPRINTF("could not find requested event to delete, func=0x%x ctxArg=%p count=%d\n",
+               func, ctxArg, th->number);
+        return 0;
+    }
+
     if(curr->func == func && curr->ctxArg == ctxArg)
     {
         th->events = curr->next;
@@ -231,21 +263,50 @@ int mTimer_delete(void *handle, eventFunc_t func, void *ctxArg)
     return 0;
 }
 
+/** 
+ * Free the events marked dead while the callbacks were running.
+ * 
+ * @param th 
+ */
+static void sweepDeadEvents(timerHandle_t *th)
+{
+    timerEvent_t **pp = &th->events;
+    timerEvent_t  *curr;
+
+    while((curr = *pp) != NULL)
+    {
+        if(curr->func == NULL)
+        {
+            *pp = curr->next;
+            free(curr);
+        }
+        else
+        {
+            pp = &curr->next;
+        }
+    }
+}
+
 void mTimer_executeExpireEvents(void *handle)
 {
     timerHandle_t  *th = (timerHandle_t *)handle;
-    timerEvent_t   *curr, *tmp;
+    timerEvent_t   *curr;
     struct timeval  tv;
 
     getTimeval(&tv);
     curr = th->events;
+    th->executing = 1;
 
     DPRINTF("call mTimer_executeExpireEvents at %d\n", tv.tv_sec);
     while (curr != NULL)
     {
         struct timeval eventTv;
 
-        tmp = curr->next;
+        if(curr->func == NULL)
+        {
+            curr = curr->next;
+            continue;
+        }
 
         eventTv = tvAdd(&curr->lastTime, curr->interval);
         
@@ -257,19 +318,28 @@ void mTimer_executeExpireEvents(void *handle)
                   curr->name, curr->func, curr->ctxArg);
         
             (curr->func)(curr->ctxArg);
-            
-            if(--curr->count == 0)
-            {                
-                mTimer_delete(handle, curr->func, curr->ctxArg);
-                th->number--;
-            }
 
-            curr->lastTime = eventTv;
-            DPRINTF("update lastTime to %d\n", curr->lastTime.tv_sec);
+            /* the callback may have deleted its own event */
+            if(curr->func != NULL)
+            {
+                if(--curr->count == 0)
+                {
+                    curr->func = NULL;
+                    th->number--;
+                }
+                else
+                {
+                    curr->lastTime = eventTv;
+                    DPRINTF("update lastTime to %d\n", curr->lastTime.tv_sec);
+                }
+            }
         }
         
-        curr = tmp;
+        curr = curr->next;
     }
 
+    th->executing = 0;
+    sweepDeadEvents(th);
+
     return;
 }
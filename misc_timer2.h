@@ -26,6 +26,17 @@ void mTimer_cleanup(void **handle);
 int mTimer_add(void *handle, eventFunc_t func, void *ctxArg,
                int interval, int count, const char *name);
 
+/** 
+ * Delete a timer event, safe to be called from a timer callback.
+ * 
+ * @param handle 
+ * @param func 
+ * @param ctxArg 
+ * 
+ * @return 0 on success, -1 if there are no events
+ */
+int mTimer_delete(void *handle, eventFunc_t func, void *ctxArg);
+
 void mTimer_executeExpireEvents(void *handle);
 
 #endif
@@ -11,65 +11,120 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "misc_util.h"
+#include "misc_spawn.h"
 
 #define CMDSZ 1024
-#define BUFSZ PIPE_BUF
+
+#define CONSOLE_DEV       "/dev/console"
+#define CONSOLE_RING_DEF  16384
+
+#define O_FILE              "/tmp/debug"
+#define DEBUG_LINE_MAX      1024            /* formatted on the stack up to */
+#define DEBUG_FLUSH_DEF     4096            /* bytes */
+#define DEBUG_MAX_SIZE_DEF  (1024 * 1024)   /* bytes */
+
+/**
+ * Byte ring drained by a writer thread. Producers copy whole messages
+ * under the lock, so the writer can send everything pending in one
+ * writev() without splitting a message.
+ */
+typedef struct utilRing
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    char           *buf;
+    unsigned int    size;       /**< power of 2 */
+    unsigned int    head;       /**< free running write offset */
+    unsigned int    tail;       /**< free running read offset */
+    unsigned int    drops;      /**< messages dropped, ring full */
+    int             running;
+    int             fd;
+    pthread_t       thread;
+} utilRing_t;
+
+/*
+ * The emitters hold lock for reading while they use fd or ring, which
+ * change with it held for writing. fd is never closed once open: a new
+ * device is dup2()'ed over it, so the ring's writer follows.
+ */
+static struct
+{
+    pthread_rwlock_t lock;
+    volatile int     fd;        /**< opened on first use */
+    char             dev[PATH_MAX];
+    utilRing_t      *ring;      /**< async mode */
+} gbl_console = { PTHREAD_RWLOCK_INITIALIZER, -1, CONSOLE_DEV, NULL };
+
+/**
+ * Debug file appender: lines are formatted on the caller's stack,
+ * then appended in order to a shared batch written with one writev()
+ * when it fills up or gets older than the period.
+ */
+static struct
+{
+    pthread_mutex_t    lock;
+    int                fd;              /**< -1 until opened */
+    char              *batch;
+    int                len;
+    int                flushSize;
+    int                periodMs;        /**< 0 writes every line through */
+    long               maxSize;         /**< truncate beyond, 0 for no limit */
+    long               size;            /**< file size, as far as we know */
+    unsigned long long firstMs;         /**< time of the oldest pending line */
+} gbl_debug = { PTHREAD_MUTEX_INITIALIZER, -1 };
 
 void misc_pipeCmd(char *command, char **output)
 {
-    FILE *fp;
-    char buf[BUFSZ];
-    int len;
+    miscSpawnResult_t res;
 
-    *output = malloc(1);
-    strcpy(*output, "");
-    
-    if((fp = popen(command, "r")) == NULL)
-        return;
-    
-    while((fgets(buf, BUFSZ, fp)) != NULL)
+    if(misc_spawnShell(command, NULL, &res) != 0)
     {
-        len = strlen(*output) + strlen(buf);
-        if((*output = realloc(*output, (sizeof(char) * (len+1)))) == NULL)
-            return;
-        strcat(*output, buf);
+        /* callers always get a string to free */
+        if((*output = malloc(1)) != NULL)
+            (*output)[0] = '\0';
+        return;
     }
-    
-    pclose(fp);
+
+    *output = res.output;
 }
 
 int misc_pipeCmd_ex(const char *cmd, char *output, int maxlen)
 {
-  FILE *fp;
-  char buf[512];
-  int len = 0;
+    miscSpawnResult_t res;
+    miscSpawnOpts_t opts;
+    int len;
 
-  output[0] = '\0';
-  if ((fp = popen(cmd, "r")) == NULL)
-	return -1;
+    output[0] = '\0';
 
-  while ((fgets(buf, sizeof(buf), fp)) != NULL) {
-    int left = maxlen - len;
-	len += snprintf(output + len, left, "%s", buf);
-  }
+    memset(&opts, 0, sizeof(opts));
+    opts.maxOutput = maxlen - 1;
+    if(maxlen <= 1 || misc_spawnShell(cmd, &opts, &res) != 0)
+        return -1;
 
-  pclose(fp);
+    len = res.len;
+    memcpy(output, res.output, len + 1);
+    misc_spawnResultFree(&res);
 
-  return len;
+    return len;
 }
 
 void misc_system(const char *format, ...)
 {
 	char buf[CMDSZ] = "";
+	char *argv[] = { "/bin/sh", "-c", buf, NULL };
 	va_list arg;
 
 	va_start(arg, format);
 	vsnprintf(buf, sizeof(buf), format, arg);
 	va_end(arg);
 
-	system(buf);
+	/* like system(), without fork()ing the whole caller */
+	misc_spawnv(argv);
 	usleep(1);
 }
 
@@ -98,40 +153,456 @@ void misc_procEp(char *pidfile)
 	}
 }
 
-void misc_printFile(char *format, ...)
+static unsigned long long utilNowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void debugAtExit(void)
+{
+    misc_debugFileFlush();
+}
+
+/* write the batch and the extra line, with the lock held */
+static int debugWrite(const char *line, int len)
+{
+    struct iovec iov[2];
+    struct stat st;
+    ssize_t n;
+    int cnt = 0;
+
+    if(gbl_debug.len > 0)
+    {
+        iov[cnt].iov_base = gbl_debug.batch;
+        iov[cnt++].iov_len = gbl_debug.len;
+    }
+    if(len > 0)
+    {
+        iov[cnt].iov_base = (void *)line;
+        iov[cnt++].iov_len = len;
+    }
+    if(cnt == 0)
+        return 0;
+
+    /* other processes append too, check the real size before cutting */
+    if(gbl_debug.maxSize > 0 &&
+       gbl_debug.size + gbl_debug.len + len > gbl_debug.maxSize)
+    {
+        if(fstat(gbl_debug.fd, &st) == 0)
+            gbl_debug.size = st.st_size;
+        if(gbl_debug.size + gbl_debug.len + len > gbl_debug.maxSize &&
+           ftruncate(gbl_debug.fd, 0) == 0)
+            gbl_debug.size = 0;
+    }
+
+    while((n = writev(gbl_debug.fd, iov, cnt)) < 0 && errno == EINTR)
+        ;
+
+    gbl_debug.len = 0;
+    if(n < 0)
+        return -1;
+    gbl_debug.size += n;
+
+    return 0;
+}
+
+int misc_debugFileOpen(const char *path, int flushSize, int periodMs, long maxSize)
+{
+    int fd;
+    struct stat st;
+    char *batch = NULL;
+
+    fd = open(path != NULL ? path : O_FILE,
+              O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return -1;
+
+    if(flushSize < 0)
+        flushSize = DEBUG_FLUSH_DEF;
+    if(flushSize > 0 && (batch = malloc(flushSize)) == NULL)
+    {
+        perror("malloc");
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&gbl_debug.lock);
+
+    if(gbl_debug.fd >= 0)
+    {
+        debugWrite(NULL, 0);
+        close(gbl_debug.fd);
+    }
+    else
+        atexit(debugAtExit);
+
+    free(gbl_debug.batch);
+    gbl_debug.fd = fd;
+    gbl_debug.batch = batch;
+    gbl_debug.len = 0;
+    gbl_debug.flushSize = flushSize;
+    /* batching is asked for: a crash loses the pending lines */
+    gbl_debug.periodMs = periodMs < 0 ? 0 : periodMs;
+    gbl_debug.maxSize = maxSize < 0 ? DEBUG_MAX_SIZE_DEF : maxSize;
+    gbl_debug.size = fstat(fd, &st) == 0 ? st.st_size : 0;
+
+    pthread_mutex_unlock(&gbl_debug.lock);
+
+    return 0;
+}
+
+int misc_vdebugFilePrint(const char *format, va_list args)
+{
+    char buf[DEBUG_LINE_MAX], *line = buf;
+    unsigned long long now;
+    va_list copy;
+    int len, ret = 0;
+
+    if(gbl_debug.fd < 0 && misc_debugFileOpen(NULL, -1, -1, -1) != 0)
+        return -1;
+
+    /* format outside of the lock, on the heap only for long lines */
+    va_copy(copy, args);
+    len = vsnprintf(buf, sizeof(buf) - 1, format, args);
+    if(len < 0)
+    {
+        va_end(copy);
+        return -1;
+    }
+    if(len > (int)sizeof(buf) - 2)
+    {
+        if((line = malloc(len + 2)) == NULL)
+        {
+            va_end(copy);
+            return -1;
+        }
+        vsnprintf(line, len + 1, format, copy);
+    }
+    va_end(copy);
+    line[len++] = '\n';
+
+    now = utilNowMs();
+
+    pthread_mutex_lock(&gbl_debug.lock);
+
+    if(gbl_debug.len > 0 && gbl_debug.periodMs > 0 &&
+       now - gbl_debug.firstMs >= (unsigned long long)gbl_debug.periodMs)
+        ret = debugWrite(NULL, 0);
+
+    if(gbl_debug.periodMs == 0 || gbl_debug.len + len > gbl_debug.flushSize)
+        ret = debugWrite(line, len);
+    else
+    {
+        if(gbl_debug.len == 0)
+            gbl_debug.firstMs = now;
+        memcpy(gbl_debug.batch + gbl_debug.len, line, len);
+        gbl_debug.len += len;
+    }
+
+    pthread_mutex_unlock(&gbl_debug.lock);
+
+    if(line != buf)
+        free(line);
+
+    return ret;
+}
+
+int misc_debugFilePrint(const char *format, ...)
 {
     va_list args;
-    FILE *fp;
+    int ret;
+
+    va_start(args, format);
+    ret = misc_vdebugFilePrint(format, args);
+    va_end(args);
+
+    return ret;
+}
+
+int misc_debugFileFlush(void)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&gbl_debug.lock);
+    if(gbl_debug.fd >= 0)
+        ret = debugWrite(NULL, 0);
+    pthread_mutex_unlock(&gbl_debug.lock);
+
+    return ret;
+}
 
-#define O_FILE "/tmp/debug"
+void misc_debugFileClose(void)
+{
+    pthread_mutex_lock(&gbl_debug.lock);
+    if(gbl_debug.fd >= 0)
+    {
+        debugWrite(NULL, 0);
+        close(gbl_debug.fd);
+        gbl_debug.fd = -1;
+    }
+    free(gbl_debug.batch);
+    gbl_debug.batch = NULL;
+    pthread_mutex_unlock(&gbl_debug.lock);
+}
 
-    fp = fopen(O_FILE,"a+");
-    if(!fp) return;
+void misc_printFile(char *format, ...)
+{
+    va_list args;
 
     va_start(args, format);
-    vfprintf(fp, format, args);
+    misc_vdebugFilePrint(format, args);
     va_end(args);
-    fprintf(fp, "\n");
-    fflush(fp);
-    fclose(fp);
+}
+
+static void *utilRingWriter(void *arg)
+{
+    utilRing_t *ring = (utilRing_t *)arg;
+    struct iovec iov[2];
+    unsigned int from, len;
+    ssize_t n;
+    int cnt;
+
+    pthread_mutex_lock(&ring->lock);
+    while(1)
+    {
+        while(ring->running && ring->head == ring->tail)
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        if(ring->head == ring->tail)
+            break;
+
+        /* everything pending, in two pieces if it wraps */
+        from = ring->tail & (ring->size - 1);
+        len = ring->head - ring->tail;
+        iov[0].iov_base = ring->buf + from;
+        iov[0].iov_len = len;
+        cnt = 1;
+        if(from + len > ring->size)
+        {
+            iov[0].iov_len = ring->size - from;
+            iov[1].iov_base = ring->buf;
+            iov[1].iov_len = len - iov[0].iov_len;
+            cnt = 2;
+        }
+        pthread_mutex_unlock(&ring->lock);
+
+        n = writev(ring->fd, iov, cnt);
+
+        pthread_mutex_lock(&ring->lock);
+        if(n < 0 && errno == EINTR)
+            continue;
+        /* on error the data is dropped rather than retried forever */
+        ring->tail += n > 0 ? (unsigned int)n : len;
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    return NULL;
+}
+
+static utilRing_t *utilRingStart(int fd, unsigned int size)
+{
+    utilRing_t *ring;
+    unsigned int sz = 1024;
+
+    while(sz < size)
+        sz <<= 1;
+
+    if((ring = calloc(1, sizeof(utilRing_t))) == NULL ||
+       (ring->buf = malloc(sz)) == NULL)
+    {
+        perror("malloc");
+        free(ring);
+        return NULL;
+    }
+    ring->size = sz;
+    ring->fd = fd;
+    ring->running = 1;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+
+    if(pthread_create(&ring->thread, NULL, utilRingWriter, ring) != 0)
+    {
+        perror("pthread_create");
+        free(ring->buf);
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+/* drain what is queued, then stop the writer */
+static void utilRingStop(utilRing_t *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->running = 0;
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+
+    pthread_join(ring->thread, NULL);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->cond);
+    free(ring->buf);
+    free(ring);
+}
+
+/* queue one message, never blocks on the device */
+static int utilRingPut(utilRing_t *ring, const char *msg, unsigned int len)
+{
+    unsigned int from, first;
+
+    pthread_mutex_lock(&ring->lock);
+    if(ring->size - (ring->head - ring->tail) < len)
+    {
+        ring->drops++;
+        pthread_mutex_unlock(&ring->lock);
+        return -1;
+    }
+
+    from = ring->head & (ring->size - 1);
+    first = ring->size - from < len ? ring->size - from : len;
+    memcpy(ring->buf + from, msg, first);
+    memcpy(ring->buf, msg + first, len - first);
+    ring->head += len;
+
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+
+    return 0;
+}
+
+/* with lock held, for reading at least */
+static int consoleFd(void)
+{
+    int fd = gbl_console.fd;
+
+    if(fd >= 0)
+        return fd;
+
+    fd = open(gbl_console.dev, O_WRONLY | O_NOCTTY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    /* another thread may have won the race */
+    if(!__sync_bool_compare_and_swap(&gbl_console.fd, -1, fd))
+    {
+        close(fd);
+        fd = gbl_console.fd;
+    }
+
+    return fd;
+}
+
+int misc_consoleSetDevice(const char *path)
+{
+    int fd, ret = 0;
+
+    pthread_rwlock_wrlock(&gbl_console.lock);
+    strncpy(gbl_console.dev, path, sizeof(gbl_console.dev) - 1);
+    if(gbl_console.fd < 0)
+        ret = consoleFd() < 0 ? -1 : 0;
+    else if((fd = open(path, O_WRONLY | O_NOCTTY | O_CLOEXEC)) < 0)
+        ret = -1;
+    else
+    {
+        /* same fd number, the ring's writer may be in writev() on it */
+        if(dup2(fd, gbl_console.fd) < 0)
+            ret = -1;
+        else
+            fcntl(gbl_console.fd, F_SETFD, FD_CLOEXEC);
+        close(fd);
+    }
+    pthread_rwlock_unlock(&gbl_console.lock);
+
+    return ret;
+}
+
+int misc_consoleWrite(const char *msg, int len)
+{
+    int fd, ret = 0;
+
+    pthread_rwlock_rdlock(&gbl_console.lock);
+    if(gbl_console.ring != NULL)
+        ret = utilRingPut(gbl_console.ring, msg, len);
+    else if((fd = consoleFd()) < 0)
+        ret = -1;
+    else
+    {
+        /* one write() per message, the tty never interleaves two of them */
+        while(write(fd, msg, len) < 0)
+        {
+            if(errno != EINTR)
+            {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&gbl_console.lock);
+
+    return ret;
+}
+
+int misc_consoleAsync(int ringSize)
+{
+    int fd, ret = 0;
+
+    pthread_rwlock_wrlock(&gbl_console.lock);
+    if(gbl_console.ring == NULL)
+    {
+        if((fd = consoleFd()) < 0)
+            ret = -1;
+        else
+        {
+            gbl_console.ring = utilRingStart(fd, ringSize > 0 ? ringSize : CONSOLE_RING_DEF);
+            ret = gbl_console.ring != NULL ? 0 : -1;
+        }
+    }
+    pthread_rwlock_unlock(&gbl_console.lock);
+
+    return ret;
+}
+
+unsigned int misc_consoleSync(void)
+{
+    utilRing_t *ring;
+    unsigned int drops;
+
+    /* once unlocked, no emitter can still be in the ring */
+    pthread_rwlock_wrlock(&gbl_console.lock);
+    ring = gbl_console.ring;
+    gbl_console.ring = NULL;
+    pthread_rwlock_unlock(&gbl_console.lock);
+
+    if(ring == NULL)
+        return 0;
+
+    drops = ring->drops;
+    utilRingStop(ring);
+
+    return drops;
 }
 
 void misc_printConsole(const char *format, ...)
 {
     char buf[CMDSZ];
-    char buf2[CMDSZ];
     va_list arg;
-        
-    memset(buf, '\0', sizeof(buf));
-    memset(buf2, '\0', sizeof(buf2));
+    int len;
+
     va_start(arg, format);
-    vsnprintf(buf, sizeof(buf), format, arg);
+    len = vsnprintf(buf, sizeof(buf) - 1, format, arg);
     va_end(arg);
 
-    sprintf(buf2, "/bin/echo \"%s\" > /dev/console", buf);
+    if(len < 0)
+        return;
+    if(len > (int)sizeof(buf) - 2)
+        len = sizeof(buf) - 2;
+    buf[len++] = '\n';
 
-    system(buf2);
-    usleep(1);
+    misc_consoleWrite(buf, len);
 }
 
 int misc_isNullStr(const char *str)
@@ -165,3 +636,85 @@ int misc_selSleep(int sec)
 
     return 0;
 }
+
+static unsigned long long utilNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int misc_periodicInit(miscPeriodic_t *per, unsigned int periodUs)
+{
+    if(periodUs == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(per, 0, sizeof(*per));
+    per->periodNs = (unsigned long long)periodUs * 1000;
+    per->nextNs = utilNowNs() + per->periodNs;
+
+    return 0;
+}
+
+int misc_periodicWait(miscPeriodic_t *per)
+{
+    struct timespec ts;
+    unsigned long long now;
+    long long late;
+    int missed = 0, err;
+
+    now = utilNowNs();
+    if(now >= per->nextNs + per->periodNs)
+    {
+        /* the body took longer than a period: skip the missed
+         * deadlines rather than run a burst to catch up */
+        missed = (now - per->nextNs) / per->periodNs;
+        per->nextNs += (unsigned long long)missed * per->periodNs;
+        per->overruns += missed;
+    }
+
+    ts.tv_sec = per->nextNs / 1000000000ULL;
+    ts.tv_nsec = per->nextNs % 1000000000ULL;
+    while((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) == EINTR)
+        ;
+    if(err != 0)
+    {
+        errno = err;
+        perror("clock_nanosleep");
+        return -1;
+    }
+
+    late = utilNowNs() - per->nextNs;
+    if(per->runs == 0 || late < per->jitterMinNs)
+        per->jitterMinNs = late;
+    if(per->runs == 0 || late > per->jitterMaxNs)
+        per->jitterMaxNs = late;
+    per->jitterSumNs += late;
+    per->runs++;
+
+    per->nextNs += per->periodNs;
+
+    return missed;
+}
+
+int misc_periodicRun(unsigned int periodUs, miscPeriodicFunc_t func, void *ctxArg)
+{
+    miscPeriodic_t per;
+    int ret;
+
+    if(misc_periodicInit(&per, periodUs) != 0)
+        return -1;
+
+    for(;;)
+    {
+        if(misc_periodicWait(&per) < 0)
+            return -1;
+        if((ret = func(&per, ctxArg)) != 0)
+            return ret;
+    }
+}
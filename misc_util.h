@@ -1,7 +1,20 @@
 #ifndef _MISC_UTIL_H_
 #define _MISC_UTIL_H_
 
+#include <stdarg.h>
+
+/** 
+ * Run a shell command and return its whole output, malloc'ed, the
+ * caller frees it. An empty string if the command can't be run.
+ */
 void misc_pipeCmd(char *command, char **output);
+
+/** 
+ * Run a shell command, keep at most maxlen - 1 bytes of its output.
+ * 
+ * @return output length, -1 on error
+ */
+int misc_pipeCmd_ex(const char *cmd, char *output, int maxlen);
 void misc_system(const char *format, ...);
 
 /** 
@@ -12,10 +25,144 @@ void misc_system(const char *format, ...);
  */
 void misc_procEp(char *pidfile);
 
+/** 
+ * Append a line to the debug file (/tmp/debug unless
+ * misc_debugFileOpen() chose another one), see misc_debugFilePrint().
+ */
 void misc_printFile(char *format, ...);
+
+/** 
+ * Open or reopen the debug file. The file stays open. By default
+ * every line is written at once; with a periodMs, lines are batched
+ * and written with one writev() once flushSize bytes are pending or
+ * the oldest pending line is periodMs old (checked when the next line
+ * comes, call misc_debugFileFlush() from a timer for idle periods).
+ * The batch is also written at exit, but lost on a crash or _exit().
+ * 
+ * @param path NULL for /tmp/debug
+ * @param flushSize batch size, -1 for 4KB
+ * @param periodMs batching period, -1 or 0 writes every line at once
+ * @param maxSize the file is truncated rather than grow beyond, 0
+ * for no limit, -1 for 1MB
+ * 
+ * @return 0 on success, -1 on error
+ */
+int misc_debugFileOpen(const char *path, int flushSize, int periodMs, long maxSize);
+
+/** 
+ * printf a line to the debug file, opened with the defaults if
+ * needed. Safe from several threads, lines keep their order.
+ * 
+ * @return 0 on success, -1 on error
+ */
+int misc_debugFilePrint(const char *format, ...);
+
+int misc_vdebugFilePrint(const char *format, va_list args);
+
+/** 
+ * Write the pending lines.
+ */
+int misc_debugFileFlush(void);
+
+void misc_debugFileClose(void);
+
+/** 
+ * Print a line on the console, formatted like printf. The console is
+ * kept open and each line is a single write(), so lines of concurrent
+ * threads never mix.
+ */
 void misc_printConsole(const char *format, ...);
+
+/** 
+ * Write a raw message on the console, see misc_printConsole().
+ * 
+ * @return 0 on success, -1 on error or if the async ring is full
+ */
+int misc_consoleWrite(const char *msg, int len);
+
+/** 
+ * Use another device than /dev/console, e.g. /dev/ttyS0. Safe while
+ * other threads print, async mode included.
+ * 
+ * @return 0 if it could be opened, -1 otherwise (the previous device
+ * stays in use)
+ */
+int misc_consoleSetDevice(const char *path);
+
+/** 
+ * Queue console messages in a ring written by a thread, a slow serial
+ * console then never blocks the callers. Messages are dropped when
+ * the ring is full.
+ * 
+ * @param ringSize bytes, 0 for 16KB
+ * 
+ * @return 0 on success, -1 on error
+ */
+int misc_consoleAsync(int ringSize);
+
+/** 
+ * Write what is queued and go back to direct writes, e.g. at exit.
+ * 
+ * @return number of messages dropped while async
+ */
+unsigned int misc_consoleSync(void);
 int misc_isNullStr(const char *str);
 
+/** 
+ * Sleep for sec seconds, see misc_periodicWait() for loops.
+ */
+int misc_selSleep(int sec);
+
+/** 
+ * Fixed rate loop: the deadlines are absolute (CLOCK_MONOTONIC), so
+ * the time spent in the loop body does not shift the next ones.
+ * 
+ *     miscPeriodic_t per;
+ * 
+ *     misc_periodicInit(&per, 500);
+ *     while(misc_periodicWait(&per) >= 0)
+ *         poll_something();
+ * 
+ * The fields are the stats, read them from the loop body. Jitter is
+ * how late the wake up was after its deadline.
+ */
+typedef struct miscPeriodic
+{
+    unsigned long long periodNs;
+    unsigned long long nextNs;      /**< next deadline */
+    unsigned long long runs;        /**< deadlines met or late */
+    unsigned long long overruns;    /**< deadlines skipped, body too slow */
+    long long          jitterMinNs;
+    long long          jitterMaxNs;
+    long long          jitterSumNs; /**< mean is jitterSumNs / runs */
+} miscPeriodic_t;
+
+/** 
+ * @param per 
+ * @param periodUs the first deadline is one period from now
+ * 
+ * @return 0 on success, -1 if periodUs is 0
+ */
+int misc_periodicInit(miscPeriodic_t *per, unsigned int periodUs);
+
+/** 
+ * Sleep until the next deadline. If deadlines already passed, they are
+ * skipped and counted in overruns instead of being run back to back.
+ * 
+ * @return number of deadlines skipped, -1 on error
+ */
+int misc_periodicWait(miscPeriodic_t *per);
+
+/** @return 0 to keep going, anything else stops misc_periodicRun() */
+typedef int (*miscPeriodicFunc_t)(miscPeriodic_t *per, void *ctxArg);
+
+/** 
+ * Call func every periodUs until it returns non zero.
+ * 
+ * @return func's return value, -1 on error
+ */
+int misc_periodicRun(unsigned int periodUs, miscPeriodicFunc_t func, void *ctxArg);
+
 #define SYSTEM misc_system
 
 #endif
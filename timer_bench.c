@@ -0,0 +1,545 @@
+/**
+ * @file   timer_bench.c
+ *
+ * @brief  Benchmark and soak test for the timer engines.
+ *
+ * Every engine is driven through the same benchEngine_t table and
+ * the same workload, so a new engine (wheel, heap ...) only needs an
+ * entry in gbl_engines[] to be compared with the existing ones.
+ *
+ *   timer_bench [-n max] [-s soakSec] [-l liveTimers] [-r seed] [-e engine]
+ *
+ * For N = 1000, 10000 ... max the bench measures:
+ *   - add throughput with random deadlines
+ *   - cancel throughput in random order
+ *   - expire throughput, all N timers due in one execute call
+ *   - worst execute call when the same backlog is drained with a
+ *     per call budget (engines supporting timer_setBudget())
+ *   - heap bytes and RSS per timer
+ *   - expiry lateness (actual - scheduled) as a log2 histogram
+ *
+ * The soak mode keeps a set of live timers for several seconds, the
+ * callbacks randomly re-add themselves and cancel/re-add other timers,
+ * and every fire is checked against the expected live set.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "misc_timer.h"
+#include "misc_timer2.h"
+
+#define BENCH_MIN_TIMERS     1000
+#define BENCH_DEF_MAX        10000
+#define BENCH_HIST_BUCKETS   24
+#define BENCH_LATENESS_SPAN  1000   /* ms, deadline spread of the lateness run */
+#define BENCH_POLL_USEC      1000   /* sleep between execute calls */
+#define BENCH_BUDGET_EVENTS  100    /* callbacks per call in the budget run */
+
+typedef struct benchEngine
+{
+    const char *name;
+    int  (*init)(void **handle);
+    void (*cleanup)(void **handle);
+    int  (*add)(void *handle, event_func func, void *ctx, int ms, const char *name);
+    int  (*cancel)(void *handle, event_func func, void *ctx);
+    void (*expire)(void *handle);
+    void (*budget)(void *handle, int maxEvents, int maxUsec);
+    int  (*pending)(void *handle);
+} benchEngine_t;
+
+typedef struct benchTimer
+{
+    struct timeval due;         /**< scheduled expire time */
+    int            idx;
+    int            live;        /**< armed in the engine */
+} benchTimer_t;
+
+typedef struct benchHist
+{
+    unsigned long bucket[BENCH_HIST_BUCKETS]; /**< [i] counts lateness < 2^i us */
+    unsigned long early;                      /**< fired before the deadline */
+    long          max;
+    double        sum;
+    unsigned long count;
+} benchHist_t;
+
+static const benchEngine_t *gbl_engine;
+static void         *gbl_handle;
+static benchTimer_t *gbl_timers;
+static int           gbl_nTimers;
+static benchHist_t   gbl_hist;
+static unsigned long gbl_fired;
+static unsigned int  gbl_seed = 1;
+static int           gbl_stdout = -1;
+
+/* soak state */
+static int           gbl_soak;
+static unsigned long gbl_soakErrors, gbl_soakReadd, gbl_soakCancel;
+static unsigned long gbl_soakReaddFail;
+
+/* ----------------------------- engines ----------------------------------- */
+
+static int timer2Add(void *handle, event_func func, void *ctx, int ms,
+                     const char *name)
+{
+    return mTimer_add(handle, func, ctx, ms, 1, name);
+}
+
+static const benchEngine_t gbl_engines[] =
+{
+    { "sorted-list", timer_init, timer_cleanup, timer_event_add,
+      timer_event_delete, timer_execute_expire_events,
+      timer_setBudget, timer_hasExpired },
+    { "unsorted-list", mTimer_init, mTimer_cleanup, timer2Add,
+      mTimer_delete, mTimer_executeExpireEvents, NULL, NULL },
+};
+
+#define NUM_ENGINES (sizeof(gbl_engines) / sizeof(gbl_engines[0]))
+
+/* ----------------------------- helpers ----------------------------------- */
+
+static unsigned int benchRand(void)
+{
+    /* xorshift32, reproducible across libc's */
+    gbl_seed ^= gbl_seed << 13;
+    gbl_seed ^= gbl_seed >> 17;
+    gbl_seed ^= gbl_seed << 5;
+
+    return gbl_seed;
+}
+
+static double nowSec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long tvDiffUsec(const struct timeval *a, const struct timeval *b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000L + (a->tv_usec - b->tv_usec);
+}
+
+static void tvAddMs(struct timeval *tv, int ms)
+{
+    tv->tv_sec += ms / 1000;
+    tv->tv_usec += (ms % 1000) * 1000;
+    if(tv->tv_usec >= 1000000)
+    {
+        tv->tv_sec++;
+        tv->tv_usec -= 1000000;
+    }
+}
+
+static long heapInUse(void)
+{
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+    return (long)mallinfo2().uordblks;
+#else
+    return (long)mallinfo().uordblks;
+#endif
+}
+
+static long rssBytes(void)
+{
+    char buf[128];
+    long size = 0, rss = 0;
+    int fd, n;
+
+    if((fd = open("/proc/self/statm", O_RDONLY)) < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0)
+        return 0;
+    buf[n] = '\0';
+    sscanf(buf, "%ld %ld", &size, &rss);
+
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * The engines may print debug chatter to stdout, keep it out of the
+ * report while they run (the formatting cost is still measured).
+ */
+static void muteStdout(int mute)
+{
+    int fd;
+
+    fflush(stdout);
+    if(mute)
+    {
+        gbl_stdout = dup(1);
+        if((fd = open("/dev/null", O_WRONLY)) >= 0)
+        {
+            dup2(fd, 1);
+            close(fd);
+        }
+    }
+    else if(gbl_stdout >= 0)
+    {
+        dup2(gbl_stdout, 1);
+        close(gbl_stdout);
+        gbl_stdout = -1;
+    }
+}
+
+static void histAdd(benchHist_t *h, long lateUsec)
+{
+    int i;
+
+    if(lateUsec < 0)
+    {
+        h->early++;
+        lateUsec = 0;
+    }
+
+    for(i = 0; i < BENCH_HIST_BUCKETS - 1 && (1L << i) <= lateUsec; i++)
+        ;
+    h->bucket[i]++;
+    h->sum += lateUsec;
+    h->count++;
+    if(lateUsec > h->max)
+        h->max = lateUsec;
+}
+
+static void histPrint(const benchHist_t *h)
+{
+    unsigned long acc = 0;
+    int i;
+
+    if(h->count == 0)
+        return;
+
+    printf("    lateness: avg %.0fus max %ldus early %lu\n",
+           h->sum / h->count, h->max, h->early);
+    for(i = 0; i < BENCH_HIST_BUCKETS; i++)
+    {
+        if(h->bucket[i] == 0)
+            continue;
+        acc += h->bucket[i];
+        printf("      < %8ldus %8lu  %5.1f%%\n",
+               1L << i, h->bucket[i], 100.0 * acc / h->count);
+    }
+}
+
+/* ----------------------------- callbacks --------------------------------- */
+
+static void benchCallback(void *ctx)
+{
+    benchTimer_t *t = (benchTimer_t *)ctx;
+    benchTimer_t *other;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    histAdd(&gbl_hist, tvDiffUsec(&now, &t->due));
+    gbl_fired++;
+
+    if(!gbl_soak)
+        return;
+
+    if(!t->live)
+    {
+        /* canceled (or never armed) but still fired */
+        gbl_soakErrors++;
+    }
+    t->live = 0;
+
+    /* cancel a random other timer from the callback */
+    other = &gbl_timers[benchRand() % gbl_nTimers];
+    if(gbl_engine->cancel != NULL && other != t && other->live &&
+       (benchRand() & 3) == 0)
+    {
+        gbl_engine->cancel(gbl_handle, benchCallback, other);
+        other->live = 0;
+        gbl_soakCancel++;
+    }
+
+    /* and re-add ourselves, or the canceled one */
+    if(benchRand() & 1)
+    {
+        /*
+         * A running mTimer event stays linked until the walk is over,
+         * drop it first (marked dead, swept after the walk); the
+         * sorted list already unlinked it, the cancel finds nothing.
+         */
+        if(gbl_engine->cancel != NULL)
+            gbl_engine->cancel(gbl_handle, benchCallback, t);
+        t->due = now;
+        tvAddMs(&t->due, benchRand() % 50);
+        if(gbl_engine->add(gbl_handle, benchCallback, t,
+                           (int)(tvDiffUsec(&t->due, &now) / 1000), "soak") == 0)
+        {
+            t->live = 1;
+            gbl_soakReadd++;
+        }
+        else
+        {
+            gbl_soakReaddFail++;
+        }
+    }
+    if(!other->live && other != t)
+    {
+        gettimeofday(&other->due, NULL);
+        tvAddMs(&other->due, benchRand() % 50);
+        if(gbl_engine->add(gbl_handle, benchCallback, other,
+                           (int)(tvDiffUsec(&other->due, &now) / 1000),
+                           "soak") == 0)
+            other->live = 1;
+    }
+}
+
+static int addTimer(benchTimer_t *t, int ms)
+{
+    gettimeofday(&t->due, NULL);
+    tvAddMs(&t->due, ms);
+    t->live = 1;
+
+    return gbl_engine->add(gbl_handle, benchCallback, t, ms, "bench");
+}
+
+/* ----------------------------- benches ----------------------------------- */
+
+static void allocTimers(int n)
+{
+    int i;
+
+    gbl_timers = calloc(n, sizeof(benchTimer_t));
+    if(gbl_timers == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for(i = 0; i < n; i++)
+        gbl_timers[i].idx = i;
+    gbl_nTimers = n;
+}
+
+static void shuffle(int *order, int n)
+{
+    int i, j, tmp;
+
+    for(i = 0; i < n; i++)
+        order[i] = i;
+    for(i = n - 1; i > 0; i--)
+    {
+        j = benchRand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+static void benchSize(int n)
+{
+    double t0, tAdd, tCancel, tExpire;
+    long heap0, rss0, heapPer, rssPer;
+    int *order;
+    int i;
+
+    allocTimers(n);
+    order = malloc(n * sizeof(int));
+    shuffle(order, n);
+
+    /* add and cancel: deadlines far away so nothing expires */
+    gbl_engine->init(&gbl_handle);
+    heap0 = heapInUse();
+    rss0 = rssBytes();
+    muteStdout(1);
+    t0 = nowSec();
+    for(i = 0; i < n; i++)
+        addTimer(&gbl_timers[i], 60000 + benchRand() % 60000);
+    tAdd = nowSec() - t0;
+    muteStdout(0);
+    heapPer = (heapInUse() - heap0) / n;
+    rssPer = (rssBytes() - rss0) / n;
+
+    tCancel = 0;
+    if(gbl_engine->cancel != NULL)
+    {
+        muteStdout(1);
+        t0 = nowSec();
+        for(i = 0; i < n; i++)
+            gbl_engine->cancel(gbl_handle, benchCallback, &gbl_timers[order[i]]);
+        tCancel = nowSec() - t0;
+        muteStdout(0);
+    }
+    gbl_engine->cleanup(&gbl_handle);
+
+    /* expire: everything due at once, drained by one execute call */
+    memset(&gbl_hist, 0, sizeof(gbl_hist));
+    gbl_fired = 0;
+    gbl_engine->init(&gbl_handle);
+    muteStdout(1);
+    for(i = 0; i < n; i++)
+        addTimer(&gbl_timers[i], 0);
+    usleep(20000);
+    t0 = nowSec();
+    gbl_engine->expire(gbl_handle);
+    tExpire = nowSec() - t0;
+    muteStdout(0);
+    gbl_engine->cleanup(&gbl_handle);
+
+    printf("  N=%-8d add %10.0f/s  cancel %10.0f/s  expire %10.0f/s (%lu fired)\n",
+           n, n / tAdd, tCancel > 0 ? n / tCancel : 0.0,
+           gbl_fired ? gbl_fired / tExpire : 0.0, gbl_fired);
+    printf("    memory: heap %ld B/timer, rss %ld B/timer\n", heapPer, rssPer);
+
+    if(gbl_engine->budget != NULL)
+    {
+        double tCall, tMax = 0;
+        int calls = 0;
+
+        gbl_engine->init(&gbl_handle);
+        gbl_engine->budget(gbl_handle, BENCH_BUDGET_EVENTS, 0);
+        muteStdout(1);
+        for(i = 0; i < n; i++)
+            addTimer(&gbl_timers[i], 0);
+        usleep(20000);
+        do
+        {
+            t0 = nowSec();
+            gbl_engine->expire(gbl_handle);
+            tCall = nowSec() - t0;
+            if(tCall > tMax)
+                tMax = tCall;
+            calls++;
+        } while(gbl_engine->pending(gbl_handle));
+        muteStdout(0);
+        gbl_engine->cleanup(&gbl_handle);
+
+        printf("    budget %d/call: %d calls, worst call %.0fus (unbudgeted %.0fus)\n",
+               BENCH_BUDGET_EVENTS, calls, tMax * 1e6, tExpire * 1e6);
+    }
+
+    /* lateness: random deadlines, polled like an event loop would */
+    memset(&gbl_hist, 0, sizeof(gbl_hist));
+    gbl_fired = 0;
+    gbl_engine->init(&gbl_handle);
+    muteStdout(1);
+    for(i = 0; i < n; i++)
+        addTimer(&gbl_timers[i], benchRand() % BENCH_LATENESS_SPAN);
+    t0 = nowSec();
+    while(gbl_fired < (unsigned long)n &&
+          nowSec() - t0 < BENCH_LATENESS_SPAN / 1000.0 + 30)
+    {
+        gbl_engine->expire(gbl_handle);
+        usleep(BENCH_POLL_USEC);
+    }
+    muteStdout(0);
+    gbl_engine->cleanup(&gbl_handle);
+    histPrint(&gbl_hist);
+
+    free(order);
+    free(gbl_timers);
+}
+
+static void benchSoak(int live, int seconds)
+{
+    double t0;
+    int i;
+
+    allocTimers(live);
+    memset(&gbl_hist, 0, sizeof(gbl_hist));
+    gbl_fired = gbl_soakErrors = gbl_soakReadd = gbl_soakCancel = 0;
+    gbl_soakReaddFail = 0;
+    gbl_soak = 1;
+
+    gbl_engine->init(&gbl_handle);
+    muteStdout(1);
+    for(i = 0; i < live; i++)
+        addTimer(&gbl_timers[i], benchRand() % 50);
+
+    t0 = nowSec();
+    while(nowSec() - t0 < seconds)
+    {
+        gbl_engine->expire(gbl_handle);
+        usleep(BENCH_POLL_USEC);
+    }
+    muteStdout(0);
+    gbl_engine->cleanup(&gbl_handle);
+    gbl_soak = 0;
+
+    printf("  soak %ds, %d timers: fired %lu readd %lu (refused %lu) cancel %lu errors %lu\n",
+           seconds, live, gbl_fired, gbl_soakReadd, gbl_soakReaddFail,
+           gbl_soakCancel, gbl_soakErrors);
+    histPrint(&gbl_hist);
+
+    free(gbl_timers);
+}
+
+static void usage(const char *prog)
+{
+    unsigned int i;
+
+    fprintf(stderr,
+            "usage: %s [-n maxTimers] [-s soakSec] [-l liveTimers] [-r seed] [-e engine]\n"
+            "engines:", prog);
+    for(i = 0; i < NUM_ENGINES; i++)
+        fprintf(stderr, " %s", gbl_engines[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = NULL;
+    int maxTimers = BENCH_DEF_MAX, soakSec = 5, live = 1000;
+    unsigned int e;
+    int opt, n;
+
+    while((opt = getopt(argc, argv, "n:s:l:r:e:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': maxTimers = atoi(optarg); break;
+            case 's': soakSec = atoi(optarg); break;
+            case 'l': live = atoi(optarg); break;
+            case 'r': gbl_seed = strtoul(optarg, NULL, 0) | 1; break;
+            case 'e': only = optarg; break;
+            default:  usage(argv[0]);
+        }
+    }
+
+    for(e = 0; e < NUM_ENGINES; e++)
+    {
+        gbl_engine = &gbl_engines[e];
+        if(only != NULL && strcmp(only, gbl_engine->name) != 0)
+            continue;
+
+        printf("engine %s\n", gbl_engine->name);
+        for(n = BENCH_MIN_TIMERS; n <= maxTimers; n *= 10)
+            benchSize(n);
+        if(soakSec > 0 && live > 0)
+            benchSoak(live, soakSec);
+        fflush(stdout);
+    }
+
+    if(only == NULL || strcmp(only, gbl_engines[0].name) == 0)
+    {
+        /* per name statistics, from a short sorted-list run of its own */
+        gbl_engine = &gbl_engines[0];
+        gbl_engine->init(&gbl_handle);
+        allocTimers(100);
+        for(n = 0; n < 100; n++)
+            gbl_engine->add(gbl_handle, benchCallback, &gbl_timers[n],
+                            benchRand() % 20, (n & 1) ? "odd" : "even");
+        usleep(30000);
+        gbl_engine->expire(gbl_handle);
+        printf("sorted-list statistics\n");
+        fflush(stdout);
+        timer_dumpStats(gbl_handle, 1);
+        gbl_engine->cleanup(&gbl_handle);
+        free(gbl_timers);
+    }
+
+    return 0;
+}
@@ -0,0 +1,190 @@
+/**
+ * @file   udp_bench.c
+ *
+ * @brief  Loopback packets per second of one sendto()/recvfrom() per
+ *         datagram against the batched misc_udp API.
+ *
+ *   udp_bench [-n packets] [-s size] [-b batch]
+ *
+ * The sender and the receiver run in the same thread: a burst of
+ * batch datagrams is sent, then drained from the receive socket, so
+ * the figures are the syscall cost of both sides together. Modes:
+ *   - single:  sendto() + recvfrom() per datagram
+ *   - mmsg:    misc_udpQueue()/misc_udpFlush() + misc_udpRecv()
+ *   - gso:     misc_udpSendSegmented(), one send per burst, + misc_udpRecv()
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "misc_net.h"
+
+#define BENCH_DEF_PACKETS  1000000
+#define BENCH_DEF_SIZE     64
+#define BENCH_DEF_BATCH    32
+#define BENCH_RCVBUF       (4 << 20)
+
+static struct sockaddr_in gbl_dst;
+static unsigned long gbl_received;
+
+static double benchNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int benchSocket(int bindIt)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int fd, rcvbuf = BENCH_RCVBUF;
+
+    if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+    if(!bindIt)
+        return fd;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+       getsockname(fd, (struct sockaddr *)&gbl_dst, &len) != 0)
+    {
+        perror("bind");
+        exit(1);
+    }
+
+    return fd;
+}
+
+static void benchCount(const unsigned char *data, int len,
+                       const struct sockaddr *from, socklen_t fromLen,
+                       void *ctxArg)
+{
+    gbl_received++;
+}
+
+static void benchReport(const char *mode, int packets, double elapsed)
+{
+    printf("  %-8s %10.0f pkt/s  received %lu/%d\n",
+           mode, gbl_received / elapsed, gbl_received, packets);
+}
+
+static void benchSingle(int packets, int size, int batch)
+{
+    unsigned char buf[65536];
+    int tx, rx, sent, i;
+    double start;
+
+    memset(buf, 0x5a, size);
+    tx = benchSocket(0);
+    rx = benchSocket(1);
+    gbl_received = 0;
+
+    start = benchNow();
+    for(sent = 0; sent < packets; sent += batch)
+    {
+        for(i = 0; i < batch; i++)
+            sendto(tx, buf, size, 0, (struct sockaddr *)&gbl_dst, sizeof(gbl_dst));
+        for(i = 0; i < batch; i++)
+        {
+            if(recvfrom(rx, buf, sizeof(buf), MSG_DONTWAIT, NULL, NULL) < 0)
+                break;
+            gbl_received++;
+        }
+    }
+    benchReport("single", packets, benchNow() - start);
+
+    close(tx);
+    close(rx);
+}
+
+static void benchBatch(int packets, int size, int batch, int gso)
+{
+    unsigned char *buf;
+    void *txh, *rxh;
+    int tx, rx, sent, i;
+    double start;
+
+    buf = malloc(size * batch);
+    memset(buf, 0x5a, size * batch);
+    tx = benchSocket(0);
+    rx = benchSocket(1);
+    if(misc_udpInit(&txh, tx, batch, size) != 0 ||
+       misc_udpInit(&rxh, rx, batch, size) != 0)
+        exit(1);
+    gbl_received = 0;
+
+    start = benchNow();
+    for(sent = 0; sent < packets; sent += batch)
+    {
+        if(gso)
+        {
+            misc_udpSendSegmented(txh, buf, size * batch, size,
+                                  (struct sockaddr *)&gbl_dst, sizeof(gbl_dst));
+        }
+        else
+        {
+            for(i = 0; i < batch; i++)
+                misc_udpQueue(txh, buf + i * size, size,
+                              (struct sockaddr *)&gbl_dst, sizeof(gbl_dst));
+            misc_udpFlush(txh);
+        }
+        misc_udpRecv(rxh, benchCount, NULL);
+    }
+    benchReport(gso ? "gso" : "mmsg", packets, benchNow() - start);
+
+    misc_udpCleanup(&txh);
+    misc_udpCleanup(&rxh);
+    close(tx);
+    close(rx);
+    free(buf);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n packets] [-s size] [-b batch]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int packets = BENCH_DEF_PACKETS, size = BENCH_DEF_SIZE;
+    int batch = BENCH_DEF_BATCH;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:s:b:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': packets = atoi(optarg); break;
+            case 's': size = atoi(optarg); break;
+            case 'b': batch = atoi(optarg); break;
+            default:  usage(argv[0]);
+        }
+    }
+    if(packets <= 0 || size <= 0 || size > 1472 || batch <= 0 || batch > 64)
+        usage(argv[0]);
+
+    printf("loopback, %d datagrams of %d bytes, bursts of %d\n",
+           packets, size, batch);
+    benchSingle(packets, size, batch);
+    benchBatch(packets, size, batch, 0);
+    benchBatch(packets, size, batch, 1);
+
+    return 0;
+}